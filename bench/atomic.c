@@ -0,0 +1,59 @@
+// Updates shared atomic counters, reference counts and flag words
+// from several threads at once. Prints a checksum, which must not
+// depend on the compiler or on scheduling, and the elapsed time.
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+
+#define NTHREADS 4
+#define ITERS 2000000
+
+static _Atomic int counter;
+static _Atomic long refcount;
+static _Atomic unsigned flags;
+static _Atomic long total;
+static long released[NTHREADS];
+
+static void *worker(void *arg) {
+  int id = (long)arg;
+  long n = 0;
+
+  for (int i = 0; i < ITERS; i++) {
+    counter++;
+    refcount += 2;
+    n += atomic_fetch_sub(&refcount, 1) >= 2;
+    refcount--;
+    flags |= 1u << ((i + id) & 31);
+    flags &= ~(1u << ((i + id + 16) & 31));
+    atomic_fetch_add(&total, i & 7);
+  }
+
+  released[id] = n;
+  return NULL;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main() {
+  pthread_t thr[NTHREADS];
+  double start = now();
+
+  for (long i = 0; i < NTHREADS; i++)
+    pthread_create(&thr[i], NULL, worker, (void *)i);
+  for (int i = 0; i < NTHREADS; i++)
+    pthread_join(thr[i], NULL);
+
+  long sum = counter + refcount + total;
+  for (int i = 0; i < NTHREADS; i++)
+    sum += released[i];
+
+  printf("checksum %ld\n", sum);
+  printf("time %.3f s\n", now() - start);
+  return 0;
+}
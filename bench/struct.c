@@ -0,0 +1,72 @@
+// Copies, passes and returns structs of several sizes in a loop.
+// Prints a checksum, which must not depend on the compiler, and the
+// elapsed time.
+
+#include <stdio.h>
+#include <time.h>
+
+typedef struct { char c[7]; } S7;
+typedef struct { long l[4]; } S32;
+typedef struct { int i[32]; } S128;
+typedef struct { long l[32]; } S256;
+typedef struct { char c[1000]; } S1000;
+
+static S32 s32[64];
+static S128 s128[64];
+static S256 s256[64];
+static S1000 s1000[8];
+
+static S7 mk7(int x) {
+  S7 s = {{x, x + 1, x + 2}};
+  return s;
+}
+
+static long sum32(S32 s) { return s.l[0] + s.l[3]; }
+static long sum128(S128 s) { return s.i[0] + s.i[31]; }
+
+static S256 next256(S256 s) {
+  s.l[0]++;
+  s.l[31] += s.l[0];
+  return s;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main() {
+  for (int i = 0; i < 64; i++) {
+    s32[i].l[0] = i;
+    s128[i].i[31] = i;
+    s256[i].l[31] = i;
+  }
+
+  double start = now();
+  unsigned long sum = 0;
+
+  for (int n = 0; n < 200000; n++) {
+    int i = n & 63, j = (n * 7) & 63;
+
+    S7 a = mk7(n);
+    sum += a.c[2];
+
+    s32[j] = s32[i];
+    sum += sum32(s32[j]);
+
+    s128[j] = s128[i];
+    sum += sum128(s128[j]);
+
+    S256 b = next256(s256[i]);
+    s256[j] = b;
+    sum += b.l[31];
+
+    s1000[n & 7] = s1000[(n + 1) & 7];
+    sum += s1000[n & 7].c[999];
+  }
+
+  printf("checksum %lu\n", sum);
+  printf("time %.3f s\n", now() - start);
+  return 0;
+}
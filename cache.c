@@ -0,0 +1,569 @@
+// This file implements a content-addressed compilation cache.
+//
+// If $CHIBICC_CACHE_DIR is set, the compiler hashes the preprocessed
+// token stream of a translation unit together with everything else
+// that affects the generated code, and uses the hash as a key for the
+// resulting assembly and object files. If a translation unit hasn't
+// changed since it was last compiled, its output is copied from the
+// cache, and parse(), codegen() and the assembler are skipped.
+//
+// In "direct mode", the compiler also records a manifest of the
+// files the preprocessor read, with their content hashes, along with
+// the results of include path searches. The manifest is keyed by the
+// command line options that affect preprocessing. If the manifest is
+// still valid the next time the same translation unit is compiled,
+// the output is copied from the cache without even running the
+// preprocessor. Translation units that use __DATE__, __TIME__ or
+// __TIMESTAMP__ don't get a manifest.
+//
+// The cache size is limited by $CHIBICC_CACHE_SIZE (1 GiB by default;
+// K, M and G suffixes are allowed). Each hit updates the entry's
+// mtime, and if the cache grows beyond the limit, the least recently
+// used entries are removed. Hit and miss counts and the total size
+// are kept in a "stats" file, which also serves as a lock for
+// concurrent compiler processes.
+
+#include "chibicc.h"
+#include <fcntl.h>
+#include <sys/file.h>
+
+//
+// 128-bit hash function. The block function is from MurmurHash3.
+//
+
+typedef struct {
+  uint64_t h1;
+  uint64_t h2;
+  uint8_t buf[16];
+  int buflen;
+  uint64_t len;
+} Hash;
+
+static uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t fmix64(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccd;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53;
+  k ^= k >> 33;
+  return k;
+}
+
+static void hash_block(Hash *h, uint8_t *p, bool is_tail) {
+  uint64_t c1 = 0x87c37b91114253d5;
+  uint64_t c2 = 0x4cf5ad432745937f;
+  uint64_t k1, k2;
+  memcpy(&k1, p, 8);
+  memcpy(&k2, p + 8, 8);
+
+  k1 *= c1;
+  k1 = rotl64(k1, 31);
+  k1 *= c2;
+  h->h1 ^= k1;
+
+  k2 *= c2;
+  k2 = rotl64(k2, 33);
+  k2 *= c1;
+  h->h2 ^= k2;
+
+  if (is_tail)
+    return;
+
+  h->h1 = rotl64(h->h1, 27);
+  h->h1 += h->h2;
+  h->h1 = h->h1 * 5 + 0x52dce729;
+
+  h->h2 = rotl64(h->h2, 31);
+  h->h2 += h->h1;
+  h->h2 = h->h2 * 5 + 0x38495ab5;
+}
+
+static void hash_update(Hash *h, void *data, int len) {
+  uint8_t *p = data;
+  h->len += len;
+
+  while (len > 0) {
+    int n = MIN(len, 16 - h->buflen);
+    memcpy(h->buf + h->buflen, p, n);
+    h->buflen += n;
+    p += n;
+    len -= n;
+
+    if (h->buflen == 16) {
+      hash_block(h, h->buf, false);
+      h->buflen = 0;
+    }
+  }
+}
+
+static void hash_str(Hash *h, char *s) {
+  hash_update(h, s, strlen(s) + 1);
+}
+
+static void hash_int(Hash *h, int64_t val) {
+  hash_update(h, &val, sizeof(val));
+}
+
+// Returns a hash as a 32-character hexadecimal string.
+static char *hash_final(Hash *h) {
+  if (h->buflen > 0) {
+    memset(h->buf + h->buflen, 0, 16 - h->buflen);
+    hash_block(h, h->buf, true);
+  }
+
+  uint64_t h1 = h->h1 ^ h->len;
+  uint64_t h2 = h->h2 ^ h->len;
+  h1 += h2;
+  h2 += h1;
+  h1 = fmix64(h1);
+  h2 = fmix64(h2);
+  h1 += h2;
+  h2 += h1;
+  return format("%016lx%016lx", (unsigned long)h1, (unsigned long)h2);
+}
+
+//
+// Cache directory
+//
+
+typedef struct {
+  long hits;
+  long direct_hits;
+  long misses;
+  long size;
+} CacheStats;
+
+static char *cache_dir(void) {
+  char *dir = getenv("CHIBICC_CACHE_DIR");
+  return (dir && *dir) ? dir : NULL;
+}
+
+static long cache_limit(void) {
+  char *s = getenv("CHIBICC_CACHE_SIZE");
+  if (!s || !*s)
+    return 1L << 30;
+
+  char *end;
+  long val = strtol(s, &end, 10);
+  switch (*end) {
+  case 'k': case 'K': return val << 10;
+  case 'm': case 'M': return val << 20;
+  case 'g': case 'G': return val << 30;
+  }
+  return val;
+}
+
+static char *entry_path(char *key, char *extn) {
+  return format("%s/%.2s/%s%s", cache_dir(), key, key + 2, extn);
+}
+
+// Open and lock the stats file. Other compiler processes that
+// update the cache wait until it is closed.
+static FILE *lock_stats(CacheStats *st) {
+  mkdir(cache_dir(), 0755);
+
+  char *path = format("%s/stats", cache_dir());
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd == -1)
+    return NULL;
+  flock(fd, LOCK_EX);
+
+  FILE *fp = fdopen(fd, "r+");
+  *st = (CacheStats){};
+  if (fscanf(fp, "%ld %ld %ld %ld", &st->hits, &st->direct_hits,
+             &st->misses, &st->size) != 4)
+    *st = (CacheStats){};
+  return fp;
+}
+
+static void unlock_stats(FILE *fp, CacheStats *st) {
+  rewind(fp);
+  ftruncate(fileno(fp), 0);
+  fprintf(fp, "%ld %ld %ld %ld\n", st->hits, st->direct_hits, st->misses,
+          st->size);
+  fclose(fp);
+}
+
+typedef struct {
+  char *path;
+  long size;
+  struct timespec mtime;
+} CacheEntry;
+
+static int compare_mtime(const void *x, const void *y) {
+  const CacheEntry *a = x;
+  const CacheEntry *b = y;
+  if (a->mtime.tv_sec != b->mtime.tv_sec)
+    return a->mtime.tv_sec < b->mtime.tv_sec ? -1 : 1;
+  if (a->mtime.tv_nsec != b->mtime.tv_nsec)
+    return a->mtime.tv_nsec < b->mtime.tv_nsec ? -1 : 1;
+  return 0;
+}
+
+// Remove least recently used entries until the cache shrinks to 90%
+// of its size limit. The stats file must be locked.
+static void evict(CacheStats *st) {
+  glob_t buf = {};
+  glob(format("%s/[0-9a-f][0-9a-f]/*", cache_dir()), 0, NULL, &buf);
+
+  CacheEntry *ents = calloc(buf.gl_pathc + 1, sizeof(CacheEntry));
+  int n = 0;
+  long size = 0;
+
+  for (int i = 0; i < buf.gl_pathc; i++) {
+    struct stat s;
+    if (stat(buf.gl_pathv[i], &s))
+      continue;
+    ents[n++] = (CacheEntry){strdup(buf.gl_pathv[i]), s.st_size, s.st_mtim};
+    size += s.st_size;
+  }
+  globfree(&buf);
+
+  qsort(ents, n, sizeof(CacheEntry), compare_mtime);
+
+  long limit = cache_limit() / 10 * 9;
+  for (int i = 0; i < n && size > limit; i++)
+    if (!unlink(ents[i].path))
+      size -= ents[i].size;
+  st->size = size;
+}
+
+static void copy_to(FILE *in, FILE *out) {
+  char buf[8192];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+    fwrite(buf, 1, n, out);
+}
+
+// Hash everything but the source code that affects the output.
+static void hash_config(Hash *h) {
+  hash_str(h, "chibicc cache 1 x86_64-linux-gnu");
+
+  // The compiler itself is identified by its size and mtime.
+  struct stat st;
+  if (!stat("/proc/self/exe", &st)) {
+    hash_int(h, st.st_size);
+    hash_int(h, st.st_mtim.tv_sec);
+    hash_int(h, st.st_mtim.tv_nsec);
+  }
+
+  hash_int(h, opt_fpic);
+  hash_int(h, opt_fcommon);
+  hash_int(h, opt_O);
+  hash_int(h, opt_omit_frame_pointer);
+  hash_int(h, opt_mno_red_zone);
+}
+
+// Returns a hash of a preprocessed translation unit, or NULL if the
+// cache is disabled.
+char *cache_key(Token *tok) {
+  if (!cache_dir())
+    return NULL;
+
+  Hash h = {};
+  hash_config(&h);
+
+  // Macros defined or undefined by -D and -U are not hashed, because
+  // their effect is already in the token stream.
+
+  // File names and line numbers appear in .file and .loc directives.
+  File **files = get_input_files();
+  for (int i = 0; files[i]; i++) {
+    hash_int(&h, files[i]->file_no);
+    hash_str(&h, files[i]->name);
+  }
+
+  for (; tok->kind != TK_EOF; tok = tok->next) {
+    int32_t pos[] = {tok->file ? tok->file->file_no : 0, tok->line_no, tok->len};
+    hash_update(&h, pos, sizeof(pos));
+    hash_update(&h, tok->loc, tok->len);
+  }
+  return hash_final(&h);
+}
+
+// Copy a cached output to `path`. "-" means stdout. A failed direct
+// mode lookup is not counted as a miss, because the compiler falls
+// back to a lookup by the preprocessed tokens.
+static bool copy_entry(char *key, char *extn, char *path, bool direct) {
+  char *src = entry_path(key, extn);
+  FILE *in = fopen(src, "r");
+  if (!in && direct)
+    return false;
+
+  CacheStats st;
+  FILE *fp = lock_stats(&st);
+
+  if (in) {
+    FILE *out = strcmp(path, "-") ? fopen(path, "w") : stdout;
+    if (!out)
+      error("cannot open output file: %s: %s", path, strerror(errno));
+    copy_to(in, out);
+    fclose(in);
+    if (out == stdout)
+      fflush(out);
+    else
+      fclose(out);
+
+    // Mark the entry as recently used.
+    utimensat(AT_FDCWD, src, NULL, 0);
+    st.hits++;
+    if (direct)
+      st.direct_hits++;
+  } else {
+    st.misses++;
+  }
+
+  if (fp)
+    unlock_stats(fp, &st);
+  return in != NULL;
+}
+
+bool cache_get(char *key, char *extn, char *path) {
+  return copy_entry(key, extn, path, false);
+}
+
+void cache_put(char *key, char *extn, char *buf, size_t len) {
+  char *dir = format("%s/%.2s", cache_dir(), key);
+  mkdir(cache_dir(), 0755);
+  mkdir(dir, 0755);
+
+  // Write to a temporary file first, so that other processes never
+  // see a partially written entry.
+  char *tmp = format("%s/tmp-XXXXXX", dir);
+  int fd = mkstemp(tmp);
+  if (fd == -1)
+    return;
+  FILE *out = fdopen(fd, "w");
+  fwrite(buf, len, 1, out);
+  fclose(out);
+
+  CacheStats st;
+  FILE *fp = lock_stats(&st);
+
+  char *path = entry_path(key, extn);
+  struct stat old;
+  if (!stat(path, &old))
+    st.size -= old.st_size;
+
+  if (rename(tmp, path)) {
+    unlink(tmp);
+  } else {
+    st.size += len;
+    if (st.size > cache_limit())
+      evict(&st);
+  }
+
+  if (fp)
+    unlock_stats(fp, &st);
+}
+
+void cache_put_file(char *key, char *extn, char *path) {
+  FILE *in = fopen(path, "r");
+  if (!in)
+    return;
+
+  char *buf;
+  size_t buflen;
+  FILE *out = open_memstream(&buf, &buflen);
+  copy_to(in, out);
+  fclose(in);
+  fclose(out);
+
+  cache_put(key, extn, buf, buflen);
+  free(buf);
+}
+
+void print_cache_stats(void) {
+  if (!cache_dir())
+    error("CHIBICC_CACHE_DIR is not set");
+
+  CacheStats st;
+  FILE *fp = lock_stats(&st);
+  if (fp)
+    unlock_stats(fp, &st);
+
+  long total = st.hits + st.misses;
+  printf("cache directory: %s\n", cache_dir());
+  printf("hits:            %ld\n", st.hits);
+  printf("direct hits:     %ld\n", st.direct_hits);
+  printf("misses:          %ld\n", st.misses);
+  printf("hit rate:        %.1f%%\n", total ? st.hits * 100.0 / total : 0.0);
+  printf("size:            %ld KiB\n", st.size / 1024);
+  printf("size limit:      %ld KiB\n", cache_limit() / 1024);
+}
+
+//
+// Direct mode
+//
+
+typedef struct {
+  FILE *out;
+  char *buf;
+  size_t buflen;
+  HashMap seen;
+  bool disabled;
+} Manifest;
+
+// The manifest of the translation unit being preprocessed, if any.
+static _Thread_local Manifest *manifest;
+
+// Returns a hash of a file's contents as returned by read_source().
+static char *hash_contents(char *contents) {
+  Hash h = {};
+  hash_str(&h, contents);
+  return hash_final(&h);
+}
+
+// Returns a key for a manifest. `args` should contain everything on
+// the command line that affects preprocessing, or NULL if the cache
+// is disabled.
+char *manifest_key(StringArray *args) {
+  if (!cache_dir())
+    return NULL;
+
+  Hash h = {};
+  hash_config(&h);
+  hash_str(&h, "manifest");
+
+  char *cwd = getcwd(NULL, 0);
+  if (!cwd)
+    return NULL;
+  hash_str(&h, cwd);
+  free(cwd);
+
+  for (int i = 0; i < args->len; i++)
+    hash_str(&h, args->data[i]);
+  return hash_final(&h);
+}
+
+// If the manifest for `mkey` is still valid, copy the output it
+// refers to to `path`.
+bool manifest_get(char *mkey, char *extn, char *path) {
+  char *mpath = entry_path(mkey, ".manifest");
+  FILE *in = fopen(mpath, "r");
+  if (!in)
+    return false;
+
+  char *line = NULL;
+  size_t cap = 0;
+  char *key = NULL;
+  bool ok = true;
+
+  while (ok && getline(&line, &cap, in) != -1) {
+    line[strcspn(line, "\n")] = '\0';
+
+    if (!strncmp(line, "file ", 5)) {
+      char *hash = line + 5;
+      char *p = strchr(hash, ' ');
+      if (!p) {
+        ok = false;
+        continue;
+      }
+      *p = '\0';
+      char *contents = read_source(p + 1);
+      ok = contents && !strcmp(hash, hash_contents(contents));
+      free(contents);
+      continue;
+    }
+
+    if (!strncmp(line, "probe ", 6)) {
+      bool found = line[6] == '1';
+      ok = file_exists(line + 8) == found;
+      continue;
+    }
+
+    if (!strncmp(line, "search ", 7)) {
+      char *filename = line + 7;
+      char *p = strchr(filename, '\t');
+      if (!p) {
+        ok = false;
+        continue;
+      }
+      *p = '\0';
+      char *path2 = search_include_paths(strdup(filename));
+      ok = path2 ? !strcmp(path2, p + 1) : p[1] == '\0';
+      continue;
+    }
+
+    if (!strncmp(line, "result ", 7)) {
+      key = strdup(line + 7);
+      continue;
+    }
+
+    ok = false;
+  }
+
+  free(line);
+  fclose(in);
+  if (!ok || !key)
+    return false;
+
+  utimensat(AT_FDCWD, mpath, NULL, 0);
+  return copy_entry(key, extn, path, true);
+}
+
+// Start recording a manifest for the current translation unit.
+void manifest_begin(void) {
+  manifest = calloc(1, sizeof(Manifest));
+  manifest->out = open_memstream(&manifest->buf, &manifest->buflen);
+}
+
+static bool is_new_entry(char *kind, char *name) {
+  char *key = format("%s %s", kind, name);
+  if (hashmap_get(&manifest->seen, key))
+    return false;
+  hashmap_put(&manifest->seen, key, (void *)1);
+  return true;
+}
+
+// Record a file read by the preprocessor. `contents` is what was
+// tokenized, so that the manifest never refers to a different
+// version of the file than the one that was compiled.
+//
+// Like ccache, we don't store a manifest if a file was modified
+// within the last couple of seconds, as it may still be being written.
+void manifest_add_file(char *path, char *contents) {
+  if (!manifest || !is_new_entry("file", path))
+    return;
+
+  struct stat st;
+  if (stat(path, &st) || st.st_mtime >= time(NULL) - 2) {
+    manifest->disabled = true;
+    return;
+  }
+  fprintf(manifest->out, "file %s %s\n", hash_contents(contents), path);
+}
+
+// Record whether a file exists or not.
+void manifest_add_probe(char *path, bool found) {
+  if (manifest && is_new_entry("probe", path))
+    fprintf(manifest->out, "probe %d %s\n", found, path);
+}
+
+// Record the result of search_include_paths().
+void manifest_add_search(char *filename, char *path) {
+  if (manifest && is_new_entry("search", filename))
+    fprintf(manifest->out, "search %s\t%s\n", filename, path ? path : "");
+}
+
+// The current translation unit can't be compiled in direct mode.
+void manifest_disable(void) {
+  if (manifest)
+    manifest->disabled = true;
+}
+
+// Save the recorded manifest. `key` is the key of the output.
+void manifest_put(char *mkey, char *key) {
+  if (!manifest)
+    return;
+
+  fprintf(manifest->out, "result %s\n", key);
+  fclose(manifest->out);
+  if (!manifest->disabled)
+    cache_put(mkey, ".manifest", manifest->buf, manifest->buflen);
+  free(manifest->buf);
+  manifest = NULL;
+}
@@ -4,6 +4,7 @@
 #include <errno.h>
 #include <glob.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -30,6 +31,7 @@ typedef struct Node Node;
 typedef struct Member Member;
 typedef struct Relocation Relocation;
 typedef struct Hideset Hideset;
+typedef struct Preprocessor Preprocessor;
 
 //
 // strings.c
@@ -103,7 +105,10 @@ File **get_input_files(void);
 File *new_file(char *name, int file_no, char *contents);
 Token *tokenize_string_literal(Token *tok, Type *basety);
 Token *tokenize(File *file);
+char *read_source(char *path);
 Token *tokenize_file(char *filename);
+void save_file_cache(FILE *out);
+void load_file_cache(FILE *in);
 
 #define unreachable() \
   error("internal error at %s:%d", __FILE__, __LINE__)
@@ -114,6 +119,8 @@ Token *tokenize_file(char *filename);
 
 char *search_include_paths(char *filename);
 void init_macros(void);
+Preprocessor *new_preprocessor(void);
+void use_preprocessor(Preprocessor *ctx);
 void define_macro(char *name, char *buf);
 void undef_macro(char *name);
 Token *preprocess(Token *tok);
@@ -122,6 +129,19 @@ Token *preprocess(Token *tok);
 // parse.c
 //
 
+// A block in a function body. Locals of blocks that are not nested in
+// each other are never live at the same time, so they can share stack
+// slots.
+typedef struct Block Block;
+struct Block {
+  Block *parent;
+  int depth;
+
+  // Used by codegen
+  bool is_placed;
+  int bottom;
+};
+
 // Variable or function
 typedef struct Obj Obj;
 struct Obj {
@@ -134,6 +154,9 @@ struct Obj {
 
   // Local variable
   int offset;
+  Block *block;       // Innermost enclosing block, or NULL for function scope
+  int vreg;           // Virtual register holding the variable in the IR
+  bool is_addr_taken; // True if the IR needs the variable's address
 
   // Global variable or function
   bool is_function;
@@ -148,6 +171,8 @@ struct Obj {
 
   // Function
   bool is_inline;
+  bool is_always_inline;
+  bool is_noinline;
   Obj *params;
   Node *body;
   Obj *locals;
@@ -222,6 +247,8 @@ typedef enum {
   ND_ASM,       // "asm"
   ND_CAS,       // Atomic compare-and-swap
   ND_EXCH,      // Atomic exchange
+  ND_FETCH_OP,  // Atomic fetch-and-op
+  ND_FENCE,     // Memory fence
 } NodeKind;
 
 // AST node type
@@ -282,9 +309,19 @@ struct Node {
   Obj *atomic_addr;
   Node *atomic_expr;
 
+  // Atomic fetch-and-op. `fetch_op` is one of ND_ADD, ND_SUB,
+  // ND_BITAND, ND_BITOR and ND_BITXOR. The new value is returned
+  // instead of the old one if `fetch_new` is true.
+  NodeKind fetch_op;
+  bool fetch_new;
+
   // Variable
   Obj *var;
 
+  // Bytes of `var` cleared by ND_MEMZERO
+  int zero_offset;
+  int zero_size;
+
   // Numeric literal
   int64_t val;
   long double fval;
@@ -408,8 +445,126 @@ void add_type(Node *node);
 // codegen.c
 //
 
+typedef enum {
+  SWITCH_CHAIN, // Compare the value with each case in turn
+  SWITCH_TREE,  // Binary search over the sorted cases
+  SWITCH_TABLE, // Jump table indexed by the value
+} SwitchKind;
+
 void codegen(Obj *prog, FILE *out);
 int align_to(int n, int align);
+SwitchKind switch_kind(Node *node);
+
+//
+// ir.c
+//
+
+typedef enum {
+  IR_IMM,    // d = imm
+  IR_MOV,    // d = a
+  IR_LVAR,   // d = address of a local variable
+  IR_GVAR,   // d = address of a global variable or function
+  IR_ADD,    // d = a + b
+  IR_SUB,    // d = a - b
+  IR_MUL,    // d = a * b
+  IR_DIV,    // d = a / b
+  IR_MOD,    // d = a % b
+  IR_AND,    // d = a & b
+  IR_OR,     // d = a | b
+  IR_XOR,    // d = a ^ b
+  IR_SHL,    // d = a << b
+  IR_SHR,    // d = a >> b
+  IR_EQ,     // d = a == b
+  IR_NE,     // d = a != b
+  IR_LT,     // d = a < b
+  IR_LE,     // d = a <= b
+  IR_NEG,    // d = -a
+  IR_BITNOT, // d = ~a
+  IR_CAST,   // d = sign or zero extension of the lower `size` bytes of a
+  IR_PARAM,  // d = the imm'th argument passed in a register
+  IR_LOAD,   // d = *(a + imm)
+  IR_STORE,  // *(a + imm) = b
+  IR_ZERO,   // memset(a + imm, 0, size)
+  IR_CALL,   // d = var(args...) or d = a(args...)
+  IR_JMP,    // goto bb1
+  IR_BR,     // if (a) goto bb1; else goto bb2
+  IR_SWITCH, // goto targets[a]
+  IR_RET,    // return a
+} IROp;
+
+typedef struct BB BB;
+typedef struct IR IR;
+
+// IR instruction
+struct IR {
+  IR *next;
+  IR *prev;
+  IROp kind;
+  Token *tok;      // for .loc directives
+
+  int d;           // Destination register, or 0
+  int a;           // Operand registers, or 0
+  int b;
+
+  int size;        // Operation size of arithmetic and comparisons
+  bool is_unsigned;
+  long imm;
+  Type *ty;        // Type of a load, store or function call
+  Obj *var;        // Variable or callee
+
+  // Function call
+  int *args;
+  int nargs;
+  bool is_tail;    // The call is emitted as a jump after the epilogue
+
+  // Branch targets
+  BB *bb1;
+  BB *bb2;
+  BB **targets;
+  int ntargets;
+};
+
+// Basic block
+struct BB {
+  BB *next;
+  int id;
+  IR *first;
+  IR *last;
+  int idx;          // Index in the function, set by the backend
+  int inline_depth; // Number of nested inlined calls it came from
+};
+
+typedef struct {
+  Obj *fn;
+  BB *bb;
+  int nregs;
+} IRFunc;
+
+BB *new_bb(void);
+IRFunc *gen_ir(Obj *fn);
+int *ir_use(IR *ir, int i);
+BB **ir_succ(IR *ir, int i);
+void dump_ir(IRFunc *f, FILE *out);
+void print_ir(Obj *prog, FILE *out);
+
+//
+// inline.c
+//
+
+void inline_calls(IRFunc *f);
+
+//
+// peephole.c
+//
+
+void peephole(char *buf, FILE *out);
+void print_peephole_stats(char *file);
+
+//
+// opt.c
+//
+
+void optimize_ir(IRFunc *f);
 
 //
 // unicode.c
@@ -443,8 +598,34 @@ void hashmap_put(HashMap *map, char *key, void *val);
 void hashmap_put2(HashMap *map, char *key, int keylen, void *val);
 void hashmap_delete(HashMap *map, char *key);
 void hashmap_delete2(HashMap *map, char *key, int keylen);
+void hashmap_copy(HashMap *dst, HashMap *src);
 void hashmap_test(void);
 
+//
+// cache.c
+//
+
+char *cache_key(Token *tok);
+bool cache_get(char *key, char *extn, char *path);
+void cache_put(char *key, char *extn, char *buf, size_t len);
+void cache_put_file(char *key, char *extn, char *path);
+void print_cache_stats(void);
+char *manifest_key(StringArray *args);
+bool manifest_get(char *mkey, char *extn, char *path);
+void manifest_begin(void);
+void manifest_add_file(char *path, char *contents);
+void manifest_add_probe(char *path, bool found);
+void manifest_add_search(char *filename, char *path);
+void manifest_disable(void);
+void manifest_put(char *mkey, char *key);
+
+//
+// server.c
+//
+
+noreturn void run_server(char *path, int (*fn)(int argc, char **argv));
+bool run_client(char *path, int argc, char **argv, int *status);
+
 //
 // main.c
 //
@@ -453,5 +634,8 @@ bool file_exists(char *path);
 
 extern StringArray include_paths;
 extern bool opt_fpic;
+extern bool opt_omit_frame_pointer;
+extern bool opt_mno_red_zone;
 extern bool opt_fcommon;
-extern char *base_file;
+extern int opt_O;
+extern _Thread_local char *base_file;
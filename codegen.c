@@ -3,13 +3,13 @@
 #define GP_MAX 6
 #define FP_MAX 8
 
-static FILE *output_file;
-static int depth;
+static _Thread_local FILE *output_file;
+static _Thread_local int depth;
 static char *argreg8[] = {"%dil", "%sil", "%dl", "%cl", "%r8b", "%r9b"};
 static char *argreg16[] = {"%di", "%si", "%dx", "%cx", "%r8w", "%r9w"};
 static char *argreg32[] = {"%edi", "%esi", "%edx", "%ecx", "%r8d", "%r9d"};
 static char *argreg64[] = {"%rdi", "%rsi", "%rdx", "%rcx", "%r8", "%r9"};
-static Obj *current_fn;
+static _Thread_local Obj *current_fn;
 
 static void gen_expr(Node *node);
 static void gen_stmt(Node *node);
@@ -24,7 +24,7 @@ static void println(char *fmt, ...) {
 }
 
 static int count(void) {
-  static int i = 1;
+  static _Thread_local int i = 1;
   return i++;
 }
 
@@ -50,6 +50,115 @@ static void popf(int reg) {
   depth--;
 }
 
+// Temporary values are kept in scratch registers rather than pushed
+// to the stack. We use callee-saved registers, so that a temporary
+// survives function calls made while the other operand is evaluated.
+// A function saves the scratch registers it uses in its prologue.
+// If all of them are in use, temporaries spill to the stack.
+#define NTMP_MAX 5
+
+static char *tmpreg32[] = {"%ebx", "%r12d", "%r13d", "%r14d", "%r15d"};
+static char *tmpreg64[] = {"%rbx", "%r12", "%r13", "%r14", "%r15"};
+static _Thread_local int ntmp;
+static _Thread_local int max_tmp;
+
+// Callees of tail calls in the current function. The epilogue is
+// emitted once more for each of them, ending with a jump to it.
+static _Thread_local StringArray tail_calls;
+
+// Save %rax as a temporary. Returns a scratch register index, or -1
+// if the value is pushed to the stack.
+static int push_tmp(void) {
+  if (ntmp >= NTMP_MAX) {
+    ntmp++;
+    push();
+    return -1;
+  }
+
+  println("  mov %%rax, %s", tmpreg64[ntmp]);
+  max_tmp = MAX(max_tmp, ntmp + 1);
+  return ntmp++;
+}
+
+// Release the last temporary and move it to `reg`.
+static void pop_tmp(int r, char *reg) {
+  ntmp--;
+  if (r == -1)
+    pop(reg);
+  else
+    println("  mov %s, %s", tmpreg64[r], reg);
+}
+
+// Release the last temporary and returns an operand referring to it.
+// A spilled temporary is popped to %rdi.
+static char *pop_tmp_operand(int r, bool is64) {
+  ntmp--;
+  if (r == -1) {
+    pop("%rdi");
+    return is64 ? "%rdi" : "%edi";
+  }
+  return is64 ? tmpreg64[r] : tmpreg32[r];
+}
+
+// Floating-point temporaries are kept in %xmm9-%xmm15. No xmm register
+// survives a function call, so a temporary is pushed to the stack if
+// the code evaluated while it is live may make one. %xmm8 is left
+// for copy_mem and zero_mem.
+#define NFTMP_MAX 7
+
+static _Thread_local int nftmp;
+
+// Returns true if evaluating `node` may clobber xmm registers.
+static bool clobbers_xmm(Node *node) {
+  if (!node)
+    return false;
+
+  switch (node->kind) {
+  case ND_FUNCALL:
+  case ND_ASM:
+    return true;
+  case ND_VAR:
+    return opt_fpic && node->var->is_tls;
+  }
+
+  for (Node *n = node->body; n; n = n->next)
+    if (clobbers_xmm(n))
+      return true;
+  for (Node *n = node->args; n; n = n->next)
+    if (clobbers_xmm(n))
+      return true;
+
+  return clobbers_xmm(node->lhs) || clobbers_xmm(node->rhs) ||
+         clobbers_xmm(node->cond) || clobbers_xmm(node->then) ||
+         clobbers_xmm(node->els) || clobbers_xmm(node->init) ||
+         clobbers_xmm(node->inc) || clobbers_xmm(node->cas_addr) ||
+         clobbers_xmm(node->cas_old) || clobbers_xmm(node->cas_new) ||
+         clobbers_xmm(node->atomic_expr);
+}
+
+// Save %xmm0 as a temporary while `next` is evaluated. Returns a
+// temporary index, or -1 if the value is pushed to the stack.
+static int push_ftmp(Node *next) {
+  if (nftmp == NFTMP_MAX || clobbers_xmm(next)) {
+    pushf();
+    return -1;
+  }
+
+  println("  movaps %%xmm0, %%xmm%d", nftmp + 9);
+  return nftmp++;
+}
+
+// Release the last floating-point temporary and returns the register
+// holding it. A spilled temporary is popped to %xmm1.
+static char *pop_ftmp(int r) {
+  if (r == -1) {
+    popf(1);
+    return "%xmm1";
+  }
+  nftmp--;
+  return format("%%xmm%d", r + 9);
+}
+
 // Round up `n` to the nearest multiple of `align`. For instance,
 // align_to(5, 8) returns 8 and align_to(11, 8) returns 16.
 int align_to(int n, int align) {
@@ -66,6 +175,16 @@ static char *reg_dx(int sz) {
   unreachable();
 }
 
+static char *reg_cx(int sz) {
+  switch (sz) {
+  case 1: return "%cl";
+  case 2: return "%cx";
+  case 4: return "%ecx";
+  case 8: return "%rcx";
+  }
+  unreachable();
+}
+
 static char *reg_ax(int sz) {
   switch (sz) {
   case 1: return "%al";
@@ -225,37 +344,124 @@ static void load(Type *ty) {
     println("  mov (%%rax), %%rax");
 }
 
-// Store %rax to an address that the stack top is pointing to.
-static void store(Type *ty) {
-  pop("%rdi");
+// Copy `size` bytes from `src_off(src)` to `dst_off(dst)` with 16-byte
+// SSE moves followed by 8, 4, 2 and 1-byte moves. %r8 and %xmm8 are
+// clobbered.
+static void copy_mem(char *src, int src_off, char *dst, int dst_off, int size) {
+  static char *r8[] = {"%r8b", "%r8w", NULL, "%r8d", NULL, NULL, NULL, "%r8"};
+  int i = 0;
+
+  for (; size - i >= 16; i += 16) {
+    println("  movdqu %d(%s), %%xmm8", src_off + i, src);
+    println("  movdqu %%xmm8, %d(%s)", dst_off + i, dst);
+  }
+
+  for (int sz = 8; sz; sz /= 2) {
+    for (; size - i >= sz; i += sz) {
+      println("  mov %d(%s), %s", src_off + i, src, r8[sz - 1]);
+      println("  mov %s, %d(%s)", r8[sz - 1], dst_off + i, dst);
+    }
+  }
+}
+
+// Struct copies of up to this many bytes are unrolled. Larger ones
+// use rep movsq.
+#define COPY_UNROLL_MAX 128
+
+// Copy a struct or a union from (%rax) to `offset(base)`. %rax and
+// `base` are preserved unless `base` is %rdi. %rcx, %rsi, %rdi, %r8
+// and %xmm8 are clobbered.
+static void copy_struct(Type *ty, int offset, char *base) {
+  if (ty->size <= COPY_UNROLL_MAX) {
+    copy_mem("%rax", 0, base, offset, ty->size);
+    return;
+  }
+
+  println("  lea %d(%s), %%rdi", offset, base);
+  println("  mov %%rax, %%rsi");
+  println("  mov $%d, %%ecx", ty->size / 8);
+  println("  rep movsq");
+  copy_mem("%rsi", 0, "%rdi", 0, ty->size % 8);
+}
+
+// Zero-clear `size` bytes at `offset(base)`. Up to COPY_UNROLL_MAX
+// bytes are cleared with 16-byte SSE stores followed by 8, 4, 2 and
+// 1-byte stores, which clobbers %xmm8. Larger areas are cleared with
+// rep stosq, which clobbers %rax, %rcx and %rdi.
+static void zero_mem(char *base, int offset, int size) {
+  if (size > COPY_UNROLL_MAX) {
+    println("  lea %d(%s), %%rdi", offset, base);
+    println("  xor %%eax, %%eax");
+    println("  mov $%d, %%ecx", size / 8);
+    println("  rep stosq");
+    base = "%rdi";
+    offset = 0;
+    size %= 8;
+  }
+
+  int i = 0;
+  if (size >= 16)
+    println("  pxor %%xmm8, %%xmm8");
+  for (; size - i >= 16; i += 16)
+    println("  movdqu %%xmm8, %d(%s)", offset + i, base);
+
+  for (int sz = 8; sz; sz /= 2)
+    for (; size - i >= sz; i += sz)
+      println("  mov%c $0, %d(%s)", "bw l   q"[sz - 1], offset + i, base);
+}
 
+// Store %rax to `offset(base)`.
+static void store(Type *ty, int offset, char *base) {
   switch (ty->kind) {
   case TY_STRUCT:
   case TY_UNION:
-    for (int i = 0; i < ty->size; i++) {
-      println("  mov %d(%%rax), %%r8b", i);
-      println("  mov %%r8b, %d(%%rdi)", i);
-    }
+    copy_struct(ty, offset, base);
     return;
   case TY_FLOAT:
-    println("  movss %%xmm0, (%%rdi)");
+    println("  movss %%xmm0, %d(%s)", offset, base);
     return;
   case TY_DOUBLE:
-    println("  movsd %%xmm0, (%%rdi)");
+    println("  movsd %%xmm0, %d(%s)", offset, base);
     return;
   case TY_LDOUBLE:
-    println("  fstpt (%%rdi)");
+    println("  fstpt %d(%s)", offset, base);
     return;
   }
 
   if (ty->size == 1)
-    println("  mov %%al, (%%rdi)");
+    println("  mov %%al, %d(%s)", offset, base);
   else if (ty->size == 2)
-    println("  mov %%ax, (%%rdi)");
+    println("  mov %%ax, %d(%s)", offset, base);
   else if (ty->size == 4)
-    println("  mov %%eax, (%%rdi)");
+    println("  mov %%eax, %d(%s)", offset, base);
   else
-    println("  mov %%rax, (%%rdi)");
+    println("  mov %%rax, %d(%s)", offset, base);
+}
+
+// Returns the condition code that holds after `cmp rhs, lhs` if
+// `lhs == rhs`, `lhs != rhs`, `lhs < rhs` or `lhs <= rhs` is true.
+static char *int_cond(int kind, bool is_unsigned) {
+  switch (kind) {
+  case ND_EQ: return "e";
+  case ND_NE: return "ne";
+  case ND_LT: return is_unsigned ? "b" : "l";
+  case ND_LE: return is_unsigned ? "be" : "le";
+  }
+  unreachable();
+}
+
+static char *negate_cond(char *cc) {
+  static char *pairs[][2] = {
+    {"e", "ne"}, {"l", "ge"}, {"le", "g"}, {"b", "ae"}, {"be", "a"},
+  };
+
+  for (int i = 0; i < sizeof(pairs) / sizeof(*pairs); i++) {
+    if (!strcmp(cc, pairs[i][0]))
+      return pairs[i][1];
+    if (!strcmp(cc, pairs[i][1]))
+      return pairs[i][0];
+  }
+  unreachable();
 }
 
 static void cmp_zero(Type *ty) {
@@ -322,7 +528,10 @@ static char i64f32[] = "cvtsi2ssq %rax, %xmm0";
 static char i64f64[] = "cvtsi2sdq %rax, %xmm0";
 static char i64f80[] = "movq %rax, -8(%rsp); fildll -8(%rsp)";
 
-static char u64f32[] = "cvtsi2ssq %rax, %xmm0";
+static char u64f32[] =
+  "test %rax,%rax; js 1f; pxor %xmm0,%xmm0; cvtsi2ss %rax,%xmm0; jmp 2f; "
+  "1: mov %rax,%rdi; and $1,%eax; pxor %xmm0,%xmm0; shr %rdi; "
+  "or %rax,%rdi; cvtsi2ss %rdi,%xmm0; addss %xmm0,%xmm0; 2:";
 static char u64f64[] =
   "test %rax,%rax; js 1f; pxor %xmm0,%xmm0; cvtsi2sd %rax,%xmm0; jmp 2f; "
   "1: mov %rax,%rdi; and $1,%eax; pxor %xmm0,%xmm0; shr %rdi; "
@@ -338,7 +547,10 @@ static char f32u16[] = "cvttss2sil %xmm0, %eax; movzwl %ax, %eax";
 static char f32i32[] = "cvttss2sil %xmm0, %eax";
 static char f32u32[] = "cvttss2siq %xmm0, %rax";
 static char f32i64[] = "cvttss2siq %xmm0, %rax";
-static char f32u64[] = "cvttss2siq %xmm0, %rax";
+static char f32u64[] =
+  "mov $0x5f000000, %eax; movd %eax, %xmm1; ucomiss %xmm1, %xmm0; jae 1f; "
+  "cvttss2siq %xmm0, %rax; jmp 2f; "
+  "1: subss %xmm1, %xmm0; cvttss2siq %xmm0, %rax; btc $63, %rax; 2:";
 static char f32f64[] = "cvtss2sd %xmm0, %xmm0";
 static char f32f80[] = "movss %xmm0, -4(%rsp); flds -4(%rsp)";
 
@@ -349,7 +561,10 @@ static char f64u16[] = "cvttsd2sil %xmm0, %eax; movzwl %ax, %eax";
 static char f64i32[] = "cvttsd2sil %xmm0, %eax";
 static char f64u32[] = "cvttsd2siq %xmm0, %rax";
 static char f64i64[] = "cvttsd2siq %xmm0, %rax";
-static char f64u64[] = "cvttsd2siq %xmm0, %rax";
+static char f64u64[] =
+  "mov $0x43e0000000000000, %rax; movq %rax, %xmm1; ucomisd %xmm1, %xmm0; jae 1f; "
+  "cvttsd2siq %xmm0, %rax; jmp 2f; "
+  "1: subsd %xmm1, %xmm0; cvttsd2siq %xmm0, %rax; btc $63, %rax; 2:";
 static char f64f32[] = "cvtsd2ss %xmm0, %xmm0";
 static char f64f80[] = "movsd %xmm0, -8(%rsp); fldl -8(%rsp)";
 
@@ -446,11 +661,7 @@ static void push_struct(Type *ty) {
   int sz = align_to(ty->size, 8);
   println("  sub $%d, %%rsp", sz);
   depth += sz / 8;
-
-  for (int i = 0; i < ty->size; i++) {
-    println("  mov %d(%%rax), %%r10b", i);
-    println("  mov %%r10b, %d(%%rsp)", i);
-  }
+  copy_struct(ty, 0, "%rsp");
 }
 
 static void push_args2(Node *args, bool first_pass) {
@@ -570,6 +781,66 @@ static int push_args(Node *node) {
   return stack;
 }
 
+// Returns the name of the low `sz` bytes of %rax or of an argument
+// register.
+static char *gp_reg(char *reg64, int sz) {
+  if (!strcmp(reg64, "%rax"))
+    return reg_ax(sz);
+
+  for (int i = 0; i < GP_MAX; i++) {
+    if (strcmp(reg64, argreg64[i]))
+      continue;
+    switch (sz) {
+    case 1: return argreg8[i];
+    case 2: return argreg16[i];
+    case 4: return argreg32[i];
+    case 8: return argreg64[i];
+    }
+  }
+  unreachable();
+}
+
+// Returns the size of the widest load or store of at most `sz` bytes.
+static int word_size(int sz) {
+  return (sz >= 8) ? 8 : (sz >= 4) ? 4 : (sz >= 2) ? 2 : 1;
+}
+
+// Store the low `sz` bytes of `reg64` to `offset(%rbp)`. Sizes other
+// than 1, 2, 4 and 8 are stored in pieces, which clobbers `reg64`.
+static void store_word(char *reg64, int offset, int sz) {
+  for (;;) {
+    int n = word_size(sz);
+    println("  mov %s, %d(%%rbp)", gp_reg(reg64, n), offset);
+    offset += n;
+    sz -= n;
+    if (sz == 0)
+      return;
+    println("  shr $%d, %s", n * 8, reg64);
+  }
+}
+
+// Load `sz` bytes at `offset(base)` to `reg64`, zero-extended. Sizes
+// other than 1, 2, 4 and 8 are loaded in pieces, which clobbers %rcx.
+static void load_word(char *reg64, char *base, int offset, int sz) {
+  for (int i = 0; i < sz;) {
+    int n = word_size(sz - i);
+    char *dst = i ? "%rcx" : reg64;
+
+    switch (n) {
+    case 1: println("  movzbl %d(%s), %s", offset + i, base, gp_reg(dst, 4)); break;
+    case 2: println("  movzwl %d(%s), %s", offset + i, base, gp_reg(dst, 4)); break;
+    case 4: println("  mov %d(%s), %s", offset + i, base, gp_reg(dst, 4)); break;
+    case 8: println("  mov %d(%s), %s", offset + i, base, dst); break;
+    }
+
+    if (i) {
+      println("  shl $%d, %%rcx", i * 8);
+      println("  or %%rcx, %s", reg64);
+    }
+    i += n;
+  }
+}
+
 static void copy_ret_buffer(Obj *var) {
   Type *ty = var->ty;
   int gp = 0, fp = 0;
@@ -582,10 +853,7 @@ static void copy_ret_buffer(Obj *var) {
       println("  movsd %%xmm0, %d(%%rbp)", var->offset);
     fp++;
   } else {
-    for (int i = 0; i < MIN(8, ty->size); i++) {
-      println("  mov %%al, %d(%%rbp)", var->offset + i);
-      println("  shr $8, %%rax");
-    }
+    store_word("%rax", var->offset, MIN(8, ty->size));
     gp++;
   }
 
@@ -597,12 +865,7 @@ static void copy_ret_buffer(Obj *var) {
       else
         println("  movsd %%xmm%d, %d(%%rbp)", fp, var->offset + 8);
     } else {
-      char *reg1 = (gp == 0) ? "%al" : "%dl";
-      char *reg2 = (gp == 0) ? "%rax" : "%rdx";
-      for (int i = 8; i < MIN(16, ty->size); i++) {
-        println("  mov %s, %d(%%rbp)", reg1, var->offset + i);
-        println("  shr $8, %s", reg2);
-      }
+      store_word(gp == 0 ? "%rax" : "%rdx", var->offset + 8, ty->size - 8);
     }
   }
 }
@@ -621,29 +884,19 @@ static void copy_struct_reg(void) {
       println("  movsd (%%rdi), %%xmm0");
     fp++;
   } else {
-    println("  mov $0, %%rax");
-    for (int i = MIN(8, ty->size) - 1; i >= 0; i--) {
-      println("  shl $8, %%rax");
-      println("  mov %d(%%rdi), %%al", i);
-    }
+    load_word("%rax", "%rdi", 0, MIN(8, ty->size));
     gp++;
   }
 
   if (ty->size > 8) {
     if (has_flonum(ty, 8, 16, 0)) {
       assert(ty->size == 12 || ty->size == 16);
-      if (ty->size == 4)
+      if (ty->size == 12)
         println("  movss 8(%%rdi), %%xmm%d", fp);
       else
         println("  movsd 8(%%rdi), %%xmm%d", fp);
     } else {
-      char *reg1 = (gp == 0) ? "%al" : "%dl";
-      char *reg2 = (gp == 0) ? "%rax" : "%rdx";
-      println("  mov $0, %s", reg2);
-      for (int i = MIN(16, ty->size) - 1; i >= 8; i--) {
-        println("  shl $8, %s", reg2);
-        println("  mov %d(%%rdi), %s", i, reg1);
-      }
+      load_word(gp == 0 ? "%rax" : "%rdx", "%rdi", 8, ty->size - 8);
     }
   }
 }
@@ -653,11 +906,10 @@ static void copy_struct_mem(void) {
   Obj *var = current_fn->params;
 
   println("  mov %d(%%rbp), %%rdi", var->offset);
+  copy_struct(ty, 0, "%rdi");
 
-  for (int i = 0; i < ty->size; i++) {
-    println("  mov %d(%%rax), %%dl", i);
-    println("  mov %%dl, %d(%%rdi)", i);
-  }
+  // The caller's buffer is returned in %rax.
+  println("  mov %d(%%rbp), %%rax", var->offset);
 }
 
 static void builtin_alloca(void) {
@@ -688,125 +940,722 @@ static void builtin_alloca(void) {
   println("  mov %%rax, %d(%%rbp)", current_fn->alloca_bottom->offset);
 }
 
-// Generate code for a given node.
-static void gen_expr(Node *node) {
-  println("  .loc %d %d", node->tok->file->file_no, node->tok->line_no);
+// Returns the number of temporaries needed to evaluate `node`.
+// This is the Sethi-Ullman number of the expression tree.
+static int need_tmp(Node *node) {
+  if (!node)
+    return 0;
 
   switch (node->kind) {
-  case ND_NULL_EXPR:
-    return;
-  case ND_NUM: {
-    switch (node->ty->kind) {
-    case TY_FLOAT: {
-      union { float f32; uint32_t u32; } u = { node->fval };
-      println("  mov $%u, %%eax  # float %Lf", u.u32, node->fval);
-      println("  movq %%rax, %%xmm0");
-      return;
-    }
-    case TY_DOUBLE: {
-      union { double f64; uint64_t u64; } u = { node->fval };
-      println("  mov $%lu, %%rax  # double %Lf", u.u64, node->fval);
-      println("  movq %%rax, %%xmm0");
-      return;
-    }
-    case TY_LDOUBLE: {
-      union { long double f80; uint64_t u64[2]; } u;
-      memset(&u, 0, sizeof(u));
-      u.f80 = node->fval;
-      println("  mov $%lu, %%rax  # long double %Lf", u.u64[0], node->fval);
-      println("  mov %%rax, -16(%%rsp)");
-      println("  mov $%lu, %%rax", u.u64[1]);
-      println("  mov %%rax, -8(%%rsp)");
-      println("  fldt -16(%%rsp)");
+  case ND_NUM:
+  case ND_VAR:
+  case ND_LABEL_VAL:
+    return 0;
+  case ND_ADD:
+  case ND_SUB:
+  case ND_MUL:
+  case ND_DIV:
+  case ND_MOD:
+  case ND_BITAND:
+  case ND_BITOR:
+  case ND_BITXOR:
+  case ND_SHL:
+  case ND_SHR:
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE:
+  case ND_ASSIGN: {
+    int l = need_tmp(node->lhs);
+    int r = need_tmp(node->rhs);
+    return (l == r) ? l + 1 : MAX(l, r);
+  }
+  }
+
+  // Other nodes evaluate their operands one at a time. MAX evaluates
+  // its arguments twice, so they are computed first.
+  int l = need_tmp(node->lhs);
+  int r = need_tmp(node->rhs);
+  return MAX(l, r);
+}
+
+// If `node` can be used as a source operand of an `sz`-byte
+// instruction without evaluating it to a register, returns the
+// operand. That is the case for immediates and local variables.
+// Skip casts that don't change the value.
+static Node *skip_value_casts(Node *node) {
+  while (node->kind == ND_CAST && node->ty->kind != TY_BOOL &&
+         (is_integer(node->ty) || node->ty->kind == TY_PTR) &&
+         (is_integer(node->lhs->ty) || node->lhs->ty->kind == TY_PTR) &&
+         node->lhs->ty->size <= node->ty->size)
+    node = node->lhs;
+  return node;
+}
+
+static bool is_int_const(Node *node, long *val) {
+  node = skip_value_casts(node);
+  if (node->kind != ND_NUM || !is_integer(node->ty))
+    return false;
+  *val = node->val;
+  return true;
+}
+
+// Returns true if `node` is a local variable or a member of one, so
+// that its address is a constant offset from %rbp, and sets `*offset`.
+static bool local_offset(Node *node, int *offset) {
+  int off = 0;
+  for (; node->kind == ND_MEMBER; node = node->lhs)
+    off += node->member->offset;
+
+  if (node->kind != ND_VAR || !node->var->is_local || node->ty->kind == TY_VLA)
+    return false;
+  *offset = node->var->offset + off;
+  return true;
+}
+
+// Sign-extend the low `sz` bytes of `val`.
+static long sext(long val, int sz) {
+  switch (sz) {
+  case 1: return (signed char)val;
+  case 2: return (short)val;
+  case 4: return (int)val;
+  }
+  return val;
+}
+
+// Returns a mask of the bits of a bitfield in its storage unit.
+static unsigned long bitfield_mask(Member *mem) {
+  unsigned long m = (mem->bit_width == 64) ? -1 : (1UL << mem->bit_width) - 1;
+  return m << mem->bit_offset;
+}
+
+// Store %rax to the bitfield `mem` whose storage unit is at
+// `offset(base)`. An immediate is merged into memory with and and or.
+// Otherwise, the unit is loaded to %rcx, merged with %rdx and stored
+// back. %rax is preserved.
+static void store_bitfield(Member *mem, Node *rhs, int offset, char *base) {
+  int sz = mem->ty->size;
+  char suffix = "bw l   q"[sz - 1];
+  unsigned long mask = bitfield_mask(mem);
+  long val;
+
+  if (is_int_const(rhs, &val)) {
+    unsigned long bits = ((unsigned long)val << mem->bit_offset) & mask;
+    long clear = sext(~mask, sz);
+    if (sz < 8 || (clear == (int)clear && bits == (int)bits)) {
+      if (bits != mask)
+        println("  and%c $%ld, %d(%s)", suffix, clear, offset, base);
+      if (bits)
+        println("  or%c $%ld, %d(%s)", suffix, sext(bits, sz), offset, base);
       return;
     }
-    }
+  }
 
-    println("  mov $%ld, %%rax", node->val);
-    return;
+  // Move the new value to its position in %rdx.
+  println("  mov %%rax, %%rdx");
+  if (mem->bit_width < 32) {
+    println("  and $%ld, %%edx", (1L << mem->bit_width) - 1);
+    if (mem->bit_offset)
+      println("  shl $%d, %%rdx", mem->bit_offset);
+  } else {
+    println("  shl $%d, %%rdx", 64 - mem->bit_width);
+    println("  shr $%d, %%rdx", 64 - mem->bit_width - mem->bit_offset);
   }
-  case ND_NEG:
-    gen_expr(node->lhs);
 
-    switch (node->ty->kind) {
-    case TY_FLOAT:
-      println("  mov $1, %%rax");
-      println("  shl $31, %%rax");
-      println("  movq %%rax, %%xmm1");
-      println("  xorps %%xmm1, %%xmm0");
-      return;
-    case TY_DOUBLE:
-      println("  mov $1, %%rax");
-      println("  shl $63, %%rax");
-      println("  movq %%rax, %%xmm1");
-      println("  xorpd %%xmm1, %%xmm0");
-      return;
-    case TY_LDOUBLE:
-      println("  fchs");
+  if (sz == 1)
+    println("  movzbl %d(%s), %%ecx", offset, base);
+  else if (sz == 2)
+    println("  movzwl %d(%s), %%ecx", offset, base);
+  else
+    println("  mov %d(%s), %s", offset, base, reg_cx(sz));
+
+  long clear = sext(~mask, sz);
+  if (clear == (int)clear) {
+    println("  and $%ld, %s", clear, reg_cx(MAX(sz, 4)));
+  } else {
+    println("  mov $%ld, %%rsi", clear);
+    println("  and %%rsi, %%rcx");
+  }
+
+  println("  or %%rdx, %%rcx");
+  println("  mov %s, %d(%s)", reg_cx(sz), offset, base);
+}
+
+static char *src_operand(Node *node, int sz) {
+  node = skip_value_casts(node);
+
+  if (node->kind == ND_NUM && is_integer(node->ty)) {
+    long val = node->val;
+    if (val == (int)val || (sz == 4 && val == (unsigned)val))
+      return format("$%ld", val);
+    return NULL;
+  }
+
+  if (node->kind == ND_VAR && node->var->is_local &&
+      (is_integer(node->ty) || node->ty->kind == TY_PTR) &&
+      node->ty->size == sz)
+    return format("%d(%%rbp)", node->var->offset);
+  return NULL;
+}
+
+// Atomically apply `node->fetch_op` to the value pointed to by
+// `node->lhs`. If the result is unused, memory is updated by a single
+// locked instruction. Otherwise, add and sub use xadd, and the others
+// a cmpxchg loop.
+static void gen_fetch_op(Node *node, bool unused) {
+  int sz = node->ty->size;
+  int op = node->fetch_op;
+  char *insn = (op == ND_ADD) ? "add" : (op == ND_SUB) ? "sub" :
+               (op == ND_BITAND) ? "and" : (op == ND_BITOR) ? "or" : "xor";
+
+  if (unused) {
+    char *val = src_operand(node->rhs, sz);
+    if (val && val[0] == '$') {
+      gen_expr(node->lhs);
+      println("  lock %s%c %s, (%%rax)", insn, "bw l   q"[sz - 1], val);
       return;
     }
+  }
 
-    println("  neg %%rax");
-    return;
-  case ND_VAR:
-    gen_addr(node);
-    load(node->ty);
+  gen_expr(node->lhs);
+  int r = push_tmp();
+  gen_expr(node->rhs);
+  pop_tmp(r, "%rdi");
+
+  if (unused) {
+    println("  lock %s %s, (%%rdi)", insn, reg_ax(sz));
     return;
-  case ND_MEMBER: {
-    gen_addr(node);
-    load(node->ty);
+  }
 
-    Member *mem = node->member;
-    if (mem->is_bitfield) {
-      println("  shl $%d, %%rax", 64 - mem->bit_width - mem->bit_offset);
-      if (mem->ty->is_unsigned)
-        println("  shr $%d, %%rax", 64 - mem->bit_width);
-      else
-        println("  sar $%d, %%rax", 64 - mem->bit_width);
+  if (op == ND_ADD || op == ND_SUB) {
+    if (op == ND_SUB)
+      println("  neg %%rax");
+    println("  mov %%rax, %%rdx");
+    println("  lock xadd %s, (%%rdi)", reg_dx(sz));
+    println("  %s %%rdx, %%rax", node->fetch_new ? "add" : "mov");
+  } else {
+    int c = count();
+    println("  mov %%rax, %%rsi");
+    println("  mov (%%rdi), %s", reg_ax(sz));
+    println(".L.fetch.%d:", c);
+    println("  mov %%rax, %%rdx");
+    println("  %s %%rsi, %%rdx", insn);
+    println("  lock cmpxchg %s, (%%rdi)", reg_dx(sz));
+    println("  jne .L.fetch.%d", c);
+    if (node->fetch_new)
+      println("  mov %%rdx, %%rax");
+  }
+
+  char *ext = node->ty->is_unsigned ? "movz" : "movs";
+  if (sz == 1)
+    println("  %sbl %%al, %%eax", ext);
+  else if (sz == 2)
+    println("  %swl %%ax, %%eax", ext);
+}
+
+static int log2_of(unsigned long val) {
+  int n = 0;
+  while (val >>= 1)
+    n++;
+  return n;
+}
+
+static bool is_pow2(unsigned long val) {
+  return val && !(val & (val - 1));
+}
+
+// Returns true if `c` is 2^shift, 3*2^shift, 5*2^shift or 9*2^shift,
+// so that a multiplication by `c` can be done with lea and shl.
+// `lea` is set to 0, 2, 4 or 8 accordingly.
+static bool split_mul_imm(long c, int *lea, int *shift) {
+  static int factors[] = {1, 3, 5, 9};
+
+  for (int i = 0; i < 4; i++) {
+    if (c > 0 && c % factors[i] == 0 && is_pow2(c / factors[i])) {
+      *lea = factors[i] - 1;
+      *shift = log2_of(c / factors[i]);
+      return true;
     }
-    return;
   }
-  case ND_DEREF:
-    gen_expr(node->lhs);
-    load(node->ty);
-    return;
-  case ND_ADDR:
-    gen_addr(node->lhs);
-    return;
-  case ND_ASSIGN:
-    gen_addr(node->lhs);
-    push();
-    gen_expr(node->rhs);
+  return false;
+}
+
+static void gen_mul_imm(char *r64, char *r, int lea, int shift) {
+  if (lea)
+    println("  lea (%s,%s,%d), %s", r64, r64, lea, r);
+  if (shift)
+    println("  shl $%d, %s", shift, r);
+}
 
-    if (node->lhs->kind == ND_MEMBER && node->lhs->member->is_bitfield) {
-      println("  mov %%rax, %%r8");
+// Magic numbers for division by a constant with a multiplication.
+// See section 10 of "Hacker's Delight" by Henry S. Warren, Jr. All
+// arithmetic is done modulo 2^bits.
+typedef struct {
+  unsigned long m;
+  int s;
+  bool add;
+} Magic;
+
+static Magic magic_signed(long d, int bits) {
+  unsigned long mask = (bits == 64) ? -1UL : 0xffffffffUL;
+  unsigned long two = 1UL << (bits - 1);
+  unsigned long ad = (d < 0) ? -(unsigned long)d : d;
+  unsigned long t = two + (d < 0);
+  unsigned long anc = t - 1 - t % ad;
+  unsigned long q1 = two / anc;
+  unsigned long r1 = two - q1 * anc;
+  unsigned long q2 = two / ad;
+  unsigned long r2 = two - q2 * ad;
+  unsigned long delta;
+  int p = bits - 1;
+
+  do {
+    p++;
+    q1 = (q1 * 2) & mask;
+    r1 = (r1 * 2) & mask;
+    if (r1 >= anc) {
+      q1++;
+      r1 -= anc;
+    }
+    q2 = (q2 * 2) & mask;
+    r2 = (r2 * 2) & mask;
+    if (r2 >= ad) {
+      q2++;
+      r2 -= ad;
+    }
+    delta = ad - r2;
+  } while (q1 < delta || (q1 == delta && r1 == 0));
 
-      // If the lhs is a bitfield, we need to read the current value
-      // from memory and merge it with a new value.
-      Member *mem = node->lhs->member;
-      println("  mov %%rax, %%rdi");
-      println("  and $%ld, %%rdi", (1L << mem->bit_width) - 1);
-      println("  shl $%d, %%rdi", mem->bit_offset);
-
-      println("  mov (%%rsp), %%rax");
-      load(mem->ty);
-
-      long mask = ((1L << mem->bit_width) - 1) << mem->bit_offset;
-      println("  mov $%ld, %%r9", ~mask);
-      println("  and %%r9, %%rax");
-      println("  or %%rdi, %%rax");
-      store(node->ty);
-      println("  mov %%r8, %%rax");
-      return;
+  Magic mag = {(q2 + 1) & mask, p - bits, false};
+  if (d < 0)
+    mag.m = -mag.m & mask;
+  return mag;
+}
+
+static Magic magic_unsigned(unsigned long d, int bits) {
+  unsigned long mask = (bits == 64) ? -1UL : 0xffffffffUL;
+  unsigned long two = 1UL << (bits - 1);
+  unsigned long nc = mask - (-d & mask) % d;
+  unsigned long q1 = two / nc;
+  unsigned long r1 = two - q1 * nc;
+  unsigned long q2 = (two - 1) / d;
+  unsigned long r2 = (two - 1) - q2 * d;
+  unsigned long delta;
+  int p = bits - 1;
+  bool add = false;
+
+  do {
+    p++;
+    if (r1 >= nc - r1) {
+      q1 = (q1 * 2 + 1) & mask;
+      r1 = (r1 * 2 - nc) & mask;
+    } else {
+      q1 = (q1 * 2) & mask;
+      r1 = (r1 * 2) & mask;
     }
+    if (r2 + 1 >= d - r2) {
+      if (q2 >= two - 1)
+        add = true;
+      q2 = (q2 * 2 + 1) & mask;
+      r2 = (r2 * 2 + 1 - d) & mask;
+    } else {
+      if (q2 >= two)
+        add = true;
+      q2 = (q2 * 2) & mask;
+      r2 = (r2 * 2 + 1) & mask;
+    }
+    delta = d - 1 - r2;
+  } while (p < bits * 2 && (q1 < delta || (q1 == delta && r1 == 0)));
+
+  return (Magic){(q2 + 1) & mask, p - bits, add};
+}
 
-    store(node->ty);
+// Divide %rax by a nonzero constant `d` without a div instruction,
+// leaving the quotient or the remainder in %rax. %rcx and %rdx are
+// clobbered.
+static void gen_div_imm(long d, int sz, bool is_unsigned, bool is_mod) {
+  int bits = sz * 8;
+  unsigned long mask = (sz == 8) ? -1UL : 0xffffffffUL;
+  char *ax = (sz == 8) ? "%rax" : "%eax";
+  char *cx = (sz == 8) ? "%rcx" : "%ecx";
+  char *dx = (sz == 8) ? "%rdx" : "%edx";
+
+  if (sz == 4 && is_unsigned)
+    d = (unsigned)d;
+  else if (sz == 4)
+    d = (int)d;
+  unsigned long ad = (!is_unsigned && d < 0) ? -(unsigned long)d & mask : d & mask;
+
+  if (ad == 1) {
+    if (is_mod)
+      println("  xor %%eax, %%eax");
+    else if (d < 0 && !is_unsigned)
+      println("  neg %s", ax);
     return;
-  case ND_STMT_EXPR:
-    for (Node *n = node->body; n; n = n->next)
-      gen_stmt(n);
+  }
+
+  // Division by 2^k is a shift. Negative dividends are rounded toward
+  // zero by adding 2^k-1 first.
+  if (is_pow2(ad)) {
+    int k = log2_of(ad);
+    if (!is_unsigned) {
+      println("  mov %s, %s", ax, dx);
+      if (k > 1)
+        println("  sar $%d, %s", bits - 1, dx);
+      println("  shr $%d, %s", bits - k, dx);
+      println("  add %s, %s", dx, ax);
+    }
+
+    if (is_mod) {
+      if (ad - 1 == (int)(ad - 1)) {
+        println("  and $%ld, %s", ad - 1, ax);
+      } else {
+        println("  mov $%ld, %%rcx", ad - 1);
+        println("  and %%rcx, %%rax");
+      }
+      if (!is_unsigned)
+        println("  sub %s, %s", dx, ax);
+    } else if (is_unsigned) {
+      println("  shr $%d, %s", k, ax);
+    } else {
+      println("  sar $%d, %s", k, ax);
+      if (d < 0)
+        println("  neg %s", ax);
+    }
     return;
-  case ND_COMMA:
+  }
+
+  // Compute the high half of the product of the dividend and a magic
+  // number in %rdx. The dividend is kept in %rcx.
+  if (is_unsigned) {
+    Magic mag = magic_unsigned(ad, bits);
+    if (sz == 4) {
+      println("  mov %%eax, %%ecx");
+      println("  mov $%lu, %%edx", mag.m);
+      println("  imul %%rcx, %%rdx");
+      println("  shr $32, %%rdx");
+    } else {
+      println("  mov %%rax, %%rcx");
+      println("  mov $%ld, %%rdx", (long)mag.m);
+      println("  mul %%rdx");
+    }
+
+    if (mag.add) {
+      println("  mov %s, %s", cx, ax);
+      println("  sub %s, %s", dx, ax);
+      println("  shr $1, %s", ax);
+      println("  add %s, %s", dx, ax);
+      if (mag.s > 1)
+        println("  shr $%d, %s", mag.s - 1, ax);
+    } else {
+      println("  mov %s, %s", dx, ax);
+      if (mag.s)
+        println("  shr $%d, %s", mag.s, ax);
+    }
+  } else {
+    Magic mag = magic_signed(d, bits);
+    if (sz == 4) {
+      println("  movslq %%eax, %%rcx");
+      println("  imul $%d, %%rcx, %%rdx", (int)mag.m);
+      println("  sar $32, %%rdx");
+    } else {
+      println("  mov %%rax, %%rcx");
+      println("  mov $%ld, %%rdx", (long)mag.m);
+      println("  imul %%rdx");
+    }
+
+    bool m_neg = (mag.m >> (bits - 1)) & 1;
+    if (d > 0 && m_neg)
+      println("  add %s, %s", cx, dx);
+    if (d < 0 && !m_neg)
+      println("  sub %s, %s", cx, dx);
+    if (mag.s)
+      println("  sar $%d, %s", mag.s, dx);
+
+    // Round toward zero by adding 1 to a negative quotient.
+    println("  mov %s, %s", dx, ax);
+    println("  shr $%d, %s", bits - 1, ax);
+    println("  add %s, %s", dx, ax);
+  }
+
+  // The remainder is the dividend minus the quotient times `d`.
+  if (is_mod) {
+    if (d == (int)d) {
+      println("  imul $%ld, %s, %s", d, ax, ax);
+    } else {
+      println("  mov $%ld, %s", d, dx);
+      println("  imul %s, %s", dx, ax);
+    }
+    println("  sub %s, %s", ax, cx);
+    println("  mov %s, %s", cx, ax);
+  }
+}
+
+// Generate code for a given node.
+// Evaluate the operands of an integer binary operator. The lhs is
+// left in %rax, and the returned operand refers to the rhs. The rhs
+// is used directly as an instruction operand if possible. Otherwise,
+// the operand that needs more temporaries is evaluated first, and the
+// other one is kept in a scratch register.
+static char *gen_int_operands(Node *node, bool is64) {
+  char *di;
+  if (node->kind != ND_SHL && node->kind != ND_SHR)
+    di = src_operand(node->rhs, is64 ? 8 : 4);
+  else if (node->rhs->kind == ND_NUM && 0 <= node->rhs->val && node->rhs->val < 64)
+    di = format("$%ld", node->rhs->val);
+  else
+    di = NULL;
+
+  if (di) {
+    gen_expr(node->lhs);
+    return di;
+  }
+
+  if (need_tmp(node->lhs) > need_tmp(node->rhs)) {
+    gen_expr(node->lhs);
+    int r = push_tmp();
+    gen_expr(node->rhs);
+    println("  mov %%rax, %%rdi");
+    pop_tmp(r, "%rax");
+    return is64 ? "%rdi" : "%edi";
+  }
+
+  gen_expr(node->rhs);
+  int r = push_tmp();
+  gen_expr(node->lhs);
+  return pop_tmp_operand(r, is64);
+}
+
+// Evaluate `x` to %xmm0 and return an operand referring to `y`. `y`
+// is read from memory if it is a local variable of the same type.
+// Otherwise it is evaluated first and kept as a temporary.
+static char *gen_flo_operands(Node *x, Node *y) {
+  if (y->kind == ND_VAR && y->var->is_local && y->ty->kind == x->ty->kind) {
+    gen_expr(x);
+    return format("%d(%%rbp)", y->var->offset);
+  }
+
+  gen_expr(y);
+  int r = push_ftmp(x);
+  gen_expr(x);
+  return pop_ftmp(r);
+}
+
+// Generate code that jumps to `label` if `node` is true when `cond`
+// is true, or if `node` is false when `cond` is false, and falls
+// through otherwise. Comparisons and logical operators are compiled
+// to conditional jumps without computing a boolean value.
+static void gen_branch(Node *node, bool cond, char *label) {
+  switch (node->kind) {
+  case ND_NUM:
+    if (is_integer(node->ty)) {
+      if ((node->val != 0) == cond)
+        println("  jmp %s", label);
+      return;
+    }
+    break;
+  case ND_NOT:
+    gen_branch(node->lhs, !cond, label);
+    return;
+  case ND_LOGAND:
+  case ND_LOGOR:
+    // `a && b` jumps if false as soon as either operand is false.
+    // `a || b` jumps if true as soon as either operand is true.
+    if ((node->kind == ND_LOGOR) == cond) {
+      gen_branch(node->lhs, cond, label);
+      gen_branch(node->rhs, cond, label);
+    } else {
+      char *skip = format(".L.skip.%d", count());
+      gen_branch(node->lhs, !cond, skip);
+      gen_branch(node->rhs, cond, label);
+      println("%s:", skip);
+    }
+    return;
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE: {
+    Type *ty = node->lhs->ty;
+
+    if (ty->kind == TY_FLOAT || ty->kind == TY_DOUBLE) {
+      char *op = gen_flo_operands(node->rhs, node->lhs);
+      println("  ucomi%s %s, %%xmm0", (ty->kind == TY_FLOAT) ? "ss" : "sd", op);
+
+      // An unordered comparison sets ZF, PF and CF. Only `!=` is true
+      // for a NaN operand.
+      switch (node->kind) {
+      case ND_LT:
+        println("  j%s %s", cond ? "a" : "be", label);
+        return;
+      case ND_LE:
+        println("  j%s %s", cond ? "ae" : "b", label);
+        return;
+      }
+
+      if ((node->kind == ND_EQ) == cond) {
+        char *skip = format(".L.skip.%d", count());
+        println("  jp %s", skip);
+        println("  je %s", label);
+        println("%s:", skip);
+      } else {
+        println("  jp %s", label);
+        println("  jne %s", label);
+      }
+      return;
+    }
+
+    if (ty->kind == TY_LDOUBLE)
+      break;
+
+    bool is64 = ty->kind == TY_LONG || ty->base;
+    char *di = gen_int_operands(node, is64);
+    char *cc = int_cond(node->kind, ty->is_unsigned);
+    println("  cmp %s, %s", di, is64 ? "%rax" : "%eax");
+    println("  j%s %s", cond ? cc : negate_cond(cc), label);
+    return;
+  }
+  }
+
+  gen_expr(node);
+  cmp_zero(node->ty);
+  println("  j%s %s", cond ? "ne" : "e", label);
+}
+
+static void gen_expr(Node *node) {
+  println("  .loc %d %d", node->tok->file->file_no, node->tok->line_no);
+
+  switch (node->kind) {
+  case ND_NULL_EXPR:
+    return;
+  case ND_NUM: {
+    switch (node->ty->kind) {
+    case TY_FLOAT: {
+      union { float f32; uint32_t u32; } u = { node->fval };
+      println("  mov $%u, %%eax  # float %Lf", u.u32, node->fval);
+      println("  movq %%rax, %%xmm0");
+      return;
+    }
+    case TY_DOUBLE: {
+      union { double f64; uint64_t u64; } u = { node->fval };
+      println("  mov $%lu, %%rax  # double %Lf", u.u64, node->fval);
+      println("  movq %%rax, %%xmm0");
+      return;
+    }
+    case TY_LDOUBLE: {
+      union { long double f80; uint64_t u64[2]; } u;
+      memset(&u, 0, sizeof(u));
+      u.f80 = node->fval;
+      println("  mov $%lu, %%rax  # long double %Lf", u.u64[0], node->fval);
+      println("  mov %%rax, -16(%%rsp)");
+      println("  mov $%lu, %%rax", u.u64[1]);
+      println("  mov %%rax, -8(%%rsp)");
+      println("  fldt -16(%%rsp)");
+      return;
+    }
+    }
+
+    println("  mov $%ld, %%rax", node->val);
+    return;
+  }
+  case ND_NEG:
+    gen_expr(node->lhs);
+
+    switch (node->ty->kind) {
+    case TY_FLOAT:
+      println("  mov $1, %%rax");
+      println("  shl $31, %%rax");
+      println("  movq %%rax, %%xmm1");
+      println("  xorps %%xmm1, %%xmm0");
+      return;
+    case TY_DOUBLE:
+      println("  mov $1, %%rax");
+      println("  shl $63, %%rax");
+      println("  movq %%rax, %%xmm1");
+      println("  xorpd %%xmm1, %%xmm0");
+      return;
+    case TY_LDOUBLE:
+      println("  fchs");
+      return;
+    }
+
+    println("  neg %%rax");
+    return;
+  case ND_VAR:
+    gen_addr(node);
+    load(node->ty);
+    return;
+  case ND_MEMBER: {
+    gen_addr(node);
+    load(node->ty);
+
+    // An unsigned bitfield is extracted with shr and and, a signed one
+    // with shl and sar.
+    Member *mem = node->member;
+    if (mem->is_bitfield) {
+      int bits = mem->ty->size * 8;
+      if ((mem->ty->is_unsigned || mem->ty->kind == TY_BOOL) && mem->bit_width < 32) {
+        char *ax = (bits == 64) ? "%rax" : "%eax";
+        if (mem->bit_offset)
+          println("  shr $%d, %s", mem->bit_offset, ax);
+        if (mem->bit_offset + mem->bit_width < bits)
+          println("  and $%ld, %%eax", (1L << mem->bit_width) - 1);
+      } else {
+        if (64 - mem->bit_width - mem->bit_offset)
+          println("  shl $%d, %%rax", 64 - mem->bit_width - mem->bit_offset);
+        println("  %s $%d, %%rax", mem->ty->is_unsigned ? "shr" : "sar", 64 - mem->bit_width);
+      }
+    }
+    return;
+  }
+  case ND_DEREF:
+    gen_expr(node->lhs);
+    load(node->ty);
+    return;
+  case ND_ADDR:
+    gen_addr(node->lhs);
+    return;
+  case ND_ASSIGN: {
+    Node *lhs = node->lhs;
+
+    // Store directly to a local variable.
+    if (lhs->kind == ND_VAR && lhs->var->is_local && lhs->ty->kind != TY_VLA) {
+      gen_expr(node->rhs);
+      store(node->ty, lhs->var->offset, "%rbp");
+      return;
+    }
+
+    // If the lhs is a bitfield, we need to read the current value
+    // from memory and merge it with a new value.
+    if (lhs->kind == ND_MEMBER && lhs->member->is_bitfield) {
+      int offset;
+      if (local_offset(lhs, &offset)) {
+        gen_expr(node->rhs);
+        store_bitfield(lhs->member, node->rhs, offset, "%rbp");
+        return;
+      }
+
+      gen_addr(lhs);
+      int r = push_tmp();
+      gen_expr(node->rhs);
+      store_bitfield(lhs->member, node->rhs, 0, pop_tmp_operand(r, true));
+      return;
+    }
+
+    gen_addr(lhs);
+    int r = push_tmp();
+    gen_expr(node->rhs);
+    store(node->ty, 0, pop_tmp_operand(r, true));
+    return;
+  }
+  case ND_STMT_EXPR:
+    for (Node *n = node->body; n; n = n->next) {
+      if (!n->next && n->kind == ND_EXPR_STMT)
+        gen_expr(n->lhs);
+      else
+        gen_stmt(n);
+    }
+    return;
+  case ND_COMMA:
     gen_expr(node->lhs);
     gen_expr(node->rhs);
     return;
@@ -815,17 +1664,11 @@ static void gen_expr(Node *node) {
     cast(node->lhs->ty, node->ty);
     return;
   case ND_MEMZERO:
-    // `rep stosb` is equivalent to `memset(%rdi, %al, %rcx)`.
-    println("  mov $%d, %%rcx", node->var->ty->size);
-    println("  lea %d(%%rbp), %%rdi", node->var->offset);
-    println("  mov $0, %%al");
-    println("  rep stosb");
+    zero_mem("%rbp", node->var->offset + node->zero_offset, node->zero_size);
     return;
   case ND_COND: {
     int c = count();
-    gen_expr(node->cond);
-    cmp_zero(node->cond->ty);
-    println("  je .L.else.%d", c);
+    gen_branch(node->cond, false, format(".L.else.%d", c));
     gen_expr(node->then);
     println("  jmp .L.end.%d", c);
     println(".L.else.%d:", c);
@@ -845,12 +1688,7 @@ static void gen_expr(Node *node) {
     return;
   case ND_LOGAND: {
     int c = count();
-    gen_expr(node->lhs);
-    cmp_zero(node->lhs->ty);
-    println("  je .L.false.%d", c);
-    gen_expr(node->rhs);
-    cmp_zero(node->rhs->ty);
-    println("  je .L.false.%d", c);
+    gen_branch(node, false, format(".L.false.%d", c));
     println("  mov $1, %%rax");
     println("  jmp .L.end.%d", c);
     println(".L.false.%d:", c);
@@ -860,12 +1698,7 @@ static void gen_expr(Node *node) {
   }
   case ND_LOGOR: {
     int c = count();
-    gen_expr(node->lhs);
-    cmp_zero(node->lhs->ty);
-    println("  jne .L.true.%d", c);
-    gen_expr(node->rhs);
-    cmp_zero(node->rhs->ty);
-    println("  jne .L.true.%d", c);
+    gen_branch(node, true, format(".L.true.%d", c));
     println("  mov $0, %%rax");
     println("  jmp .L.end.%d", c);
     println(".L.true.%d:", c);
@@ -972,14 +1805,14 @@ static void gen_expr(Node *node) {
     return;
   case ND_CAS: {
     gen_expr(node->cas_addr);
-    push();
+    int r1 = push_tmp();
     gen_expr(node->cas_new);
-    push();
+    int r2 = push_tmp();
     gen_expr(node->cas_old);
     println("  mov %%rax, %%r8");
     load(node->cas_old->ty->base);
-    pop("%rdx"); // new
-    pop("%rdi"); // addr
+    pop_tmp(r2, "%rdx"); // new
+    pop_tmp(r1, "%rdi"); // addr
 
     int sz = node->cas_addr->ty->base->size;
     println("  lock cmpxchg %s, (%%rdi)", reg_dx(sz));
@@ -992,44 +1825,47 @@ static void gen_expr(Node *node) {
   }
   case ND_EXCH: {
     gen_expr(node->lhs);
-    push();
+    int r = push_tmp();
     gen_expr(node->rhs);
-    pop("%rdi");
+    pop_tmp(r, "%rdi");
 
     int sz = node->lhs->ty->base->size;
     println("  xchg %s, (%%rdi)", reg_ax(sz));
     return;
   }
+  case ND_FETCH_OP:
+    gen_fetch_op(node, false);
+    return;
+  case ND_FENCE:
+    println("  mfence");
+    return;
   }
 
   switch (node->lhs->ty->kind) {
   case TY_FLOAT:
   case TY_DOUBLE: {
-    gen_expr(node->rhs);
-    pushf();
-    gen_expr(node->lhs);
-    popf(1);
-
     char *sz = (node->lhs->ty->kind == TY_FLOAT) ? "ss" : "sd";
 
     switch (node->kind) {
     case ND_ADD:
-      println("  add%s %%xmm1, %%xmm0", sz);
+      println("  add%s %s, %%xmm0", sz, gen_flo_operands(node->lhs, node->rhs));
       return;
     case ND_SUB:
-      println("  sub%s %%xmm1, %%xmm0", sz);
+      println("  sub%s %s, %%xmm0", sz, gen_flo_operands(node->lhs, node->rhs));
       return;
     case ND_MUL:
-      println("  mul%s %%xmm1, %%xmm0", sz);
+      println("  mul%s %s, %%xmm0", sz, gen_flo_operands(node->lhs, node->rhs));
       return;
     case ND_DIV:
-      println("  div%s %%xmm1, %%xmm0", sz);
+      println("  div%s %s, %%xmm0", sz, gen_flo_operands(node->lhs, node->rhs));
       return;
     case ND_EQ:
     case ND_NE:
     case ND_LT:
     case ND_LE:
-      println("  ucomi%s %%xmm0, %%xmm1", sz);
+      // The rhs is compared with the lhs, so that "above" is false for
+      // unordered operands.
+      println("  ucomi%s %s, %%xmm0", sz, gen_flo_operands(node->rhs, node->lhs));
 
       if (node->kind == ND_EQ) {
         println("  sete %%al");
@@ -1093,23 +1929,30 @@ static void gen_expr(Node *node) {
   }
   }
 
-  gen_expr(node->rhs);
-  push();
-  gen_expr(node->lhs);
-  pop("%rdi");
+  bool is64 = node->lhs->ty->kind == TY_LONG || node->lhs->ty->base;
+  char *ax = is64 ? "%rax" : "%eax";
+  char *dx = is64 ? "%rdx" : "%edx";
+  char *di;
 
-  char *ax, *di, *dx;
+  // Division and multiplication by constants don't need div or imul.
+  long val;
+  if ((node->kind == ND_DIV || node->kind == ND_MOD) &&
+      is_int_const(node->rhs, &val) && val) {
+    gen_expr(node->lhs);
+    gen_div_imm(val, is64 ? 8 : 4, node->ty->is_unsigned, node->kind == ND_MOD);
+    return;
+  }
 
-  if (node->lhs->ty->kind == TY_LONG || node->lhs->ty->base) {
-    ax = "%rax";
-    di = "%rdi";
-    dx = "%rdx";
-  } else {
-    ax = "%eax";
-    di = "%edi";
-    dx = "%edx";
+  int lea, shift;
+  if (node->kind == ND_MUL && is_int_const(node->rhs, &val) &&
+      split_mul_imm(val, &lea, &shift)) {
+    gen_expr(node->lhs);
+    gen_mul_imm("%rax", ax, lea, shift);
+    return;
   }
 
+  di = gen_int_operands(node, is64);
+
   switch (node->kind) {
   case ND_ADD:
     println("  add %s, %s", di, ax);
@@ -1122,6 +1965,12 @@ static void gen_expr(Node *node) {
     return;
   case ND_DIV:
   case ND_MOD:
+    // div and idiv don't take an immediate operand.
+    if (di[0] != '%') {
+      println("  mov %s, %s", di, is64 ? "%rdi" : "%edi");
+      di = is64 ? "%rdi" : "%edi";
+    }
+
     if (node->ty->is_unsigned) {
       println("  mov $0, %s", dx);
       println("  div %s", di);
@@ -1150,50 +1999,138 @@ static void gen_expr(Node *node) {
   case ND_LT:
   case ND_LE:
     println("  cmp %s, %s", di, ax);
-
-    if (node->kind == ND_EQ) {
-      println("  sete %%al");
-    } else if (node->kind == ND_NE) {
-      println("  setne %%al");
-    } else if (node->kind == ND_LT) {
-      if (node->lhs->ty->is_unsigned)
-        println("  setb %%al");
-      else
-        println("  setl %%al");
-    } else if (node->kind == ND_LE) {
-      if (node->lhs->ty->is_unsigned)
-        println("  setbe %%al");
-      else
-        println("  setle %%al");
-    }
-
+    println("  set%s %%al", int_cond(node->kind, node->lhs->ty->is_unsigned));
     println("  movzb %%al, %%rax");
     return;
   case ND_SHL:
-    println("  mov %%rdi, %%rcx");
-    println("  shl %%cl, %s", ax);
-    return;
-  case ND_SHR:
-    println("  mov %%rdi, %%rcx");
-    if (node->lhs->ty->is_unsigned)
-      println("  shr %%cl, %s", ax);
+  case ND_SHR: {
+    char *cnt = di;
+    if (di[0] != '$') {
+      println("  mov %s, %s", di, is64 ? "%rcx" : "%ecx");
+      cnt = "%cl";
+    }
+
+    if (node->kind == ND_SHL)
+      println("  shl %s, %s", cnt, ax);
+    else if (node->lhs->ty->is_unsigned)
+      println("  shr %s, %s", cnt, ax);
     else
-      println("  sar %%cl, %s", ax);
+      println("  sar %s, %s", cnt, ax);
     return;
   }
+  }
 
   error_tok(node->tok, "invalid expression");
 }
 
+// Cases are sorted by value by the parser. A jump table is used if
+// they are dense enough, a binary search if there are many of them,
+// and a chain of comparisons otherwise.
+SwitchKind switch_kind(Node *node) {
+  int n = 0;
+  unsigned long covered = 0;
+  Node *last = NULL;
+  for (Node *c = node->case_next; c; c = c->case_next) {
+    n++;
+    covered += c->end - c->begin + 1;
+    last = c;
+  }
+
+  if (n < 4)
+    return SWITCH_CHAIN;
+
+  unsigned long span = last->end - node->case_next->begin + 1;
+  if (span && span <= 4096 && span <= covered * 3)
+    return SWITCH_TABLE;
+  return SWITCH_TREE;
+}
+
+static char *default_label(Node *node) {
+  return node->default_case ? node->default_case->label : node->brk_label;
+}
+
+// Returns an operand for a case value. A 64-bit value that doesn't
+// fit in an immediate is loaded to %rdx.
+static char *case_operand(Node *node, long val) {
+  if (node->cond->ty->size < 8 || val == (int)val)
+    return format("$%ld", val);
+  println("  movabs $%ld, %%rdx", val);
+  return "%rdx";
+}
+
+// Jump to the label of case `c` if it matches the value in %rax.
+static void gen_case_test(Node *node, Node *c) {
+  char *ax = (node->cond->ty->size == 8) ? "%rax" : "%eax";
+  char *di = (node->cond->ty->size == 8) ? "%rdi" : "%edi";
+
+  if (c->begin == c->end) {
+    println("  cmp %s, %s", case_operand(node, c->begin), ax);
+    println("  je %s", c->label);
+    return;
+  }
+
+  // [GNU] Case ranges
+  println("  mov %s, %s", ax, di);
+  println("  sub %s, %s", case_operand(node, c->begin), di);
+  println("  cmp %s, %s", case_operand(node, c->end - c->begin), di);
+  println("  jbe %s", c->label);
+}
+
+// Binary search over cases[lo, hi), which are sorted by value.
+static void gen_case_tree(Node *node, Node **cases, int lo, int hi) {
+  if (hi - lo <= 3) {
+    for (int i = lo; i < hi; i++)
+      gen_case_test(node, cases[i]);
+    println("  jmp %s", default_label(node));
+    return;
+  }
+
+  Type *ty = node->cond->ty;
+  int mid = (lo + hi) / 2;
+  int c = count();
+  println("  cmp %s, %s", case_operand(node, cases[mid]->begin), (ty->size == 8) ? "%rax" : "%eax");
+  println("  %s .L.case.%d", (ty->is_unsigned && ty->size >= 4) ? "jae" : "jge", c);
+  gen_case_tree(node, cases, lo, mid);
+  println(".L.case.%d:", c);
+  gen_case_tree(node, cases, mid, hi);
+}
+
+// Jump through a table indexed by the value minus the smallest case.
+// The table holds offsets of labels from the table itself.
+static void gen_jump_table(Node *node, Node **cases, int n) {
+  char *di = (node->cond->ty->size == 8) ? "%rdi" : "%edi";
+  long min = cases[0]->begin;
+  unsigned long span = cases[n - 1]->end - min + 1;
+  int c = count();
+
+  println("  mov %s, %s", (node->cond->ty->size == 8) ? "%rax" : "%eax", di);
+  println("  sub %s, %s", case_operand(node, min), di);
+  println("  cmp $%lu, %s", span - 1, di);
+  println("  ja %s", default_label(node));
+  println("  lea .L.switch.%d(%%rip), %%rdx", c);
+  println("  movslq (%%rdx,%%rdi,4), %%rdi");
+  println("  add %%rdx, %%rdi");
+  println("  jmp *%%rdi");
+
+  println("  .section .rodata");
+  println("  .align 4");
+  println(".L.switch.%d:", c);
+  for (int i = 0, j = 0; i < span; i++) {
+    while (cases[j]->end - min < i)
+      j++;
+    char *label = (cases[j]->begin - min <= i) ? cases[j]->label : default_label(node);
+    println("  .long %s-.L.switch.%d", label, c);
+  }
+  println("  .text");
+}
+
 static void gen_stmt(Node *node) {
   println("  .loc %d %d", node->tok->file->file_no, node->tok->line_no);
 
   switch (node->kind) {
   case ND_IF: {
     int c = count();
-    gen_expr(node->cond);
-    cmp_zero(node->cond->ty);
-    println("  je  .L.else.%d", c);
+    gen_branch(node->cond, false, format(".L.else.%d", c));
     gen_stmt(node->then);
     println("  jmp .L.end.%d", c);
     println(".L.else.%d:", c);
@@ -1207,11 +2144,8 @@ static void gen_stmt(Node *node) {
     if (node->init)
       gen_stmt(node->init);
     println(".L.begin.%d:", c);
-    if (node->cond) {
-      gen_expr(node->cond);
-      cmp_zero(node->cond->ty);
-      println("  je %s", node->brk_label);
-    }
+    if (node->cond)
+      gen_branch(node->cond, false, node->brk_label);
     gen_stmt(node->then);
     println("%s:", node->cont_label);
     if (node->inc)
@@ -1225,39 +2159,38 @@ static void gen_stmt(Node *node) {
     println(".L.begin.%d:", c);
     gen_stmt(node->then);
     println("%s:", node->cont_label);
-    gen_expr(node->cond);
-    cmp_zero(node->cond->ty);
-    println("  jne .L.begin.%d", c);
+    gen_branch(node->cond, true, format(".L.begin.%d", c));
     println("%s:", node->brk_label);
     return;
   }
-  case ND_SWITCH:
+  case ND_SWITCH: {
     gen_expr(node->cond);
 
-    for (Node *n = node->case_next; n; n = n->case_next) {
-      char *ax = (node->cond->ty->size == 8) ? "%rax" : "%eax";
-      char *di = (node->cond->ty->size == 8) ? "%rdi" : "%edi";
-
-      if (n->begin == n->end) {
-        println("  cmp $%ld, %s", n->begin, ax);
-        println("  je %s", n->label);
-        continue;
-      }
-
-      // [GNU] Case ranges
-      println("  mov %s, %s", ax, di);
-      println("  sub $%ld, %s", n->begin, di);
-      println("  cmp $%ld, %s", n->end - n->begin, di);
-      println("  jbe %s", n->label);
+    int n = 0;
+    for (Node *c = node->case_next; c; c = c->case_next)
+      n++;
+    Node **cases = calloc(n, sizeof(Node *));
+    int i = 0;
+    for (Node *c = node->case_next; c; c = c->case_next)
+      cases[i++] = c;
+
+    switch (switch_kind(node)) {
+    case SWITCH_TABLE:
+      gen_jump_table(node, cases, n);
+      break;
+    case SWITCH_TREE:
+      gen_case_tree(node, cases, 0, n);
+      break;
+    default:
+      for (i = 0; i < n; i++)
+        gen_case_test(node, cases[i]);
+      println("  jmp %s", default_label(node));
     }
 
-    if (node->default_case)
-      println("  jmp %s", node->default_case->label);
-
-    println("  jmp %s", node->brk_label);
     gen_stmt(node->then);
     println("%s:", node->brk_label);
     return;
+  }
   case ND_CASE:
     println("%s:", node->label);
     gen_stmt(node->lhs);
@@ -1296,40 +2229,972 @@ static void gen_stmt(Node *node) {
     println("  jmp .L.return.%s", current_fn->name);
     return;
   case ND_EXPR_STMT:
-    gen_expr(node->lhs);
+    if (node->lhs->kind == ND_FETCH_OP)
+      gen_fetch_op(node->lhs, true);
+    else
+      gen_expr(node->lhs);
     return;
   case ND_ASM:
+    println("#APP");
     println("  %s", node->asm_str);
+    println("#NO_APP");
     return;
   }
 
   error_tok(node->tok, "invalid statement");
 }
 
-// Assign offsets to local variables.
-static void assign_lvar_offsets(Obj *prog) {
-  for (Obj *fn = prog; fn; fn = fn->next) {
-    if (!fn->is_function)
-      continue;
+//
+// IR backend
+//
 
-    // If a function has many parameters, some parameters are
-    // inevitably passed by stack rather than by register.
-    // The first passed-by-stack parameter resides at RBP+16.
-    int top = 16;
-    int bottom = 0;
+// Registers available to the register allocator. The first NCALLEE
+// ones are callee-saved and are the same as the AST code generator's
+// scratch registers, so that the prologue saves them in the same way.
+// %rax, %rcx, %rdx, %rdi and %r11 are never allocated. They are used as
+// temporaries within an instruction.
+#define NCALLEE 5
+#define NREGS 9
+
+enum { RAX = NREGS, RCX, RDX, RDI, R11 };
+
+static char *regs[][4] = {
+  {"%bl", "%bx", "%ebx", "%rbx"},
+  {"%r12b", "%r12w", "%r12d", "%r12"},
+  {"%r13b", "%r13w", "%r13d", "%r13"},
+  {"%r14b", "%r14w", "%r14d", "%r14"},
+  {"%r15b", "%r15w", "%r15d", "%r15"},
+  {"%sil", "%si", "%esi", "%rsi"},
+  {"%r8b", "%r8w", "%r8d", "%r8"},
+  {"%r9b", "%r9w", "%r9d", "%r9"},
+  {"%r10b", "%r10w", "%r10d", "%r10"},
+  {"%al", "%ax", "%eax", "%rax"},
+  {"%cl", "%cx", "%ecx", "%rcx"},
+  {"%dl", "%dx", "%edx", "%rdx"},
+  {"%dil", "%di", "%edi", "%rdi"},
+  {"%r11b", "%r11w", "%r11d", "%r11"},
+};
 
-    int gp = 0, fp = 0;
+static int argregs[] = {RDI, 5, RDX, RCX, 6, 7};
 
-    // Assign offsets to pass-by-stack parameters.
-    for (Obj *var = fn->params; var; var = var->next) {
-      Type *ty = var->ty;
+#define SPILLED -1
+#define REMAT -2
+
+static _Thread_local int *reg_of;  // Allocated register, SPILLED or REMAT
+static _Thread_local int *slot_of; // Stack slot of a spilled register
+static _Thread_local IR **remat;   // Definition of a rematerializable register
+static _Thread_local int *nuses;
+static _Thread_local int *live_start;
+static _Thread_local int *live_end;
+static _Thread_local int spill_size;
+
+// True if the function makes a call other than a tail call
+static _Thread_local bool has_calls;
+
+// The IR backend addresses the stack frame relative to `frame_base`,
+// which is %rbp, or %rsp if the frame pointer is omitted. In the
+// latter case, %rsp is `frame_bias` bytes below where %rbp would be.
+// Pushes while the body runs are accounted for by move_sp().
+static _Thread_local char *frame_base;
+static _Thread_local int frame_bias;
+
+// Returns a memory operand for `offset` bytes from where %rbp would be.
+static char *frame_addr(long offset) {
+  return format("%ld(%s)", offset + frame_bias, frame_base);
+}
+
+// Record that %rsp has been moved down by `n` bytes.
+static void move_sp(int n) {
+  if (!strcmp(frame_base, "%rsp"))
+    frame_bias += n;
+}
+
+// Condition code of a comparison whose result is used only by the
+// following branch, or NULL
+static _Thread_local char *br_cond;
+
+static char *reg(int r, int sz) {
+  switch (sz) {
+  case 1: return regs[r][0];
+  case 2: return regs[r][1];
+  case 4: return regs[r][2];
+  }
+  return regs[r][3];
+}
+
+static bool fits_imm32(long val) {
+  return val == (int)val;
+}
+
+// An immediate or the address of a local variable doesn't need a
+// register. It is recomputed where it is used.
+static bool is_remat(IR *ir) {
+  return (ir->kind == IR_IMM && fits_imm32(ir->imm)) || ir->kind == IR_LVAR;
+}
+
+// Returns an operand referring to the value of `v`. The address of a
+// local variable is computed into register `tmp`.
+static char *src(int v, int sz, int tmp) {
+  switch (reg_of[v]) {
+  case REMAT:
+    if (remat[v]->kind == IR_IMM)
+      return format("$%ld", remat[v]->imm);
+    println("  lea %s, %s", frame_addr(remat[v]->var->offset), reg(tmp, 8));
+    return reg(tmp, sz);
+  case SPILLED:
+    return frame_addr(slot_of[v]);
+  }
+  return reg(reg_of[v], sz);
+}
+
+// Returns a register holding the value of `v`, loading it to `tmp`
+// if necessary.
+static int in_reg(int v, int tmp) {
+  if (reg_of[v] >= 0)
+    return reg_of[v];
+  char *s = src(v, 8, tmp);
+  if (s[0] != '%')
+    println("  mov %s, %s", s, reg(tmp, 8));
+  return tmp;
+}
+
+// Move the value of `v` to register `r`.
+static void load_to(int r, int v, int sz) {
+  char *s = src(v, sz, r);
+  if (strcmp(s, reg(r, sz)))
+    println("  mov %s, %s", s, reg(r, sz));
+}
+
+// Returns the register an instruction should compute `v` into.
+static int dst_of(int v, int tmp) {
+  return (reg_of[v] >= 0) ? reg_of[v] : tmp;
+}
+
+// Write register `r` to the location of `v`.
+static void set_dst(int v, int r) {
+  if (!nuses[v])
+    return;
+  if (reg_of[v] == SPILLED)
+    println("  mov %s, %s", reg(r, 8), frame_addr(slot_of[v]));
+  else if (reg_of[v] != r)
+    println("  mov %s, %s", reg(r, 8), reg(reg_of[v], 8));
+}
+
+// Returns a memory operand for the address `v` + `off`.
+static char *mem_addr(int v, long off, int tmp) {
+  if (reg_of[v] == REMAT && remat[v]->kind == IR_LVAR)
+    return frame_addr(remat[v]->var->offset + off);
+  return format("%ld(%s)", off, reg(in_reg(v, tmp), 8));
+}
+
+static void emit_binop(IR *ir, char *insn) {
+  int sz = ir->size;
+  int d = dst_of(ir->d, RAX);
+  if (ir->b != ir->a && reg_of[ir->b] == d)
+    d = RAX;
+  load_to(d, ir->a, sz);
+  println("  %s %s, %s", insn, src(ir->b, sz, RCX), reg(d, sz));
+  set_dst(ir->d, d);
+}
+
+static void emit_mul(IR *ir) {
+  int a = ir->a;
+  int b = ir->b;
+  if (reg_of[a] == REMAT && remat[a]->kind == IR_IMM) {
+    a = ir->b;
+    b = ir->a;
+  }
+
+  int lea, shift;
+  if (reg_of[b] != REMAT || remat[b]->kind != IR_IMM ||
+      !split_mul_imm(remat[b]->imm, &lea, &shift)) {
+    emit_binop(ir, "imul");
+    return;
+  }
+
+  int d = dst_of(ir->d, RAX);
+  load_to(d, a, ir->size);
+  gen_mul_imm(reg(d, 8), reg(d, ir->size), lea, shift);
+  set_dst(ir->d, d);
+}
+
+static void emit_shift(IR *ir) {
+  int sz = ir->size;
+  int d = dst_of(ir->d, RAX);
+  if (ir->b != ir->a && reg_of[ir->b] == d)
+    d = RAX;
+
+  char *cnt = "%cl";
+  if (reg_of[ir->b] == REMAT && remat[ir->b]->kind == IR_IMM &&
+      0 <= remat[ir->b]->imm && remat[ir->b]->imm < 256)
+    cnt = format("$%ld", remat[ir->b]->imm);
+  else
+    load_to(RCX, ir->b, 4);
+
+  load_to(d, ir->a, sz);
+  if (ir->kind == IR_SHL)
+    println("  shl %s, %s", cnt, reg(d, sz));
+  else if (ir->is_unsigned)
+    println("  shr %s, %s", cnt, reg(d, sz));
+  else
+    println("  sar %s, %s", cnt, reg(d, sz));
+  set_dst(ir->d, d);
+}
+
+static void emit_div(IR *ir) {
+  int sz = ir->size;
+  load_to(RAX, ir->a, sz);
+
+  if (reg_of[ir->b] == REMAT && remat[ir->b]->kind == IR_IMM && remat[ir->b]->imm) {
+    gen_div_imm(remat[ir->b]->imm, sz, ir->is_unsigned, ir->kind == IR_MOD);
+    set_dst(ir->d, RAX);
+    return;
+  }
+
+  int r = in_reg(ir->b, RCX);
+
+  if (ir->is_unsigned) {
+    println("  mov $0, %%edx");
+    println("  div %s", reg(r, sz));
+  } else {
+    println(sz == 8 ? "  cqo" : "  cdq");
+    println("  idiv %s", reg(r, sz));
+  }
+  set_dst(ir->d, (ir->kind == IR_DIV) ? RAX : RDX);
+}
+
+static void emit_cmp(IR *ir) {
+  int sz = ir->size;
+  char *b = src(ir->b, sz, RCX);
+  int a = in_reg(ir->a, RAX);
+  println("  cmp %s, %s", b, reg(a, sz));
+
+  char *cc;
+  switch (ir->kind) {
+  case IR_EQ: cc = int_cond(ND_EQ, false); break;
+  case IR_NE: cc = int_cond(ND_NE, false); break;
+  case IR_LT: cc = int_cond(ND_LT, ir->is_unsigned); break;
+  default:    cc = int_cond(ND_LE, ir->is_unsigned); break;
+  }
+
+  // If the result is used only by the following branch, the branch
+  // jumps on the flags.
+  IR *next = ir->next;
+  if (next && next->kind == IR_BR && next->a == ir->d && nuses[ir->d] == 1) {
+    br_cond = cc;
+    return;
+  }
+
+  println("  set%s %%al", cc);
+
+  int d = dst_of(ir->d, RAX);
+  println("  movzbl %%al, %s", reg(d, 4));
+  set_dst(ir->d, d);
+}
+
+static void emit_cast(IR *ir) {
+  int d = dst_of(ir->d, RAX);
+  int a = in_reg(ir->a, RAX);
+  char *insn = ir->is_unsigned ? "movz" : "movs";
+
+  if (ir->size == 1)
+    println("  %sbl %s, %s", insn, reg(a, 1), reg(d, 4));
+  else if (ir->size == 2)
+    println("  %swl %s, %s", insn, reg(a, 2), reg(d, 4));
+  else if (ir->is_unsigned)
+    println("  mov %s, %s", reg(a, 4), reg(d, 4));
+  else
+    println("  movsxd %s, %s", reg(a, 4), reg(d, 8));
+  set_dst(ir->d, d);
+}
+
+static void emit_load(IR *ir) {
+  char *m = mem_addr(ir->a, ir->imm, R11);
+  int d = dst_of(ir->d, RAX);
+  Type *ty = ir->ty;
+  char *insn = ty->is_unsigned ? "movz" : "movs";
+
+  // Loads extend values in the same way as load() does.
+  if (ty->size == 1)
+    println("  %sbl %s, %s", insn, m, reg(d, 4));
+  else if (ty->size == 2)
+    println("  %swl %s, %s", insn, m, reg(d, 4));
+  else if (ty->size == 4)
+    println("  movsxd %s, %s", m, reg(d, 8));
+  else
+    println("  mov %s, %s", m, reg(d, 8));
+  set_dst(ir->d, d);
+}
+
+static void emit_store(IR *ir) {
+  int sz = ir->ty->size;
+  char *m = mem_addr(ir->a, ir->imm, R11);
+
+  if (reg_of[ir->b] == REMAT && remat[ir->b]->kind == IR_IMM) {
+    long val = remat[ir->b]->imm;
+    if (sz == 1)
+      println("  movb $%d, %s", (uint8_t)val, m);
+    else if (sz == 2)
+      println("  movw $%d, %s", (uint16_t)val, m);
+    else if (sz == 4)
+      println("  movl $%u, %s", (uint32_t)val, m);
+    else
+      println("  movq $%ld, %s", val, m);
+    return;
+  }
+
+  println("  mov %s, %s", reg(in_reg(ir->b, RAX), sz), m);
+}
+
+static void emit_gvar(IR *ir) {
+  int d = dst_of(ir->d, RAX);
+  char *r = reg(d, 8);
+  Obj *var = ir->var;
+
+  if (opt_fpic) {
+    println("  mov %s@GOTPCREL(%%rip), %s", var->name, r);
+  } else if (var->is_tls) {
+    println("  mov %%fs:0, %s", r);
+    println("  add $%s@tpoff, %s", var->name, r);
+  } else if (var->ty->kind == TY_FUNC && !var->is_definition) {
+    println("  mov %s@GOTPCREL(%%rip), %s", var->name, r);
+  } else {
+    println("  lea %s(%%rip), %s", var->name, r);
+  }
+  set_dst(ir->d, d);
+}
+
+static void emit_call(IR *ir) {
+  // The callee's register may be overwritten while arguments are
+  // set up, so it is moved out of the way first.
+  if (!ir->var)
+    load_to(R11, ir->a, 8);
+
+  int stack = MAX(ir->nargs - GP_MAX, 0);
+  if (stack % 2) {
+    println("  sub $8, %%rsp");
+    move_sp(8);
+  }
+  for (int i = ir->nargs - 1; i >= GP_MAX; i--) {
+    println("  pushq %s", src(ir->args[i], 8, RAX));
+    move_sp(8);
+  }
+
+  // Arguments may themselves live in argument registers, so moving
+  // them is a parallel copy. A cycle is broken by using %rax.
+  int n = MIN(ir->nargs, GP_MAX);
+  int from[GP_MAX];
+  bool done[GP_MAX];
+  for (int i = 0; i < n; i++) {
+    from[i] = reg_of[ir->args[i]];
+    done[i] = false;
+  }
+
+  for (int left = n; left > 0;) {
+    int i = 0;
+    for (; i < n; i++) {
+      if (done[i])
+        continue;
+      bool blocked = false;
+      for (int j = 0; j < n; j++)
+        if (!done[j] && j != i && from[j] == argregs[i])
+          blocked = true;
+      if (!blocked)
+        break;
+    }
+
+    if (i == n) {
+      for (i = 0; done[i]; i++);
+      println("  mov %s, %%rax", reg(argregs[i], 8));
+      for (int j = 0; j < n; j++)
+        if (!done[j] && from[j] == argregs[i])
+          from[j] = RAX;
+      continue;
+    }
+
+    if (from[i] >= 0) {
+      if (from[i] != argregs[i])
+        println("  mov %s, %s", reg(from[i], 8), reg(argregs[i], 8));
+    } else {
+      load_to(argregs[i], ir->args[i], 8);
+    }
+    done[i] = true;
+    left--;
+  }
+
+  println("  mov $0, %%eax");
+
+  if (ir->is_tail) {
+    if (ir->var)
+      strarray_push(&tail_calls, format("%s%s", ir->var->name, opt_fpic ? "@PLT" : ""));
+    else
+      strarray_push(&tail_calls, "*%r11");
+    println("  jmp .L.tail.%s.%d", current_fn->name, tail_calls.len - 1);
+    return;
+  }
+
+  if (ir->var)
+    println("  call %s%s", ir->var->name, opt_fpic ? "@PLT" : "");
+  else
+    println("  call *%%r11");
+  if (stack) {
+    println("  add $%d, %%rsp", align_to(stack, 2) * 8);
+    move_sp(-align_to(stack, 2) * 8);
+  }
+
+  // Clear the upper bits of small return values as gen_expr() does.
+  switch (ir->ty->kind) {
+  case TY_BOOL:
+    println("  movzx %%al, %%eax");
+    break;
+  case TY_CHAR:
+    println(ir->ty->is_unsigned ? "  movzbl %%al, %%eax" : "  movsbl %%al, %%eax");
+    break;
+  case TY_SHORT:
+    println(ir->ty->is_unsigned ? "  movzwl %%ax, %%eax" : "  movswl %%ax, %%eax");
+    break;
+  }
+  set_dst(ir->d, RAX);
+}
+
+// Move incoming arguments to the locations of their registers. The
+// IR_PARAM instructions at the beginning of a function are emitted
+// together, because allocated registers may themselves be argument
+// registers. This is a parallel copy as in emit_call().
+static void emit_params(IR *ir) {
+  int from[GP_MAX];
+  int to[GP_MAX];
+  bool done[GP_MAX] = {};
+  int n = 0;
+
+  for (; ir && ir->kind == IR_PARAM; ir = ir->next) {
+    if (!nuses[ir->d])
+      continue;
+    if (reg_of[ir->d] == SPILLED) {
+      println("  mov %s, %s", reg(argregs[ir->imm], 8), frame_addr(slot_of[ir->d]));
+      continue;
+    }
+    from[n] = argregs[ir->imm];
+    to[n] = reg_of[ir->d];
+    n++;
+  }
+
+  for (int left = n; left > 0;) {
+    int i = 0;
+    for (; i < n; i++) {
+      if (done[i])
+        continue;
+      bool blocked = false;
+      for (int j = 0; j < n; j++)
+        if (!done[j] && j != i && from[j] == to[i])
+          blocked = true;
+      if (!blocked)
+        break;
+    }
+
+    if (i == n) {
+      for (i = 0; done[i]; i++);
+      println("  mov %s, %%rax", reg(from[i], 8));
+      from[i] = RAX;
+      continue;
+    }
+
+    if (from[i] != to[i])
+      println("  mov %s, %s", reg(from[i], 8), reg(to[i], 8));
+    done[i] = true;
+    left--;
+  }
+}
+
+static void emit_inst(IR *ir, BB *next) {
+  switch (ir->kind) {
+  case IR_IMM: {
+    int d = dst_of(ir->d, RAX);
+    println("  mov $%ld, %s", ir->imm, reg(d, 8));
+    set_dst(ir->d, d);
+    return;
+  }
+  case IR_MOV:
+    if (ir->d == ir->a)
+      return;
+    if (reg_of[ir->d] >= 0)
+      load_to(reg_of[ir->d], ir->a, 8);
+    else
+      set_dst(ir->d, in_reg(ir->a, RAX));
+    return;
+  case IR_LVAR: {
+    int d = dst_of(ir->d, RAX);
+    println("  lea %s, %s", frame_addr(ir->var->offset), reg(d, 8));
+    set_dst(ir->d, d);
+    return;
+  }
+  case IR_GVAR:
+    emit_gvar(ir);
+    return;
+  case IR_ADD:
+    emit_binop(ir, "add");
+    return;
+  case IR_SUB:
+    emit_binop(ir, "sub");
+    return;
+  case IR_MUL:
+    emit_mul(ir);
+    return;
+  case IR_AND:
+    emit_binop(ir, "and");
+    return;
+  case IR_OR:
+    emit_binop(ir, "or");
+    return;
+  case IR_XOR:
+    emit_binop(ir, "xor");
+    return;
+  case IR_SHL:
+  case IR_SHR:
+    emit_shift(ir);
+    return;
+  case IR_DIV:
+  case IR_MOD:
+    emit_div(ir);
+    return;
+  case IR_EQ:
+  case IR_NE:
+  case IR_LT:
+  case IR_LE:
+    emit_cmp(ir);
+    return;
+  case IR_NEG:
+  case IR_BITNOT: {
+    int d = dst_of(ir->d, RAX);
+    load_to(d, ir->a, 8);
+    println("  %s %s", (ir->kind == IR_NEG) ? "neg" : "not", reg(d, 8));
+    set_dst(ir->d, d);
+    return;
+  }
+  case IR_CAST:
+    emit_cast(ir);
+    return;
+  case IR_PARAM:
+    if (!ir->prev || ir->prev->kind != IR_PARAM)
+      emit_params(ir);
+    return;
+  case IR_LOAD:
+    emit_load(ir);
+    return;
+  case IR_STORE:
+    emit_store(ir);
+    return;
+  case IR_ZERO:
+    if (reg_of[ir->a] == REMAT && remat[ir->a]->kind == IR_LVAR)
+      zero_mem(frame_base, frame_bias + remat[ir->a]->var->offset + ir->imm, ir->size);
+    else
+      zero_mem(reg(in_reg(ir->a, RDI), 8), ir->imm, ir->size);
+    return;
+  case IR_CALL:
+    emit_call(ir);
+    return;
+  case IR_JMP:
+    if (ir->bb1 != next)
+      println("  jmp .L.bb.%d", ir->bb1->id);
+    return;
+  case IR_BR: {
+    if (reg_of[ir->a] == REMAT && remat[ir->a]->kind == IR_IMM) {
+      BB *bb = remat[ir->a]->imm ? ir->bb1 : ir->bb2;
+      if (bb != next)
+        println("  jmp .L.bb.%d", bb->id);
+      return;
+    }
+
+    char *cc = "ne";
+    if (br_cond) {
+      cc = br_cond;
+      br_cond = NULL;
+    } else {
+      char *r = reg(in_reg(ir->a, RAX), ir->size);
+      println("  test %s, %s", r, r);
+    }
+
+    if (ir->bb2 == next) {
+      println("  j%s .L.bb.%d", cc, ir->bb1->id);
+    } else if (ir->bb1 == next) {
+      println("  j%s .L.bb.%d", negate_cond(cc), ir->bb2->id);
+    } else {
+      println("  j%s .L.bb.%d", cc, ir->bb1->id);
+      println("  jmp .L.bb.%d", ir->bb2->id);
+    }
+    return;
+  }
+  case IR_SWITCH: {
+    // The table holds offsets of blocks from the table itself, so
+    // it works in position-independent code too.
+    int c = count();
+    if (ir->size == 4)
+      println("  mov %s, %%eax", reg(in_reg(ir->a, RAX), 4));
+    else
+      load_to(RAX, ir->a, 8);
+    println("  lea .L.jt.%d(%%rip), %%r11", c);
+    println("  movslq (%%r11,%%rax,4), %%rax");
+    println("  add %%r11, %%rax");
+    println("  jmp *%%rax");
+    println("  .section .rodata");
+    println("  .align 4");
+    println(".L.jt.%d:", c);
+    for (int i = 0; i < ir->ntargets; i++)
+      println("  .long .L.bb.%d-.L.jt.%d", ir->targets[i]->id, c);
+    println("  .text");
+    return;
+  }
+  case IR_RET:
+    if (ir->a)
+      load_to(RAX, ir->a, 8);
+    if (next)
+      println("  jmp .L.return.%s", current_fn->name);
+    return;
+  }
+  unreachable();
+}
+
+static int by_start(const void *x, const void *y) {
+  int a = *(int *)x;
+  int b = *(int *)y;
+  return live_start[a] - live_start[b];
+}
+
+static void set_bit(unsigned long *set, int i) {
+  set[i / 64] |= 1UL << (i % 64);
+}
+
+static bool get_bit(unsigned long *set, int i) {
+  return set[i / 64] & (1UL << (i % 64));
+}
+
+static void extend(int v, int pos) {
+  live_start[v] = MIN(live_start[v], pos);
+  live_end[v] = MAX(live_end[v], pos);
+}
+
+// Compute live ranges of virtual registers. A live range is the
+// smallest interval of instruction positions that covers every point
+// where the register is live.
+static void compute_live_ranges(IRFunc *f, int nbbs, int *ncalls) {
+  int nregs = f->nregs + 1;
+  size_t w = nregs / 64 + 1;
+  unsigned long *use = calloc(nbbs * w, sizeof(long));
+  unsigned long *def = calloc(nbbs * w, sizeof(long));
+  unsigned long *in = calloc(nbbs * w, sizeof(long));
+  unsigned long *out = calloc(nbbs * w, sizeof(long));
+  BB **bbs = calloc(nbbs, sizeof(BB *));
+  if (!use || !def || !in || !out || !bbs)
+    error("out of memory");
+
+  for (BB *bb = f->bb; bb; bb = bb->next) {
+    bbs[bb->idx] = bb;
+    unsigned long *u = use + bb->idx * w;
+    unsigned long *d = def + bb->idx * w;
+
+    for (IR *ir = bb->first; ir; ir = ir->next) {
+      int *p;
+      for (int i = 0; (p = ir_use(ir, i)); i++)
+        if (*p && reg_of[*p] != REMAT && !get_bit(d, *p))
+          set_bit(u, *p);
+      if (ir->d)
+        set_bit(d, ir->d);
+    }
+  }
+
+  // Solve the dataflow equations backward until nothing changes.
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (int i = nbbs - 1; i >= 0; i--) {
+      IR *last = bbs[i]->last;
+      unsigned long *o = out + i * w;
+      for (size_t j = 0; j < w; j++) {
+        unsigned long x = 0;
+        BB **p;
+        for (int k = 0; (p = ir_succ(last, k)); k++)
+          x |= in[(*p)->idx * w + j];
+        o[j] = x;
+
+        unsigned long y = use[i * w + j] | (x & ~def[i * w + j]);
+        if (y != in[i * w + j]) {
+          in[i * w + j] = y;
+          changed = true;
+        }
+      }
+    }
+  }
+
+  for (int v = 0; v < nregs; v++) {
+    live_start[v] = INT32_MAX;
+    live_end[v] = -1;
+  }
+
+  int pos = 0;
+  for (int i = 0; i < nbbs; i++) {
+    int begin = pos;
+    for (IR *ir = bbs[i]->first; ir; ir = ir->next) {
+      int *p;
+      for (int j = 0; (p = ir_use(ir, j)); j++)
+        if (*p)
+          extend(*p, pos);
+      if (ir->d)
+        extend(ir->d, pos);
+      ncalls[pos + 1] = ncalls[pos] + (ir->kind == IR_CALL && !ir->is_tail);
+      pos++;
+    }
+
+    // Only words with a live register are looked at.
+    for (size_t j = 0; j < w; j++) {
+      unsigned long x = in[i * w + j] | out[i * w + j];
+      for (int v = j * 64; x; x >>= 1, v++) {
+        if (!(x & 1))
+          continue;
+        if (get_bit(in + i * w, v))
+          extend(v, begin);
+        if (get_bit(out + i * w, v))
+          extend(v, pos - 1);
+      }
+    }
+  }
+}
+
+// Assign registers to virtual registers by linear scan. Registers
+// that are live across a function call get callee-saved registers.
+// If no register is available, the one whose live range ends last is
+// spilled to the stack.
+static void alloc_regs(IRFunc *f) {
+  int nregs = f->nregs + 1;
+  reg_of = calloc(nregs, sizeof(int));
+  slot_of = calloc(nregs, sizeof(int));
+  remat = calloc(nregs, sizeof(IR *));
+  nuses = calloc(nregs, sizeof(int));
+  live_start = calloc(nregs, sizeof(int));
+  live_end = calloc(nregs, sizeof(int));
+  int *ndefs = calloc(nregs, sizeof(int));
+
+  int nbbs = 0, npos = 0;
+  for (BB *bb = f->bb; bb; bb = bb->next) {
+    bb->idx = nbbs++;
+    for (IR *ir = bb->first; ir; ir = ir->next) {
+      int *p;
+      for (int i = 0; (p = ir_use(ir, i)); i++)
+        nuses[*p]++;
+      if (ir->d) {
+        ndefs[ir->d]++;
+        remat[ir->d] = ir;
+      }
+      npos++;
+    }
+  }
+
+  for (int v = 1; v < nregs; v++) {
+    if (ndefs[v] == 1 && is_remat(remat[v]))
+      reg_of[v] = REMAT;
+    else
+      remat[v] = NULL;
+  }
+
+  int *ncalls = calloc(npos + 1, sizeof(int));
+  compute_live_ranges(f, nbbs, ncalls);
+  has_calls = ncalls[npos] > 0;
+
+  int *order = calloc(nregs, sizeof(int));
+  int n = 0;
+  for (int v = 1; v < nregs; v++)
+    if (reg_of[v] != REMAT && live_end[v] >= 0)
+      order[n++] = v;
+  qsort(order, n, sizeof(int), by_start);
+
+  int active[NREGS];
+  int nactive = 0;
+  bool used[NREGS] = {};
+  int nslots = 0;
+
+  for (int i = 0; i < n; i++) {
+    int v = order[i];
+
+    // Expire old live ranges.
+    for (int j = 0; j < nactive;) {
+      if (live_end[active[j]] < live_start[v])
+        active[j] = active[--nactive];
+      else
+        j++;
+    }
+
+    bool busy[NREGS] = {};
+    for (int j = 0; j < nactive; j++)
+      busy[reg_of[active[j]]] = true;
+
+    bool across_call = ncalls[live_end[v]] - ncalls[live_start[v] + 1] > 0;
+    int r = -1;
+    for (int j = NCALLEE; j < NREGS && r == -1 && !across_call; j++)
+      if (!busy[j])
+        r = j;
+    for (int j = 0; j < NCALLEE && r == -1; j++)
+      if (!busy[j])
+        r = j;
+
+    if (r == -1) {
+      int victim = -1;
+      for (int j = 0; j < nactive; j++) {
+        int a = active[j];
+        if ((!across_call || reg_of[a] < NCALLEE) &&
+            (victim == -1 || live_end[a] > live_end[active[victim]]))
+          victim = j;
+      }
+
+      if (victim == -1 || live_end[active[victim]] <= live_end[v]) {
+        reg_of[v] = SPILLED;
+        slot_of[v] = nslots++;
+        continue;
+      }
+
+      int a = active[victim];
+      r = reg_of[a];
+      reg_of[a] = SPILLED;
+      slot_of[a] = nslots++;
+      active[victim] = active[--nactive];
+    }
+
+    reg_of[v] = r;
+    used[r] = true;
+    active[nactive++] = v;
+  }
+
+  // Callee-saved registers are saved by the prologue.
+  for (int i = 0; i < NCALLEE; i++)
+    if (used[i])
+      max_tmp = i + 1;
+
+  Obj *fn = f->fn;
+  for (int v = 1; v < nregs; v++)
+    if (reg_of[v] == SPILLED)
+      slot_of[v] = -fn->stack_size - max_tmp * 8 - (slot_of[v] + 1) * 8;
+  spill_size = nslots * 8;
+}
+
+static void emit_ir(IRFunc *f) {
+  int file_no = 0, line_no = 0;
+
+  for (BB *bb = f->bb; bb; bb = bb->next) {
+    println(".L.bb.%d:", bb->id);
+
+    for (IR *ir = bb->first; ir; ir = ir->next) {
+      if (ir->tok && (ir->tok->file->file_no != file_no || ir->tok->line_no != line_no)) {
+        file_no = ir->tok->file->file_no;
+        line_no = ir->tok->line_no;
+        println("  .loc %d %d", file_no, line_no);
+      }
+
+      if (ir->d && reg_of[ir->d] == REMAT)
+        continue;
+      emit_inst(ir, bb->next);
+
+      // The return after a tail call is not reached.
+      if (ir->kind == IR_CALL && ir->is_tail)
+        break;
+    }
+  }
+}
+
+// Assign offsets to local variables.
+// Assign offsets to pass-by-register parameters and local variables
+// that don't have one yet. This is done again for a function after
+// the inliner has added the local variables of inlined functions.
+static int var_align(Obj *var) {
+  // AMD64 System V ABI has a special alignment rule for an array of
+  // length at least 16 bytes. We need to align such array to at least
+  // 16-byte boundaries. See p.14 of
+  // https://github.com/hjl-tools/x86-psABI/wiki/x86-64-psABI-draft.pdf.
+  return (var->ty->kind == TY_ARRAY && var->ty->size >= 16)
+    ? MAX(16, var->align) : var->align;
+}
+
+static int block_bottom(Block *blk, int base) {
+  if (!blk)
+    return base;
+  if (!blk->is_placed) {
+    blk->bottom = block_bottom(blk->parent, base);
+    blk->is_placed = true;
+  }
+  return blk->bottom;
+}
+
+// Assign offsets to the local variables of a function as parsed.
+// The locals of a block are placed below those of the blocks that
+// enclose it, and sibling blocks start at the same offset, so locals
+// that are never live at the same time share stack slots.
+static void assign_block_offsets(Obj *fn) {
+  int base = 0;
+  int max_depth = 0;
+
+  for (Obj *var = fn->locals; var; var = var->next) {
+    if (var->offset)
+      continue;
+    if (var->block) {
+      max_depth = MAX(max_depth, var->block->depth);
+      continue;
+    }
+    base = align_to(base + var->ty->size, var_align(var));
+    var->offset = -base;
+  }
+
+  // Place outer blocks first.
+  int bottom = base;
+  for (int depth = 1; depth <= max_depth; depth++) {
+    for (Obj *var = fn->locals; var; var = var->next) {
+      Block *blk = var->block;
+      if (var->offset || !blk || blk->depth != depth)
+        continue;
+
+      int off = align_to(block_bottom(blk, base) + var->ty->size, var_align(var));
+      var->offset = -off;
+      blk->bottom = off;
+      bottom = MAX(bottom, off);
+    }
+  }
+
+  fn->stack_size = align_to(bottom, 16);
+}
+
+// Assign offsets to locals that don't have one yet, such as the ones
+// added by inlining, below all the others.
+static void assign_local_offsets(Obj *fn) {
+  int bottom = fn->stack_size;
+
+  for (Obj *var = fn->locals; var; var = var->next) {
+    if (var->offset)
+      continue;
+
+    bottom += var->ty->size;
+    bottom = align_to(bottom, var_align(var));
+    var->offset = -bottom;
+  }
+
+  fn->stack_size = align_to(bottom, 16);
+}
+
+static void assign_lvar_offsets(Obj *prog) {
+  for (Obj *fn = prog; fn; fn = fn->next) {
+    if (!fn->is_function)
+      continue;
+
+    // If a function has many parameters, some parameters are
+    // inevitably passed by stack rather than by register.
+    // The first passed-by-stack parameter resides at RBP+16.
+    int top = 16;
+    int gp = 0, fp = 0;
+
+    // Assign offsets to pass-by-stack parameters.
+    for (Obj *var = fn->params; var; var = var->next) {
+      Type *ty = var->ty;
 
       switch (ty->kind) {
       case TY_STRUCT:
       case TY_UNION:
         if (ty->size <= 16) {
           bool fp1 = has_flonum(ty, 0, 8, 0);
-          bool fp2 = has_flonum(ty, 8, 16, 8);
+          bool fp2 = has_flonum(ty, 8, 16, 0);
           if (fp + fp1 + fp2 < FP_MAX && gp + !fp1 + !fp2 < GP_MAX) {
             fp = fp + fp1 + fp2;
             gp = gp + !fp1 + !fp2;
@@ -1354,24 +3219,7 @@ static void assign_lvar_offsets(Obj *prog) {
       top += var->ty->size;
     }
 
-    // Assign offsets to pass-by-register parameters and local variables.
-    for (Obj *var = fn->locals; var; var = var->next) {
-      if (var->offset)
-        continue;
-
-      // AMD64 System V ABI has a special alignment rule for an array of
-      // length at least 16 bytes. We need to align such array to at least
-      // 16-byte boundaries. See p.14 of
-      // https://github.com/hjl-tools/x86-psABI/wiki/x86-64-psABI-draft.pdf.
-      int align = (var->ty->kind == TY_ARRAY && var->ty->size >= 16)
-        ? MAX(16, var->align) : var->align;
-
-      bottom += var->ty->size;
-      bottom = align_to(bottom, align);
-      var->offset = -bottom;
-    }
-
-    fn->stack_size = align_to(bottom, 16);
+    assign_block_offsets(fn);
   }
 }
 
@@ -1445,26 +3293,14 @@ static void store_fp(int r, int offset, int sz) {
 }
 
 static void store_gp(int r, int offset, int sz) {
-  switch (sz) {
-  case 1:
-    println("  mov %s, %d(%%rbp)", argreg8[r], offset);
-    return;
-  case 2:
-    println("  mov %s, %d(%%rbp)", argreg16[r], offset);
-    return;
-  case 4:
-    println("  mov %s, %d(%%rbp)", argreg32[r], offset);
-    return;
-  case 8:
-    println("  mov %s, %d(%%rbp)", argreg64[r], offset);
-    return;
-  default:
-    for (int i = 0; i < sz; i++) {
-      println("  mov %s, %d(%%rbp)", argreg8[r], offset + i);
-      println("  shr $8, %s", argreg64[r]);
-    }
-    return;
-  }
+  store_word(argreg64[r], offset, sz);
+}
+
+static void emit_body(char *buf, size_t buflen) {
+  if (opt_O)
+    peephole(buf, output_file);
+  else
+    fwrite(buf, buflen, 1, output_file);
 }
 
 static void emit_text(Obj *prog) {
@@ -1487,11 +3323,17 @@ static void emit_text(Obj *prog) {
     println("%s:", fn->name);
     current_fn = fn;
 
-    // Prologue
-    println("  push %%rbp");
-    println("  mov %%rsp, %%rbp");
-    println("  sub $%d, %%rsp", fn->stack_size);
-    println("  mov %%rsp, %d(%%rbp)", fn->alloca_bottom->offset);
+    // The function body is emitted to a buffer first, because the
+    // prologue depends on the number of scratch registers it uses.
+    FILE *out = output_file;
+    char *buf;
+    size_t buflen;
+    output_file = open_memstream(&buf, &buflen);
+    max_tmp = 0;
+    spill_size = 0;
+    tail_calls = (StringArray){};
+    frame_base = "%rbp";
+    frame_bias = 0;
 
     // Save arg registers if function is variadic
     if (fn->va_area) {
@@ -1530,9 +3372,14 @@ static void emit_text(Obj *prog) {
       println("  movsd %%xmm7, %d(%%rbp)", off + 128);
     }
 
+    // Functions that can be lowered to the IR are compiled by the IR
+    // backend, which moves arguments to where they belong by itself.
+    IRFunc *ir = gen_ir(fn);
+    assign_local_offsets(fn);
+
     // Save passed-by-register arguments to the stack
     int gp = 0, fp = 0;
-    for (Obj *var = fn->params; var; var = var->next) {
+    for (Obj *var = fn->params; var && !ir; var = var->next) {
       if (var->offset > 0)
         continue;
 
@@ -1563,22 +3410,83 @@ static void emit_text(Obj *prog) {
       }
     }
 
-    // Emit code
-    gen_stmt(fn->body);
-    assert(depth == 0);
+    // The IR backend knows the frame layout before emitting the body.
+    // With -fomit-frame-pointer, the frame is then addressed relative
+    // to %rsp. A leaf function whose frame fits in the 128-byte red
+    // zone below %rsp doesn't need to move %rsp at all, unless
+    // -mno-red-zone is given. The AST backend always uses %rbp.
+    int sp_size = 0;
+    if (ir) {
+      alloc_regs(ir);
+
+      if (opt_omit_frame_pointer && !fn->va_area && !fn->alloca_bottom) {
+        int frame_size = fn->stack_size + max_tmp * 8 + spill_size;
+        bool in_red_zone = frame_size == 0 || (!opt_mno_red_zone && frame_size <= 120);
+        sp_size = (!has_calls && in_red_zone) ? 0 : align_to(frame_size, 16) + 8;
+        frame_base = "%rsp";
+        frame_bias = sp_size - 8;
+      }
+    }
 
-    // [https://www.sigbus.info/n1570#5.1.2.2.3p1] The C spec defines
-    // a special rule for the main function. Reaching the end of the
-    // main function is equivalent to returning 0, even though the
-    // behavior is undefined for the other functions.
-    if (strcmp(fn->name, "main") == 0)
-      println("  mov $0, %%rax");
+    // Emit code
+    if (ir) {
+      emit_ir(ir);
+    } else {
+      gen_stmt(fn->body);
+      assert(depth == 0);
+      assert(ntmp == 0);
+
+      // [https://www.sigbus.info/n1570#5.1.2.2.3p1] The C spec defines
+      // a special rule for the main function. Reaching the end of the
+      // main function is equivalent to returning 0, even though the
+      // behavior is undefined for the other functions.
+      if (strcmp(fn->name, "main") == 0)
+        println("  mov $0, %%rax");
+    }
 
-    // Epilogue
     println(".L.return.%s:", fn->name);
-    println("  mov %%rbp, %%rsp");
-    println("  pop %%rbp");
-    println("  ret");
+    fclose(output_file);
+    output_file = out;
+
+    // Prologue. Scratch registers are callee-saved, so they are saved
+    // below the local variables, followed by spilled IR registers.
+    int frame_size = fn->stack_size + max_tmp * 8 + spill_size;
+    int stack_size = align_to(frame_size, 16);
+
+    bool omit_fp = !strcmp(frame_base, "%rsp");
+    if (omit_fp) {
+      if (sp_size)
+        println("  sub $%d, %%rsp", sp_size);
+    } else {
+      println("  push %%rbp");
+      println("  mov %%rsp, %%rbp");
+      println("  sub $%d, %%rsp", stack_size);
+    }
+    for (int i = 0; i < max_tmp; i++)
+      println("  mov %s, %s", tmpreg64[i], frame_addr(-fn->stack_size - (i + 1) * 8));
+    if (fn->alloca_bottom)
+      println("  mov %%rsp, %s", frame_addr(fn->alloca_bottom->offset));
+    emit_body(buf, buflen);
+    free(buf);
+
+    // Epilogue, followed by a copy of it for each tail call
+    for (int i = -1; i < tail_calls.len; i++) {
+      if (i >= 0)
+        println(".L.tail.%s.%d:", fn->name, i);
+      for (int j = 0; j < max_tmp; j++)
+        println("  mov %s, %s", frame_addr(-fn->stack_size - (j + 1) * 8), tmpreg64[j]);
+      if (omit_fp) {
+        if (sp_size)
+          println("  add $%d, %%rsp", sp_size);
+      } else {
+        println("  mov %%rbp, %%rsp");
+        println("  pop %%rbp");
+      }
+      if (i < 0)
+        println("  ret");
+      else
+        println("  jmp %s", tail_calls.data[i]);
+    }
   }
 }
 
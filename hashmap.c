@@ -133,6 +133,16 @@ void hashmap_delete2(HashMap *map, char *key, int keylen) {
     ent->key = TOMBSTONE;
 }
 
+// Make `dst` a copy of `src`. Keys and values are shared
+// between the two maps.
+void hashmap_copy(HashMap *dst, HashMap *src) {
+  *dst = *src;
+  if (!src->buckets)
+    return;
+  dst->buckets = calloc(src->capacity, sizeof(HashEntry));
+  memcpy(dst->buckets, src->buckets, src->capacity * sizeof(HashEntry));
+}
+
 void hashmap_test(void) {
   HashMap *map = calloc(1, sizeof(HashMap));
 
@@ -161,5 +171,13 @@ void hashmap_test(void) {
     hashmap_put(map, format("key %d", i), (void *)(size_t)i);
 
   assert(hashmap_get(map, "no such key") == NULL);
+
+  HashMap map2;
+  hashmap_copy(&map2, map);
+  hashmap_delete(map, "key 0");
+  assert((size_t)hashmap_get(&map2, "key 0") == 0);
+  assert(hashmap_get(&map2, "key 1000") == NULL);
+  for (int i = 6000; i < 7000; i++)
+    assert((size_t)hashmap_get(&map2, format("key %d", i)) == i);
   printf("OK\n");
 }
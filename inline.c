@@ -0,0 +1,263 @@
+// This file implements function inlining on the IR. A call to a
+// function defined in the same translation unit is replaced with a
+// copy of the callee's body if the callee is small enough, or if it
+// is declared with __attribute__((always_inline)). Functions declared
+// with __attribute__((noinline)) are never inlined. Without -O, only
+// always_inline functions are inlined.
+//
+// The copy gets its own virtual registers, basic blocks and local
+// variables. Reading a parameter becomes a move from the argument,
+// and a return becomes a move to the call's result followed by a jump
+// to the code after the call. Calls in an inlined body are inlined in
+// turn up to a fixed depth. Recursive functions are not inlined
+// unless they are always_inline, in which case the depth limit stops
+// the recursion.
+
+#include "chibicc.h"
+
+// Functions with at most this many instructions are inlined. Functions
+// declared `inline` have a higher limit.
+#define MAX_SIZE 12
+#define MAX_INLINE_SIZE 40
+
+// Limits on nesting and on how many instructions inlining may add to
+// a function. always_inline functions are exempt from the growth
+// limit but not from the hard one.
+#define MAX_DEPTH 4
+#define MAX_GROWTH 400
+#define HARD_MAX_GROWTH 4000
+
+// Bodies of callees, which are lowered once per translation unit.
+// Inlining is not done in them, so they don't depend on each other.
+static _Thread_local HashMap bodies;
+static _Thread_local bool in_body;
+
+static IRFunc *get_body(Obj *fn) {
+  static IRFunc none;
+
+  char *key = format("%p", fn);
+  IRFunc *f = hashmap_get(&bodies, key);
+  if (!f) {
+    in_body = true;
+    f = gen_ir(fn);
+    in_body = false;
+    hashmap_put(&bodies, key, f ? f : &none);
+  }
+  return (f == &none) ? NULL : f;
+}
+
+// Returns the number of instructions that inlining `f` adds.
+static int body_size(IRFunc *f) {
+  int n = 0;
+  for (BB *bb = f->bb; bb; bb = bb->next)
+    for (IR *ir = bb->first; ir; ir = ir->next)
+      if (ir->kind != IR_PARAM && ir->kind != IR_JMP && ir->kind != IR_RET)
+        n++;
+  return n;
+}
+
+// Unrolling a recursive function only makes the caller bigger.
+static bool calls_itself(IRFunc *f) {
+  for (BB *bb = f->bb; bb; bb = bb->next)
+    for (IR *ir = bb->first; ir; ir = ir->next)
+      if (ir->kind == IR_CALL && ir->var == f->fn)
+        return true;
+  return false;
+}
+
+// Returns the body of the callee of `call` if it should be inlined.
+static IRFunc *callee_body(IRFunc *f, BB *bb, IR *call, int growth) {
+  Obj *fn = call->var;
+  if (!fn || !fn->body || fn == f->fn || fn->is_noinline || fn->va_area)
+    return NULL;
+  if (bb->inline_depth >= MAX_DEPTH)
+    return NULL;
+
+  // A global function may be replaced by another definition at load
+  // time in position-independent code.
+  if (!fn->is_always_inline && (!opt_O || (opt_fpic && !fn->is_static)))
+    return NULL;
+
+  // Parameters passed on the stack are not supported.
+  int nparams = 0;
+  for (Obj *var = fn->params; var; var = var->next)
+    nparams++;
+  if (nparams != call->nargs || nparams > 6)
+    return NULL;
+
+  IRFunc *body = get_body(fn);
+  if (!body)
+    return NULL;
+
+  int size = body_size(body);
+  if (growth + size > HARD_MAX_GROWTH)
+    return NULL;
+  if (fn->is_always_inline)
+    return body;
+  if (size > (fn->is_inline ? MAX_INLINE_SIZE : MAX_SIZE) || growth + size > MAX_GROWTH)
+    return NULL;
+  if (calls_itself(body))
+    return NULL;
+  return body;
+}
+
+static IR *append(BB *bb, IROp kind) {
+  IR *ir = calloc(1, sizeof(IR));
+  ir->kind = kind;
+  ir->prev = bb->last;
+  if (bb->last)
+    bb->last->next = ir;
+  else
+    bb->first = ir;
+  bb->last = ir;
+  return ir;
+}
+
+// Returns the caller's copy of a local variable of the callee. Copies
+// get their stack slots when the caller is compiled.
+static Obj *copy_local(IRFunc *f, Obj *var, Obj **from, Obj **to, int *n) {
+  for (int i = 0; i < *n; i++)
+    if (from[i] == var)
+      return to[i];
+
+  Obj *copy = calloc(1, sizeof(Obj));
+  *copy = *var;
+  copy->offset = 0;
+  copy->vreg = 0;
+  copy->next = f->fn->locals;
+  f->fn->locals = copy;
+
+  from[*n] = var;
+  to[(*n)++] = copy;
+  return copy;
+}
+
+// Replace `call` in `bb` with a copy of `body`.
+static void inline_call(IRFunc *f, BB *bb, IR *call, IRFunc *body) {
+  int base = f->nregs;
+  f->nregs += body->nregs;
+
+  // Move the instructions after the call to a new block.
+  BB *cont = new_bb();
+  cont->inline_depth = bb->inline_depth;
+  cont->first = call->next;
+  cont->last = bb->last;
+  cont->first->prev = NULL;
+  bb->last = call;
+  call->next = NULL;
+
+  // Create blocks for the copy and put them between the two halves.
+  int nbbs = 0;
+  for (BB *b = body->bb; b; b = b->next)
+    b->idx = nbbs++;
+
+  BB **bbs = calloc(nbbs, sizeof(BB *));
+  BB *last = bb;
+  cont->next = bb->next;
+  for (int i = 0; i < nbbs; i++) {
+    bbs[i] = new_bb();
+    bbs[i]->inline_depth = bb->inline_depth + 1;
+    last = last->next = bbs[i];
+  }
+  last->next = cont;
+
+  int nlocals = 0;
+  for (Obj *var = body->fn->locals; var; var = var->next)
+    nlocals++;
+  Obj **from = calloc(nlocals, sizeof(Obj *));
+  Obj **to = calloc(nlocals, sizeof(Obj *));
+  int nfrom = 0;
+
+  bool is_void = body->fn->ty->return_ty->kind == TY_VOID;
+
+  for (BB *b = body->bb; b; b = b->next) {
+    BB *dst = bbs[b->idx];
+
+    for (IR *ir = b->first; ir; ir = ir->next) {
+      IR *copy = append(dst, ir->kind);
+      IR *next = copy->next;
+      IR *prev = copy->prev;
+      *copy = *ir;
+      copy->next = next;
+      copy->prev = prev;
+
+      copy->is_tail = false;
+      if (ir->d)
+        copy->d = ir->d + base;
+      if (ir->a)
+        copy->a = ir->a + base;
+      if (ir->b)
+        copy->b = ir->b + base;
+
+      if (ir->nargs) {
+        copy->args = calloc(ir->nargs, sizeof(int));
+        for (int i = 0; i < ir->nargs; i++)
+          copy->args[i] = ir->args[i] + base;
+      }
+
+      if (ir->bb1)
+        copy->bb1 = bbs[ir->bb1->idx];
+      if (ir->bb2)
+        copy->bb2 = bbs[ir->bb2->idx];
+      if (ir->ntargets) {
+        copy->targets = calloc(ir->ntargets, sizeof(BB *));
+        for (int i = 0; i < ir->ntargets; i++)
+          copy->targets[i] = bbs[ir->targets[i]->idx];
+      }
+
+      switch (ir->kind) {
+      case IR_PARAM:
+        copy->kind = IR_MOV;
+        copy->a = call->args[ir->imm];
+        copy->imm = 0;
+        break;
+      case IR_LVAR:
+        copy->var = copy_local(f, ir->var, from, to, &nfrom);
+        break;
+      case IR_RET:
+        if (!is_void) {
+          copy->kind = ir->a ? IR_MOV : IR_IMM;
+          copy->d = call->d;
+          copy->imm = 0;
+          copy = append(dst, IR_JMP);
+          copy->tok = ir->tok;
+        } else {
+          copy->kind = IR_JMP;
+          copy->a = 0;
+        }
+        copy->bb1 = cont;
+        break;
+      }
+    }
+  }
+
+  // The call becomes a jump to the copy.
+  *call = (IR){
+    .prev = call->prev,
+    .kind = IR_JMP,
+    .tok = call->tok,
+    .bb1 = bbs[0],
+  };
+}
+
+// Inline calls in `f`. Calls in inlined code are visited after it is
+// inserted, because the copy is placed right after the calling block.
+void inline_calls(IRFunc *f) {
+  if (in_body)
+    return;
+
+  int growth = 0;
+  for (BB *bb = f->bb; bb; bb = bb->next) {
+    for (IR *ir = bb->first; ir; ir = ir->next) {
+      if (ir->kind != IR_CALL)
+        continue;
+
+      IRFunc *body = callee_body(f, bb, ir, growth);
+      if (body) {
+        growth += body_size(body);
+        inline_call(f, bb, ir, body);
+        break;
+      }
+    }
+  }
+}
@@ -0,0 +1,1071 @@
+// This file lowers the AST of a function to a linear intermediate
+// representation. A function in the IR is a list of basic blocks, and
+// a basic block is a list of three-address instructions operating on
+// an unlimited number of virtual registers. Every basic block ends
+// with a jump, a conditional branch or a return.
+//
+// Virtual registers are 64 bits wide and are not in SSA form; the
+// result of ?: and of logical operators is assigned on each path.
+// Values follow the same convention as the AST code generator: for
+// types smaller than 8 bytes, only the lower 32 bits are meaningful.
+//
+// Scalar local variables and parameters whose address is never taken
+// are kept in virtual registers instead of on the stack.
+//
+// Only integers and pointers are lowered. If a function uses floating-
+// point numbers, struct values, variable-length arrays, inline
+// assembly or other constructs the IR doesn't cover, gen_ir() returns
+// NULL and the function is compiled directly from the AST.
+
+#include "chibicc.h"
+
+// Functions with more blocks times virtual registers than this are
+// compiled from the AST.
+#define MAX_LIVE_BITS (1L << 26)
+
+static _Thread_local IRFunc *cur_fn;
+static _Thread_local BB *cur_bb;
+static _Thread_local BB *last_bb;
+static _Thread_local HashMap labels;
+static _Thread_local bool failed;
+static _Thread_local bool retry;
+static _Thread_local bool locals_in_memory;
+static _Thread_local Token *cur_tok;
+
+static int gen_expr(Node *node);
+static void gen_stmt(Node *node);
+
+BB *new_bb(void) {
+  static _Thread_local int id = 1;
+  BB *bb = calloc(1, sizeof(BB));
+  bb->id = id++;
+  return bb;
+}
+
+static bool is_terminated(BB *bb) {
+  if (!bb->last)
+    return false;
+  IROp kind = bb->last->kind;
+  return kind == IR_JMP || kind == IR_BR || kind == IR_SWITCH || kind == IR_RET;
+}
+
+static IR *new_ir(IROp kind);
+
+static void emit_jmp(BB *bb) {
+  IR *ir = new_ir(IR_JMP);
+  ir->bb1 = bb;
+}
+
+// Append `bb` to the current function and make it the current block.
+// If the previous block doesn't end with a jump, it falls through.
+static void start_bb(BB *bb) {
+  if (cur_bb && !is_terminated(cur_bb))
+    emit_jmp(bb);
+
+  if (last_bb)
+    last_bb->next = bb;
+  else
+    cur_fn->bb = bb;
+  last_bb = cur_bb = bb;
+}
+
+static IR *new_ir(IROp kind) {
+  // Code after a jump is unreachable but still needs a block.
+  if (is_terminated(cur_bb))
+    start_bb(new_bb());
+
+  IR *ir = calloc(1, sizeof(IR));
+  ir->kind = kind;
+  ir->tok = cur_tok;
+
+  ir->prev = cur_bb->last;
+  if (cur_bb->last)
+    cur_bb->last->next = ir;
+  else
+    cur_bb->first = ir;
+  cur_bb->last = ir;
+  return ir;
+}
+
+// Returns the basic block for a label name.
+static BB *label_bb(char *label) {
+  BB *bb = hashmap_get(&labels, label);
+  if (!bb) {
+    bb = new_bb();
+    hashmap_put(&labels, label, bb);
+  }
+  return bb;
+}
+
+static int new_reg(void) {
+  return ++cur_fn->nregs;
+}
+
+static int unsupported(void) {
+  failed = true;
+  return new_reg();
+}
+
+static int imm(long val) {
+  IR *ir = new_ir(IR_IMM);
+  ir->d = new_reg();
+  ir->imm = val;
+  return ir->d;
+}
+
+static void set_imm(int d, long val) {
+  IR *ir = new_ir(IR_IMM);
+  ir->d = d;
+  ir->imm = val;
+}
+
+static void emit_mov(int d, int a) {
+  IR *ir = new_ir(IR_MOV);
+  ir->d = d;
+  ir->a = a;
+}
+
+static int emit_unary(IROp kind, int a) {
+  IR *ir = new_ir(kind);
+  ir->d = new_reg();
+  ir->a = a;
+  return ir->d;
+}
+
+static int emit_binary(IROp kind, int a, int b, int size, bool is_unsigned) {
+  IR *ir = new_ir(kind);
+  ir->d = new_reg();
+  ir->a = a;
+  ir->b = b;
+  ir->size = size;
+  ir->is_unsigned = is_unsigned;
+  return ir->d;
+}
+
+// Comparisons with zero are 32-bit for int and smaller types.
+static int cond_size(Type *ty) {
+  return (is_integer(ty) && ty->size <= 4) ? 4 : 8;
+}
+
+static void emit_branch(int r, int size, BB *then, BB *els) {
+  IR *ir = new_ir(IR_BR);
+  ir->a = r;
+  ir->size = size;
+  ir->bb1 = then;
+  ir->bb2 = els;
+}
+
+// Branch to `then` if `cond` is true and to `els` otherwise. Logical
+// operators become chains of branches without a boolean value.
+static void emit_br(Node *cond, BB *then, BB *els) {
+  switch (cond->kind) {
+  case ND_NOT:
+    emit_br(cond->lhs, els, then);
+    return;
+  case ND_LOGAND: {
+    BB *rhs = new_bb();
+    emit_br(cond->lhs, rhs, els);
+    start_bb(rhs);
+    emit_br(cond->rhs, then, els);
+    return;
+  }
+  case ND_LOGOR: {
+    BB *rhs = new_bb();
+    emit_br(cond->lhs, then, rhs);
+    start_bb(rhs);
+    emit_br(cond->rhs, then, els);
+    return;
+  }
+  }
+
+  int r = gen_expr(cond);
+  emit_branch(r, cond_size(cond->ty), then, els);
+}
+
+static int emit_load(Type *ty, int addr, long off) {
+  switch (ty->kind) {
+  case TY_ARRAY:
+  case TY_STRUCT:
+  case TY_UNION:
+  case TY_FUNC:
+    // Aggregates are not loaded. Their value is their address.
+    if (!off)
+      return addr;
+    return emit_binary(IR_ADD, addr, imm(off), 8, false);
+  case TY_VLA:
+  case TY_FLOAT:
+  case TY_DOUBLE:
+  case TY_LDOUBLE:
+    return unsupported();
+  }
+
+  IR *ir = new_ir(IR_LOAD);
+  ir->d = new_reg();
+  ir->a = addr;
+  ir->imm = off;
+  ir->ty = ty;
+  return ir->d;
+}
+
+static void emit_store(Type *ty, int addr, long off, int val) {
+  IR *ir = new_ir(IR_STORE);
+  ir->a = addr;
+  ir->b = val;
+  ir->imm = off;
+  ir->ty = ty;
+}
+
+// Returns true if `node` is a 64-bit integer constant such as the
+// scaled index of `p + 3`, and sets `*val` to its value.
+static bool const_offset(Node *node, long *val) {
+  if (node->ty->size != 8)
+    return false;
+
+  long x, y;
+  switch (node->kind) {
+  case ND_NUM:
+    *val = node->val;
+    return is_integer(node->ty);
+  case ND_CAST:
+    if (!is_integer(node->lhs->ty))
+      return false;
+    if (node->lhs->kind == ND_NUM && node->lhs->ty->size == 4) {
+      *val = node->lhs->ty->is_unsigned ? (unsigned)node->lhs->val : (int)node->lhs->val;
+      return true;
+    }
+    return const_offset(node->lhs, val);
+  case ND_MUL:
+    if (!const_offset(node->lhs, &x) || !const_offset(node->rhs, &y))
+      return false;
+    *val = x * y;
+    return true;
+  }
+  return false;
+}
+
+// Compute the address of a given node. The result is the sum of the
+// returned register and `*off`.
+static int gen_addr(Node *node, long *off) {
+  switch (node->kind) {
+  case ND_VAR: {
+    Obj *var = node->var;
+    if (var->ty->kind == TY_VLA || (var->is_tls && opt_fpic))
+      break;
+
+    // If the address of a variable kept in a register is taken, the
+    // function is lowered again with the variable in memory.
+    if (var->vreg) {
+      var->is_addr_taken = true;
+      retry = true;
+    }
+
+    IR *ir = new_ir(var->is_local ? IR_LVAR : IR_GVAR);
+    ir->d = new_reg();
+    ir->var = var;
+    return ir->d;
+  }
+  case ND_DEREF: {
+    // Fold a constant offset into the address.
+    Node *addr = node->lhs;
+    while (addr->kind == ND_CAST && addr->ty->kind == TY_PTR && addr->lhs->ty->kind == TY_PTR)
+      addr = addr->lhs;
+
+    long val;
+    if ((addr->kind == ND_ADD || addr->kind == ND_SUB) && addr->ty->kind == TY_PTR &&
+        const_offset(addr->rhs, &val) && val == (int)val) {
+      *off += (addr->kind == ND_ADD) ? val : -val;
+      return gen_expr(addr->lhs);
+    }
+    return gen_expr(node->lhs);
+  }
+  case ND_COMMA:
+    gen_expr(node->lhs);
+    return gen_addr(node->rhs, off);
+  case ND_MEMBER: {
+    int r = gen_addr(node->lhs, off);
+    *off += node->member->offset;
+    return r;
+  }
+  case ND_COND:
+    if (node->ty->kind == TY_STRUCT || node->ty->kind == TY_UNION)
+      return gen_expr(node);
+    break;
+  }
+
+  return unsupported();
+}
+
+enum { I8, I16, I32, I64, U8, U16, U32, U64 };
+
+static int type_id(Type *ty) {
+  switch (ty->kind) {
+  case TY_CHAR:
+    return ty->is_unsigned ? U8 : I8;
+  case TY_SHORT:
+    return ty->is_unsigned ? U16 : I16;
+  case TY_INT:
+    return ty->is_unsigned ? U32 : I32;
+  case TY_LONG:
+    return ty->is_unsigned ? U64 : I64;
+  }
+  return U64;
+}
+
+// Integer conversions are sign or zero extensions of the lower 1, 2
+// or 4 bytes of a value. Conversions to int, and conversions that
+// don't change the value, are no-ops.
+static int gen_cast(int r, Type *from, Type *to) {
+  if (to->kind == TY_VOID)
+    return r;
+
+  if (to->kind == TY_BOOL)
+    return emit_binary(IR_NE, r, imm(0), cond_size(from), false);
+
+  int t1 = type_id(from);
+  int size = 0;
+  bool is_unsigned = false;
+
+  switch (type_id(to)) {
+  case I8:
+    if (t1 != I8)
+      size = 1;
+    break;
+  case U8:
+    if (t1 != U8)
+      size = 1, is_unsigned = true;
+    break;
+  case I16:
+    if (t1 != I8 && t1 != I16 && t1 != U8)
+      size = 2;
+    break;
+  case U16:
+    if (t1 != U8 && t1 != U16)
+      size = 2, is_unsigned = true;
+    break;
+  case I64:
+  case U64:
+    if (t1 != I64 && t1 != U64)
+      size = 4, is_unsigned = (t1 == U32);
+    break;
+  }
+
+  if (!size)
+    return r;
+
+  IR *ir = new_ir(IR_CAST);
+  ir->d = new_reg();
+  ir->a = r;
+  ir->size = size;
+  ir->is_unsigned = is_unsigned;
+  return ir->d;
+}
+
+static int gen_assign(Node *node) {
+  if (node->ty->kind == TY_STRUCT || node->ty->kind == TY_UNION)
+    return unsupported();
+
+  if (node->lhs->kind == ND_VAR && node->lhs->var->vreg) {
+    Type *ty = node->lhs->var->ty;
+    int val = gen_expr(node->rhs);
+
+    // Shifts and `~` have the type of their operand but are computed
+    // in full registers, so a small value is truncated as if it were
+    // stored to memory and loaded again.
+    if (ty->size < 4) {
+      IR *ir = new_ir(IR_CAST);
+      ir->d = new_reg();
+      ir->a = val;
+      ir->size = ty->size;
+      ir->is_unsigned = ty->is_unsigned || ty->kind == TY_BOOL;
+      val = ir->d;
+    }
+
+    emit_mov(node->lhs->var->vreg, val);
+    return val;
+  }
+
+  long off = 0;
+  int addr = gen_addr(node->lhs, &off);
+  int val = gen_expr(node->rhs);
+
+  if (node->lhs->kind == ND_MEMBER && node->lhs->member->is_bitfield) {
+    // Read the current value from memory and merge it with the new one.
+    // A constant is shifted and masked at compile time.
+    Member *mem = node->lhs->member;
+    unsigned long width = (mem->bit_width == 64) ? -1 : (1UL << mem->bit_width) - 1;
+    unsigned long mask = width << mem->bit_offset;
+
+    Node *rhs = node->rhs;
+    while (rhs->kind == ND_CAST && is_integer(rhs->ty) && rhs->ty->kind != TY_BOOL &&
+           is_integer(rhs->lhs->ty))
+      rhs = rhs->lhs;
+
+    int r;
+    if (rhs->kind == ND_NUM) {
+      r = imm((rhs->val << mem->bit_offset) & mask);
+    } else {
+      r = emit_binary(IR_AND, val, imm(width), 8, false);
+      if (mem->bit_offset)
+        r = emit_binary(IR_SHL, r, imm(mem->bit_offset), 8, false);
+    }
+
+    int old = emit_load(mem->ty, addr, off);
+    old = emit_binary(IR_AND, old, imm(~mask), 8, false);
+    emit_store(node->ty, addr, off, emit_binary(IR_OR, old, r, 8, false));
+    return val;
+  }
+
+  emit_store(node->ty, addr, off, val);
+  return val;
+}
+
+static int gen_funcall(Node *node) {
+  if (node->ret_buffer || node->ty->kind == TY_STRUCT || node->ty->kind == TY_UNION)
+    return unsupported();
+  if (node->lhs->kind == ND_VAR && !strcmp(node->lhs->var->name, "alloca"))
+    return unsupported();
+
+  int nargs = 0;
+  for (Node *arg = node->args; arg; arg = arg->next) {
+    if (arg->ty->kind == TY_STRUCT || arg->ty->kind == TY_UNION)
+      return unsupported();
+    nargs++;
+  }
+
+  // Arguments are evaluated from right to left as in the AST code
+  // generator.
+  Node **args = calloc(nargs, sizeof(Node *));
+  int i = 0;
+  for (Node *arg = node->args; arg; arg = arg->next)
+    args[i++] = arg;
+
+  int *regs = calloc(nargs, sizeof(int));
+  for (i = nargs - 1; i >= 0; i--)
+    regs[i] = gen_expr(args[i]);
+
+  Obj *fn = NULL;
+  int r = 0;
+  if (node->lhs->kind == ND_VAR && node->lhs->ty->kind == TY_FUNC)
+    fn = node->lhs->var;
+  else
+    r = gen_expr(node->lhs);
+
+  IR *ir = new_ir(IR_CALL);
+  ir->d = new_reg();
+  ir->a = r;
+  ir->var = fn;
+  ir->args = regs;
+  ir->nargs = nargs;
+  ir->ty = node->ty;
+  return ir->d;
+}
+
+static IROp binary_op(NodeKind kind) {
+  switch (kind) {
+  case ND_ADD: return IR_ADD;
+  case ND_SUB: return IR_SUB;
+  case ND_MUL: return IR_MUL;
+  case ND_DIV: return IR_DIV;
+  case ND_MOD: return IR_MOD;
+  case ND_BITAND: return IR_AND;
+  case ND_BITOR: return IR_OR;
+  case ND_BITXOR: return IR_XOR;
+  case ND_SHL: return IR_SHL;
+  case ND_SHR: return IR_SHR;
+  case ND_EQ: return IR_EQ;
+  case ND_NE: return IR_NE;
+  case ND_LT: return IR_LT;
+  case ND_LE: return IR_LE;
+  }
+  return -1;
+}
+
+static bool is_local_addr(Node *node) {
+  while (node->kind == ND_CAST)
+    node = node->lhs;
+  return node->kind == ND_ADDR && node->lhs->kind == ND_VAR && node->lhs->var->is_local;
+}
+
+// Lower an expression and return the register holding its value.
+static int gen_expr(Node *node) {
+  cur_tok = node->tok;
+
+  if (node->ty && is_flonum(node->ty))
+    return unsupported();
+
+  switch (node->kind) {
+  case ND_NULL_EXPR:
+    return imm(0);
+  case ND_NUM:
+    return imm(node->val);
+  case ND_NEG:
+    return emit_unary(IR_NEG, gen_expr(node->lhs));
+  case ND_VAR:
+  case ND_MEMBER:
+  case ND_DEREF: {
+    if (node->kind == ND_VAR && node->var->vreg)
+      return node->var->vreg;
+
+    long off = 0;
+    int addr = gen_addr(node, &off);
+    int r = emit_load(node->ty, addr, off);
+
+    // An unsigned bitfield is extracted with a shift and a mask, a
+    // signed one with a pair of shifts.
+    if (node->kind == ND_MEMBER && node->member->is_bitfield) {
+      Member *mem = node->member;
+      if ((mem->ty->is_unsigned || mem->ty->kind == TY_BOOL) && mem->bit_width < 32) {
+        if (mem->bit_offset)
+          r = emit_binary(IR_SHR, r, imm(mem->bit_offset), 8, true);
+        r = emit_binary(IR_AND, r, imm((1L << mem->bit_width) - 1), 8, true);
+      } else {
+        if (64 - mem->bit_width - mem->bit_offset)
+          r = emit_binary(IR_SHL, r, imm(64 - mem->bit_width - mem->bit_offset), 8, false);
+        r = emit_binary(IR_SHR, r, imm(64 - mem->bit_width), 8, mem->ty->is_unsigned);
+      }
+    }
+    return r;
+  }
+  case ND_ADDR: {
+    long off = 0;
+    int r = gen_addr(node->lhs, &off);
+    if (!off)
+      return r;
+    return emit_binary(IR_ADD, r, imm(off), 8, false);
+  }
+  case ND_ASSIGN:
+    return gen_assign(node);
+  case ND_STMT_EXPR: {
+    Node *n = node->body;
+    if (!n)
+      return imm(0);
+    for (; n->next; n = n->next)
+      gen_stmt(n);
+    if (n->kind == ND_EXPR_STMT)
+      return gen_expr(n->lhs);
+    gen_stmt(n);
+    return imm(0);
+  }
+  case ND_COMMA:
+    gen_expr(node->lhs);
+    return gen_expr(node->rhs);
+  case ND_CAST:
+    return gen_cast(gen_expr(node->lhs), node->lhs->ty, node->ty);
+  case ND_MEMZERO: {
+    if (node->var->vreg) {
+      set_imm(node->var->vreg, 0);
+      return imm(0);
+    }
+
+    IR *ir = new_ir(IR_LVAR);
+    ir->d = new_reg();
+    ir->var = node->var;
+
+    IR *ir2 = new_ir(IR_ZERO);
+    ir2->a = ir->d;
+    ir2->imm = node->zero_offset;
+    ir2->size = node->zero_size;
+    return imm(0);
+  }
+  case ND_COND: {
+    int r = new_reg();
+    BB *then = new_bb();
+    BB *els = new_bb();
+    BB *end = new_bb();
+
+    emit_br(node->cond, then, els);
+    start_bb(then);
+    emit_mov(r, gen_expr(node->then));
+    emit_jmp(end);
+    start_bb(els);
+    emit_mov(r, gen_expr(node->els));
+    start_bb(end);
+    return r;
+  }
+  case ND_NOT:
+    return emit_binary(IR_EQ, gen_expr(node->lhs), imm(0), cond_size(node->lhs->ty), false);
+  case ND_BITNOT:
+    return emit_unary(IR_BITNOT, gen_expr(node->lhs));
+  case ND_LOGAND:
+  case ND_LOGOR: {
+    int r = new_reg();
+    BB *t = new_bb();
+    BB *f = new_bb();
+    BB *end = new_bb();
+
+    emit_br(node, t, f);
+    start_bb(t);
+    set_imm(r, 1);
+    emit_jmp(end);
+    start_bb(f);
+    set_imm(r, 0);
+    start_bb(end);
+    return r;
+  }
+  case ND_FUNCALL:
+    return gen_funcall(node);
+  }
+
+  IROp op = binary_op(node->kind);
+  if (op == -1)
+    return unsupported();
+
+  // Pointer arithmetic on the address of a local variable may reach
+  // its neighbors on the stack, so all of them are kept in memory.
+  if ((op == IR_ADD || op == IR_SUB) && !locals_in_memory &&
+      (is_local_addr(node->lhs) || is_local_addr(node->rhs))) {
+    locals_in_memory = true;
+    retry = true;
+  }
+
+  int a = gen_expr(node->lhs);
+  int b = gen_expr(node->rhs);
+  cur_tok = node->tok;
+
+  bool is64 = node->lhs->ty->kind == TY_LONG || node->lhs->ty->base;
+  bool is_unsigned = (op == IR_DIV || op == IR_MOD)
+    ? node->ty->is_unsigned : node->lhs->ty->is_unsigned;
+  return emit_binary(op, a, b, is64 ? 8 : 4, is_unsigned);
+}
+
+// Jump to the block of case `c` if it matches the value in `r`.
+static void gen_case_test(Node *c, int r, int size) {
+  int cond;
+  if (c->begin == c->end) {
+    cond = emit_binary(IR_EQ, r, imm(c->begin), size, false);
+  } else {
+    // [GNU] Case ranges
+    int d = emit_binary(IR_SUB, r, imm(c->begin), size, false);
+    cond = emit_binary(IR_LE, d, imm(c->end - c->begin), size, true);
+  }
+
+  BB *next = new_bb();
+  emit_branch(cond, 4, label_bb(c->label), next);
+  start_bb(next);
+}
+
+// Binary search over cases[lo, hi), which are sorted by value.
+static void gen_case_tree(Node **cases, int lo, int hi, int r, int size,
+                          bool is_unsigned, BB *dflt) {
+  if (hi - lo <= 3) {
+    for (int i = lo; i < hi; i++)
+      gen_case_test(cases[i], r, size);
+    emit_jmp(dflt);
+    return;
+  }
+
+  int mid = (lo + hi) / 2;
+  BB *left = new_bb();
+  BB *right = new_bb();
+  int cond = emit_binary(IR_LT, r, imm(cases[mid]->begin), size, is_unsigned);
+  emit_branch(cond, 4, left, right);
+
+  start_bb(left);
+  gen_case_tree(cases, lo, mid, r, size, is_unsigned, dflt);
+  start_bb(right);
+  gen_case_tree(cases, mid, hi, r, size, is_unsigned, dflt);
+}
+
+// Jump through a table indexed by the value minus the smallest case.
+static void gen_jump_table(Node **cases, int n, int r, int size, BB *dflt) {
+  long min = cases[0]->begin;
+  unsigned long span = cases[n - 1]->end - min + 1;
+
+  int idx = emit_binary(IR_SUB, r, imm(min), size, false);
+  int cond = emit_binary(IR_LE, idx, imm(span - 1), size, true);
+  BB *table = new_bb();
+  emit_branch(cond, 4, table, dflt);
+  start_bb(table);
+
+  IR *ir = new_ir(IR_SWITCH);
+  ir->a = idx;
+  ir->size = size;
+  ir->ntargets = span;
+  ir->targets = calloc(span, sizeof(BB *));
+
+  for (int i = 0, j = 0; i < span; i++) {
+    while ((unsigned long)(cases[j]->end - min) < i)
+      j++;
+    bool match = (unsigned long)(cases[j]->begin - min) <= i;
+    ir->targets[i] = match ? label_bb(cases[j]->label) : dflt;
+  }
+}
+
+static void gen_stmt(Node *node) {
+  cur_tok = node->tok;
+
+  switch (node->kind) {
+  case ND_IF: {
+    BB *then = new_bb();
+    BB *els = new_bb();
+    BB *end = new_bb();
+
+    emit_br(node->cond, then, els);
+    start_bb(then);
+    gen_stmt(node->then);
+    emit_jmp(end);
+    start_bb(els);
+    if (node->els)
+      gen_stmt(node->els);
+    start_bb(end);
+    return;
+  }
+  case ND_FOR: {
+    if (node->init)
+      gen_stmt(node->init);
+
+    BB *begin = new_bb();
+    BB *body = new_bb();
+    BB *brk = label_bb(node->brk_label);
+
+    start_bb(begin);
+    if (node->cond)
+      emit_br(node->cond, body, brk);
+    start_bb(body);
+    gen_stmt(node->then);
+    start_bb(label_bb(node->cont_label));
+    if (node->inc)
+      gen_expr(node->inc);
+    emit_jmp(begin);
+    start_bb(brk);
+    return;
+  }
+  case ND_DO: {
+    BB *begin = new_bb();
+    BB *brk = label_bb(node->brk_label);
+
+    start_bb(begin);
+    gen_stmt(node->then);
+    start_bb(label_bb(node->cont_label));
+    emit_br(node->cond, begin, brk);
+    start_bb(brk);
+    return;
+  }
+  case ND_SWITCH: {
+    int r = gen_expr(node->cond);
+    Type *ty = node->cond->ty;
+    int size = (ty->size == 8) ? 8 : 4;
+    bool is_unsigned = ty->is_unsigned && ty->size >= 4;
+    BB *dflt = label_bb(node->default_case ? node->default_case->label : node->brk_label);
+
+    int n = 0;
+    for (Node *c = node->case_next; c; c = c->case_next)
+      n++;
+    Node **cases = calloc(n, sizeof(Node *));
+    int i = 0;
+    for (Node *c = node->case_next; c; c = c->case_next)
+      cases[i++] = c;
+
+    switch (switch_kind(node)) {
+    case SWITCH_TABLE:
+      gen_jump_table(cases, n, r, size, dflt);
+      break;
+    case SWITCH_TREE:
+      gen_case_tree(cases, 0, n, r, size, is_unsigned, dflt);
+      break;
+    default:
+      for (i = 0; i < n; i++)
+        gen_case_test(cases[i], r, size);
+      emit_jmp(dflt);
+    }
+
+    gen_stmt(node->then);
+    start_bb(label_bb(node->brk_label));
+    return;
+  }
+  case ND_CASE:
+    start_bb(label_bb(node->label));
+    gen_stmt(node->lhs);
+    return;
+  case ND_BLOCK:
+    for (Node *n = node->body; n; n = n->next)
+      gen_stmt(n);
+    return;
+  case ND_GOTO:
+    emit_jmp(label_bb(node->unique_label));
+    return;
+  case ND_LABEL:
+    start_bb(label_bb(node->unique_label));
+    gen_stmt(node->lhs);
+    return;
+  case ND_RETURN: {
+    int r = 0;
+    if (node->lhs) {
+      Type *ty = node->lhs->ty;
+      if (ty->kind == TY_STRUCT || ty->kind == TY_UNION) {
+        unsupported();
+        return;
+      }
+      r = gen_expr(node->lhs);
+    }
+
+    IR *ir = new_ir(IR_RET);
+    ir->a = r;
+    return;
+  }
+  case ND_EXPR_STMT:
+    gen_expr(node->lhs);
+    return;
+  }
+
+  unsupported();
+}
+
+static bool is_scalar(Type *ty) {
+  return is_integer(ty) || ty->kind == TY_PTR;
+}
+
+// Move parameters passed in registers to their virtual registers or
+// stack slots. Parameters passed on the stack are loaded if they are
+// kept in registers.
+static void gen_params(Obj *fn) {
+  // The first six arguments are passed in registers. All of them are
+  // read first, because the backend moves them in parallel.
+  int regs[6];
+  int n = 0;
+  for (Obj *var = fn->params; var && n < 6; var = var->next) {
+    IR *ir = new_ir(IR_PARAM);
+    ir->d = (var->vreg && var->ty->size >= 4) ? var->vreg : new_reg();
+    ir->imm = n;
+    regs[n++] = ir->d;
+  }
+
+  int i = 0;
+  for (Obj *var = fn->params; var; var = var->next, i++) {
+    Type *ty = var->ty;
+
+    if (i >= 6) {
+      if (var->vreg) {
+        IR *ir = new_ir(IR_LVAR);
+        ir->d = new_reg();
+        ir->var = var;
+
+        IR *ir2 = new_ir(IR_LOAD);
+        ir2->d = var->vreg;
+        ir2->a = ir->d;
+        ir2->ty = ty;
+      }
+      continue;
+    }
+
+    if (!var->vreg) {
+      IR *ir = new_ir(IR_LVAR);
+      ir->d = new_reg();
+      ir->var = var;
+      emit_store(ty, ir->d, 0, regs[i]);
+    } else if (ty->size < 4) {
+      // Small values are extended as if they were loaded.
+      IR *ir = new_ir(IR_CAST);
+      ir->d = var->vreg;
+      ir->a = regs[i];
+      ir->size = ty->size;
+      ir->is_unsigned = ty->is_unsigned || ty->kind == TY_BOOL;
+    }
+  }
+}
+
+static IRFunc *lower(Obj *fn) {
+  cur_fn = calloc(1, sizeof(IRFunc));
+  cur_fn->fn = fn;
+  cur_bb = last_bb = NULL;
+  labels = (HashMap){};
+  failed = retry = false;
+  cur_tok = fn->body->tok;
+
+  for (Obj *var = fn->locals; var; var = var->next)
+    var->vreg = (is_scalar(var->ty) && !var->is_addr_taken && !locals_in_memory)
+      ? new_reg() : 0;
+
+  start_bb(new_bb());
+  gen_params(fn);
+  gen_stmt(fn->body);
+
+  // [https://www.sigbus.info/n1570#5.1.2.2.3p1] Reaching the end of
+  // the main function is equivalent to returning 0.
+  if (!is_terminated(cur_bb)) {
+    int r = strcmp(fn->name, "main") ? 0 : imm(0);
+    IR *ir = new_ir(IR_RET);
+    ir->a = r;
+  }
+
+  if (failed)
+    return NULL;
+  return cur_fn;
+}
+
+// The backend's liveness analysis keeps a set of all registers for
+// each block, so huge functions are left to the AST code generator.
+static bool too_large(IRFunc *f) {
+  long nbbs = 0;
+  for (BB *bb = f->bb; bb; bb = bb->next)
+    nbbs++;
+  return nbbs * (f->nregs + 1) > MAX_LIVE_BITS;
+}
+
+// Lower a function definition to the IR. Returns NULL if the function
+// uses a construct that the IR doesn't support.
+IRFunc *gen_ir(Obj *fn) {
+  Type *ret = fn->ty->return_ty;
+  if (ret->kind != TY_VOID && !is_scalar(ret))
+    return NULL;
+
+  for (Obj *var = fn->params; var; var = var->next)
+    if (!is_scalar(var->ty))
+      return NULL;
+
+  IRFunc *f;
+  locals_in_memory = false;
+  do {
+    f = lower(fn);
+  } while (f && retry);
+
+  if (!f || too_large(f))
+    return NULL;
+
+  inline_calls(f);
+  if (opt_O)
+    optimize_ir(f);
+  return too_large(f) ? NULL : f;
+}
+
+// Returns a pointer to the i'th register operand of `ir`, or NULL if
+// there are no more operands. An operand of 0 means "unused".
+int *ir_use(IR *ir, int i) {
+  if (i == 0)
+    return &ir->a;
+  if (i == 1)
+    return &ir->b;
+  if (i - 2 < ir->nargs)
+    return &ir->args[i - 2];
+  return NULL;
+}
+
+// Returns a pointer to the i'th successor of a block's terminator, or
+// NULL if there are no more successors.
+BB **ir_succ(IR *ir, int i) {
+  switch (ir->kind) {
+  case IR_JMP:
+    return (i == 0) ? &ir->bb1 : NULL;
+  case IR_BR:
+    if (i == 0)
+      return &ir->bb1;
+    return (i == 1) ? &ir->bb2 : NULL;
+  case IR_SWITCH:
+    return (i < ir->ntargets) ? &ir->targets[i] : NULL;
+  }
+  return NULL;
+}
+
+//
+// IR dump
+//
+
+static char *op_name[] = {
+  [IR_IMM] = "imm", [IR_MOV] = "mov", [IR_LVAR] = "lvar", [IR_GVAR] = "gvar",
+  [IR_ADD] = "add", [IR_SUB] = "sub", [IR_MUL] = "mul", [IR_DIV] = "div",
+  [IR_MOD] = "mod", [IR_AND] = "and", [IR_OR] = "or", [IR_XOR] = "xor",
+  [IR_SHL] = "shl", [IR_SHR] = "shr", [IR_EQ] = "eq", [IR_NE] = "ne",
+  [IR_LT] = "lt", [IR_LE] = "le", [IR_NEG] = "neg", [IR_BITNOT] = "not",
+  [IR_CAST] = "ext", [IR_PARAM] = "param", [IR_LOAD] = "load", [IR_STORE] = "store",
+  [IR_ZERO] = "zero", [IR_CALL] = "call", [IR_JMP] = "jmp", [IR_BR] = "br",
+  [IR_SWITCH] = "switch", [IR_RET] = "ret",
+};
+
+static char *type_name(Type *ty) {
+  static char *names[] = {"i8", "i16", "i32", "i64", "u8", "u16", "u32", "u64"};
+  if (ty->kind == TY_VOID)
+    return "void";
+  if (ty->kind == TY_PTR)
+    return "ptr";
+  return names[type_id(ty)];
+}
+
+static void print_inst(IR *ir, FILE *out) {
+  fprintf(out, "  ");
+  if (ir->d)
+    fprintf(out, "r%d = ", ir->d);
+  fprintf(out, "%s", op_name[ir->kind]);
+
+  switch (ir->kind) {
+  case IR_IMM:
+    fprintf(out, " %ld\n", ir->imm);
+    return;
+  case IR_MOV:
+  case IR_NEG:
+  case IR_BITNOT:
+    fprintf(out, " r%d\n", ir->a);
+    return;
+  case IR_LVAR:
+  case IR_GVAR:
+    fprintf(out, " %s\n", *ir->var->name ? ir->var->name : "(tmp)");
+    return;
+  case IR_CAST:
+    fprintf(out, ".%c%d r%d\n", ir->is_unsigned ? 'u' : 's', ir->size * 8, ir->a);
+    return;
+  case IR_LOAD:
+    fprintf(out, ".%s r%d%+ld\n", type_name(ir->ty), ir->a, ir->imm);
+    return;
+  case IR_STORE:
+    fprintf(out, ".%s r%d%+ld, r%d\n", type_name(ir->ty), ir->a, ir->imm, ir->b);
+    return;
+  case IR_PARAM:
+    fprintf(out, " %ld\n", ir->imm);
+    return;
+  case IR_ZERO:
+    fprintf(out, " r%d%+ld, %d\n", ir->a, ir->imm, ir->size);
+    return;
+  case IR_CALL:
+    if (ir->var)
+      fprintf(out, " %s(", ir->var->name);
+    else
+      fprintf(out, " r%d(", ir->a);
+    for (int i = 0; i < ir->nargs; i++)
+      fprintf(out, "%sr%d", i ? ", " : "", ir->args[i]);
+    fprintf(out, ")\n");
+    return;
+  case IR_JMP:
+    fprintf(out, " L%d\n", ir->bb1->id);
+    return;
+  case IR_BR:
+    fprintf(out, " r%d, L%d, L%d\n", ir->a, ir->bb1->id, ir->bb2->id);
+    return;
+  case IR_SWITCH:
+    fprintf(out, " r%d, [", ir->a);
+    for (int i = 0; i < ir->ntargets; i++)
+      fprintf(out, "%sL%d", i ? ", " : "", ir->targets[i]->id);
+    fprintf(out, "]\n");
+    return;
+  case IR_RET:
+    if (ir->a)
+      fprintf(out, " r%d", ir->a);
+    fprintf(out, "\n");
+    return;
+  }
+
+  // Binary operators
+  fprintf(out, ".%s%d r%d, r%d\n", ir->is_unsigned ? "u" : "", ir->size * 8, ir->a, ir->b);
+}
+
+void dump_ir(IRFunc *f, FILE *out) {
+  fprintf(out, "function %s\n", f->fn->name);
+  for (BB *bb = f->bb; bb; bb = bb->next) {
+    fprintf(out, "L%d:\n", bb->id);
+    for (IR *ir = bb->first; ir; ir = ir->next)
+      print_inst(ir, out);
+  }
+  fprintf(out, "\n");
+}
+
+// Print the IR of all functions in a translation unit for -emit-ir.
+void print_ir(Obj *prog, FILE *out) {
+  for (Obj *fn = prog; fn; fn = fn->next) {
+    if (!fn->is_function || !fn->is_definition || !fn->is_live)
+      continue;
+
+    IRFunc *f = gen_ir(fn);
+    if (f)
+      dump_ir(f, out);
+    else
+      fprintf(out, "# function %s is not lowered to the IR\n\n", fn->name);
+  }
+}
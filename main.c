@@ -7,6 +7,9 @@ typedef enum {
 StringArray include_paths;
 bool opt_fcommon = true;
 bool opt_fpic;
+bool opt_omit_frame_pointer;
+bool opt_mno_red_zone;
+int opt_O;
 
 static FileType opt_x;
 static StringArray opt_include;
@@ -16,6 +19,8 @@ static bool opt_MD;
 static bool opt_MMD;
 static bool opt_MP;
 static bool opt_S;
+static bool opt_emit_ir;
+static bool opt_peephole_stats;
 static bool opt_c;
 static bool opt_cc1;
 static bool opt_hash_hash_hash;
@@ -25,11 +30,13 @@ static char *opt_MF;
 static char *opt_MT;
 static char *opt_o;
 
+static StringArray macro_args;
 static StringArray ld_extra_args;
 static StringArray std_include_paths;
 
-char *base_file;
-static char *output_file;
+_Thread_local char *base_file;
+static _Thread_local char *output_file;
+static _Thread_local char *obj_file;
 
 static StringArray input_paths;
 static StringArray tmpfiles;
@@ -71,6 +78,12 @@ static void define(char *str) {
     define_macro(strndup(str, eq - str), eq + 1);
   else
     define_macro(str, "1");
+  strarray_push(&macro_args, format("-D%s", str));
+}
+
+static void undef(char *name) {
+  undef_macro(name);
+  strarray_push(&macro_args, format("-U%s", name));
 }
 
 static FileType parse_opt_x(char *s) {
@@ -120,6 +133,7 @@ static void parse_args(int argc, char **argv) {
         usage(1);
 
   StringArray idirafter = {};
+  int omit_frame_pointer = -1;
 
   for (int i = 1; i < argc; i++) {
     if (!strcmp(argv[i], "-###")) {
@@ -150,6 +164,17 @@ static void parse_args(int argc, char **argv) {
       continue;
     }
 
+    if (!strcmp(argv[i], "-emit-ir")) {
+      opt_S = opt_emit_ir = true;
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-O", 2)) {
+      // -O0 disables optimizations. Any other level enables -O1.
+      opt_O = strcmp(argv[i], "-O0") != 0;
+      continue;
+    }
+
     if (!strcmp(argv[i], "-fcommon")) {
       opt_fcommon = true;
       continue;
@@ -160,6 +185,21 @@ static void parse_args(int argc, char **argv) {
       continue;
     }
 
+    if (!strcmp(argv[i], "-fomit-frame-pointer")) {
+      omit_frame_pointer = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fno-omit-frame-pointer")) {
+      omit_frame_pointer = false;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-mno-red-zone")) {
+      opt_mno_red_zone = true;
+      continue;
+    }
+
     if (!strcmp(argv[i], "-c")) {
       opt_c = true;
       continue;
@@ -186,12 +226,12 @@ static void parse_args(int argc, char **argv) {
     }
 
     if (!strcmp(argv[i], "-U")) {
-      undef_macro(argv[++i]);
+      undef(argv[++i]);
       continue;
     }
 
     if (!strncmp(argv[i], "-U", 2)) {
-      undef_macro(argv[i] + 2);
+      undef(argv[i] + 2);
       continue;
     }
 
@@ -281,6 +321,21 @@ static void parse_args(int argc, char **argv) {
       continue;
     }
 
+    if (!strcmp(argv[i], "-cc1-obj")) {
+      obj_file = argv[++i];
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-peephole-stats")) {
+      opt_peephole_stats = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-cache-stats")) {
+      print_cache_stats();
+      exit(0);
+    }
+
     if (!strcmp(argv[i], "-idirafter")) {
       strarray_push(&idirafter, argv[i++]);
       continue;
@@ -316,17 +371,14 @@ static void parse_args(int argc, char **argv) {
     }
 
     // These options are ignored for now.
-    if (!strncmp(argv[i], "-O", 2) ||
-        !strncmp(argv[i], "-W", 2) ||
+    if (!strncmp(argv[i], "-W", 2) ||
         !strncmp(argv[i], "-g", 2) ||
         !strncmp(argv[i], "-std=", 5) ||
         !strcmp(argv[i], "-ffreestanding") ||
         !strcmp(argv[i], "-fno-builtin") ||
-        !strcmp(argv[i], "-fno-omit-frame-pointer") ||
         !strcmp(argv[i], "-fno-stack-protector") ||
         !strcmp(argv[i], "-fno-strict-aliasing") ||
         !strcmp(argv[i], "-m64") ||
-        !strcmp(argv[i], "-mno-red-zone") ||
         !strcmp(argv[i], "-w"))
       continue;
 
@@ -339,6 +391,12 @@ static void parse_args(int argc, char **argv) {
   for (int i = 0; i < idirafter.len; i++)
     strarray_push(&include_paths, idirafter.data[i]);
 
+  // -O1 implies -fomit-frame-pointer unless the opposite is given.
+  if (omit_frame_pointer == -1)
+    opt_omit_frame_pointer = opt_O;
+  else
+    opt_omit_frame_pointer = omit_frame_pointer;
+
   if (input_paths.len == 0)
     error("no input files");
 
@@ -397,21 +455,22 @@ static void run_subprocess(char **argv) {
     fprintf(stderr, "\n");
   }
 
-  if (fork() == 0) {
+  pid_t pid = fork();
+  if (pid == 0) {
     // Child process. Run a new command.
     execvp(argv[0], argv);
     fprintf(stderr, "exec failed: %s: %s\n", argv[0], strerror(errno));
     _exit(1);
   }
 
-  // Wait for the child process to finish.
+  // Wait for the child process to finish. Other threads may be
+  // running subprocesses too, so we wait only for our own child.
   int status;
-  while (wait(&status) > 0);
-  if (status != 0)
+  if (waitpid(pid, &status, 0) == -1 || status != 0)
     exit(1);
 }
 
-static void run_cc1(int argc, char **argv, char *input, char *output) {
+static void run_cc1(int argc, char **argv, char *input, char *output, char *obj) {
   char **args = calloc(argc + 10, sizeof(char *));
   memcpy(args, argv, argc * sizeof(char *));
   args[argc++] = "-cc1";
@@ -426,13 +485,16 @@ static void run_cc1(int argc, char **argv, char *input, char *output) {
     args[argc++] = output;
   }
 
+  if (obj) {
+    args[argc++] = "-cc1-obj";
+    args[argc++] = obj;
+  }
+
   run_subprocess(args);
 }
 
-// Print tokens to stdout. Used for -E.
-static void print_tokens(Token *tok) {
-  FILE *out = open_file(opt_o ? opt_o : "-");
-
+// Print tokens to a given file. Used for -E.
+static void print_tokens(Token *tok, FILE *out) {
   int line = 1;
   for (; tok->kind != TK_EOF; tok = tok->next) {
     if (line > 1 && tok->at_bol)
@@ -512,7 +574,8 @@ static Token *append_tokens(Token *tok1, Token *tok2) {
   return tok1;
 }
 
-static void cc1(void) {
+// Tokenize and preprocess `base_file` along with -include files.
+static Token *preprocess_input(void) {
   Token *tok = NULL;
 
   // Process -include option
@@ -520,7 +583,9 @@ static void cc1(void) {
     char *incl = opt_include.data[i];
 
     char *path;
-    if (file_exists(incl)) {
+    bool found = file_exists(incl);
+    manifest_add_probe(incl, found);
+    if (found) {
       path = incl;
     } else {
       path = search_include_paths(incl);
@@ -532,10 +597,51 @@ static void cc1(void) {
     tok = append_tokens(tok, tok2);
   }
 
-  // Tokenize and parse.
   Token *tok2 = must_tokenize_file(base_file);
   tok = append_tokens(tok, tok2);
-  tok = preprocess(tok);
+  return preprocess(tok);
+}
+
+static void assemble(char *input, char *output) {
+  char *cmd[] = {"as", "-c", input, "-o", output, NULL};
+  run_subprocess(cmd);
+}
+
+// Returns a key for the direct-mode manifest of the compilation
+// cache. It covers all command line options that affect
+// preprocessing.
+static char *direct_mode_key(void) {
+  StringArray arr = {};
+  strarray_push(&arr, base_file);
+  for (int i = 0; i < include_paths.len; i++)
+    strarray_push(&arr, format("-I%s", include_paths.data[i]));
+  for (int i = 0; i < opt_include.len; i++)
+    strarray_push(&arr, format("-include%s", opt_include.data[i]));
+  for (int i = 0; i < macro_args.len; i++)
+    strarray_push(&arr, macro_args.data[i]);
+  return manifest_key(&arr);
+}
+
+static void cc1(void) {
+  char *extn = obj_file ? ".o" : ".s";
+  char *path = obj_file ? obj_file : output_file;
+
+  // In direct mode, a valid manifest lets us copy the result from the
+  // compilation cache without preprocessing. -M and -MD need the
+  // list of included files, so they always run the preprocessor.
+  char *mkey = NULL;
+  if (!opt_E && !opt_M && !opt_MD && !opt_emit_ir && !opt_peephole_stats &&
+      strcmp(base_file, "-"))
+    mkey = direct_mode_key();
+
+  if (mkey) {
+    if (manifest_get(mkey, extn, path))
+      return;
+    manifest_begin();
+  }
+
+  // Tokenize and parse.
+  Token *tok = preprocess_input();
 
   // If -M or -MD are given, print file dependencies.
   if (opt_M || opt_MD) {
@@ -546,10 +652,18 @@ static void cc1(void) {
 
   // If -E is given, print out preprocessed C code as a result.
   if (opt_E) {
-    print_tokens(tok);
+    print_tokens(tok, open_file(opt_o ? opt_o : "-"));
     return;
   }
 
+  // If the same translation unit has been compiled before, copy the
+  // result from the compilation cache.
+  char *key = (opt_emit_ir || opt_peephole_stats) ? NULL : cache_key(tok);
+  if (mkey)
+    manifest_put(mkey, key);
+  if (key && cache_get(key, extn, path))
+    return;
+
   Obj *prog = parse(tok);
 
   // Open a temporary output buffer.
@@ -557,19 +671,108 @@ static void cc1(void) {
   size_t buflen;
   FILE *output_buf = open_memstream(&buf, &buflen);
 
-  // Traverse the AST to emit assembly.
-  codegen(prog, output_buf);
+  // Traverse the AST to emit assembly, or dump the IR if -emit-ir
+  // is given.
+  if (opt_emit_ir)
+    print_ir(prog, output_buf);
+  else
+    codegen(prog, output_buf);
   fclose(output_buf);
 
+  if (opt_peephole_stats)
+    print_peephole_stats(base_file);
+
   // Write the asembly text to a file.
   FILE *out = open_file(output_file);
   fwrite(buf, buflen, 1, out);
   fclose(out);
+
+  if (key)
+    cache_put(key, ".s", buf, buflen);
+
+  if (obj_file) {
+    assemble(output_file, obj_file);
+    if (key)
+      cache_put_file(key, ".o", obj_file);
+  }
 }
 
-static void assemble(char *input, char *output) {
-  char *cmd[] = {"as", "-c", input, "-o", output, NULL};
-  run_subprocess(cmd);
+// If more than one C file is given, we compile them in this process
+// on worker threads instead of spawning a cc1 subprocess for each
+// file. All compiler state is thread-local, and each file gets its
+// own preprocessor context initialized with the macros defined by
+// the command line, so translation units don't interfere with each
+// other.
+typedef struct {
+  char *input;
+  char *output; // Assembly output, or NULL for -E
+  char *obj;    // Object file to assemble to, or NULL
+  Preprocessor *pp;
+
+  // Preprocessed text for -E
+  char *buf;
+  size_t buflen;
+} Job;
+
+static bool use_threads;
+static bool in_server;
+static Job *jobs;
+static int njobs;
+
+// Each job runs on a new thread, so that it starts with fresh
+// thread-local compiler state.
+static void *worker(void *arg) {
+  Job *job = arg;
+  use_preprocessor(job->pp);
+  base_file = job->input;
+
+  if (job->output || opt_M || opt_MD) {
+    output_file = job->output;
+    obj_file = job->obj;
+    cc1();
+    return NULL;
+  }
+
+  FILE *out = open_memstream(&job->buf, &job->buflen);
+  print_tokens(preprocess_input(), out);
+  fclose(out);
+  return NULL;
+}
+
+// Compile a C file to an assembly file and then assemble it if
+// `obj` is not NULL. If `output` is NULL, the file is just
+// preprocessed.
+static void compile(int argc, char **argv, char *input, char *output, char *obj) {
+  if (!use_threads) {
+    run_cc1(argc, argv, input, output, obj);
+    return;
+  }
+
+  jobs = realloc(jobs, sizeof(Job) * (njobs + 1));
+  jobs[njobs++] = (Job){input, output, obj, new_preprocessor()};
+}
+
+static void run_jobs(void) {
+  // Run at most as many threads as CPUs at once.
+  int nthreads = MAX(1, sysconf(_SC_NPROCESSORS_ONLN));
+  pthread_t *threads = calloc(njobs, sizeof(pthread_t));
+
+  for (int i = 0; i < njobs; i++) {
+    if (i >= nthreads)
+      pthread_join(threads[i - nthreads], NULL);
+    if (pthread_create(&threads[i], NULL, worker, &jobs[i]))
+      error("pthread_create failed");
+  }
+
+  for (int i = MAX(0, njobs - nthreads); i < njobs; i++)
+    pthread_join(threads[i], NULL);
+
+  if (opt_E) {
+    FILE *out = open_file(opt_o ? opt_o : "-");
+    for (int i = 0; i < njobs; i++)
+      fwrite(jobs[i].buf, jobs[i].buflen, 1, out);
+    fflush(out);
+  }
 }
 
 static char *find_file(char *pattern) {
@@ -697,9 +900,7 @@ static FileType get_file_type(char *filename) {
   error("<command line>: unknown file extension: %s", filename);
 }
 
-int main(int argc, char **argv) {
-  atexit(cleanup);
-  init_macros();
+static int driver(int argc, char **argv) {
   parse_args(argc, argv);
 
   if (opt_cc1) {
@@ -711,6 +912,23 @@ int main(int argc, char **argv) {
   if (input_paths.len > 1 && opt_o && (opt_c || opt_S | opt_E))
     error("cannot specify '-o' with '-c,' '-S' or '-E' with multiple files");
 
+  int num_c_files = 0;
+  for (int i = 0; i < input_paths.len; i++) {
+    char *input = input_paths.data[i];
+    if (strncmp(input, "-l", 2) && strncmp(input, "-Wl,", 4) &&
+        get_file_type(input) == FILE_C)
+      num_c_files++;
+  }
+
+  // A compile server compiles even a single file in-process, so that
+  // the file is compiled with the server's warm caches.
+  if (!opt_hash_hash_hash &&
+      ((num_c_files > 1 && !opt_M && !opt_MD) ||
+       (num_c_files == 1 && in_server))) {
+    use_threads = true;
+    add_default_include_paths(argv[0]);
+  }
+
   StringArray ld_args = {};
 
   for (int i = 0; i < input_paths.len; i++) {
@@ -758,34 +976,62 @@ int main(int argc, char **argv) {
 
     // Just preprocess
     if (opt_E || opt_M) {
-      run_cc1(argc, argv, input, NULL);
+      compile(argc, argv, input, NULL, NULL);
       continue;
     }
 
     // Compile
     if (opt_S) {
-      run_cc1(argc, argv, input, output);
+      compile(argc, argv, input, output, NULL);
       continue;
     }
 
     // Compile and assemble
     if (opt_c) {
-      char *tmp = create_tmpfile();
-      run_cc1(argc, argv, input, tmp);
-      assemble(tmp, output);
+      compile(argc, argv, input, create_tmpfile(), output);
       continue;
     }
 
     // Compile, assemble and link
     char *tmp1 = create_tmpfile();
     char *tmp2 = create_tmpfile();
-    run_cc1(argc, argv, input, tmp1);
-    assemble(tmp1, tmp2);
+    compile(argc, argv, input, tmp1, tmp2);
     strarray_push(&ld_args, tmp2);
     continue;
   }
 
+  if (njobs > 0)
+    run_jobs();
+
   if (ld_args.len > 0)
     run_linker(&ld_args, opt_o ? opt_o : "a.out");
   return 0;
 }
+
+static int serve_request(int argc, char **argv) {
+  in_server = true;
+  return driver(argc, argv);
+}
+
+int main(int argc, char **argv) {
+  atexit(cleanup);
+  init_macros();
+
+  // "chibicc -server <path>" starts a compile server listening on a
+  // Unix domain socket. If $CHIBICC_SERVER is set to the path of the
+  // socket, the compiler driver forwards its command line to the
+  // server instead of compiling by itself.
+  if (argc == 3 && !strcmp(argv[1], "-server"))
+    run_server(argv[2], serve_request);
+
+  char *server = getenv("CHIBICC_SERVER");
+  bool is_cc1 = false;
+  for (int i = 1; i < argc; i++)
+    if (!strcmp(argv[i], "-cc1"))
+      is_cc1 = true;
+
+  int status;
+  if (server && *server && !is_cc1 && run_client(server, argc, argv, &status))
+    return status;
+  return driver(argc, argv);
+}
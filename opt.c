@@ -0,0 +1,921 @@
+// This file implements the -O1 optimizations on the IR. The passes
+// are run repeatedly until none of them changes the function:
+//
+//  - Constant folding and algebraic simplification. A register with a
+//    single definition that loads an immediate is a constant, so
+//    constants are propagated through such registers.
+//  - Copy propagation of moves between single-definition registers,
+//    and coalescing of a computation with a move of its result.
+//  - Simplification of the control flow graph: branches on constants
+//    become jumps, jumps to empty blocks are threaded, and blocks that
+//    are not reachable from the entry block are removed.
+//  - Dead-store elimination for local variables whose address is only
+//    used by loads and stores.
+//  - Dead-code elimination of instructions whose results are unused
+//    or overwritten before use.
+//
+// Finally, calls whose values are returned right away are marked as
+// tail calls.
+//
+// Virtual registers are not in SSA form, but a register with a single
+// definition is never modified after it is defined, which is all
+// these passes need to know.
+
+#include "chibicc.h"
+
+static _Thread_local IR **def_of;
+static _Thread_local int *ndefs;
+static _Thread_local int *nuses;
+
+static void count_regs(IRFunc *f) {
+  int nregs = f->nregs + 1;
+  def_of = calloc(nregs, sizeof(IR *));
+  ndefs = calloc(nregs, sizeof(int));
+  nuses = calloc(nregs, sizeof(int));
+
+  for (BB *bb = f->bb; bb; bb = bb->next) {
+    for (IR *ir = bb->first; ir; ir = ir->next) {
+      int *p;
+      for (int i = 0; (p = ir_use(ir, i)); i++)
+        nuses[*p]++;
+      if (ir->d) {
+        ndefs[ir->d]++;
+        def_of[ir->d] = ir;
+      }
+    }
+  }
+}
+
+// Returns the definition of `r` if it has only one.
+static IR *single_def(int r) {
+  if (r && ndefs[r] == 1)
+    return def_of[r];
+  return NULL;
+}
+
+static bool is_const(int r, long *val) {
+  IR *ir = single_def(r);
+  if (!ir || ir->kind != IR_IMM)
+    return false;
+  *val = ir->imm;
+  return true;
+}
+
+static void remove_inst(BB *bb, IR *ir) {
+  if (ir->prev)
+    ir->prev->next = ir->next;
+  else
+    bb->first = ir->next;
+  if (ir->next)
+    ir->next->prev = ir->prev;
+  else
+    bb->last = ir->prev;
+}
+
+static void to_imm(IR *ir, long val) {
+  ir->kind = IR_IMM;
+  ir->imm = val;
+  ir->a = ir->b = 0;
+}
+
+static void to_mov(IR *ir, int a) {
+  ir->kind = IR_MOV;
+  ir->a = a;
+  ir->b = 0;
+}
+
+//
+// Constant folding and algebraic simplification
+//
+
+static long extend(long val, int size, bool is_unsigned) {
+  if (is_unsigned) {
+    switch (size) {
+    case 1: return (uint8_t)val;
+    case 2: return (uint16_t)val;
+    case 4: return (uint32_t)val;
+    }
+    return val;
+  }
+
+  switch (size) {
+  case 1: return (int8_t)val;
+  case 2: return (int16_t)val;
+  case 4: return (int32_t)val;
+  }
+  return val;
+}
+
+// Evaluate a binary operator in the same way as the backend does.
+// Only the lower `size` bytes of the operands are significant.
+static bool eval_binary(IR *ir, long x, long y, long *res) {
+  int size = ir->size;
+  bool u = ir->is_unsigned;
+  x = extend(x, size, u);
+  y = extend(y, size, u);
+
+  uint64_t ux = x, uy = y;
+  long val;
+
+  switch (ir->kind) {
+  case IR_ADD: val = ux + uy; break;
+  case IR_SUB: val = ux - uy; break;
+  case IR_MUL: val = ux * uy; break;
+  case IR_AND: val = x & y; break;
+  case IR_OR:  val = x | y; break;
+  case IR_XOR: val = x ^ y; break;
+  case IR_SHL: val = ux << (y & (size * 8 - 1)); break;
+  case IR_SHR:
+    if (u)
+      val = ux >> (y & (size * 8 - 1));
+    else
+      val = x >> (y & (size * 8 - 1));
+    break;
+  case IR_DIV:
+  case IR_MOD:
+    // Leave division by zero and overflow to the runtime.
+    if (y == 0 || (!u && y == -1))
+      return false;
+    if (ir->kind == IR_DIV)
+      val = u ? (long)(ux / uy) : x / y;
+    else
+      val = u ? (long)(ux % uy) : x % y;
+    break;
+  case IR_EQ: *res = (x == y); return true;
+  case IR_NE: *res = (x != y); return true;
+  case IR_LT: *res = u ? (ux < uy) : (x < y); return true;
+  case IR_LE: *res = u ? (ux <= uy) : (x <= y); return true;
+  default:
+    return false;
+  }
+
+  *res = extend(val, size, false);
+  return true;
+}
+
+static bool is_commutative(IROp kind) {
+  switch (kind) {
+  case IR_ADD:
+  case IR_MUL:
+  case IR_AND:
+  case IR_OR:
+  case IR_XOR:
+  case IR_EQ:
+  case IR_NE:
+    return true;
+  }
+  return false;
+}
+
+// Simplify `a op k` where k is a constant.
+static bool simplify_const_rhs(IR *ir, long k) {
+  k = extend(k, ir->size, false);
+
+  switch (ir->kind) {
+  case IR_ADD:
+  case IR_SUB:
+  case IR_OR:
+  case IR_XOR:
+  case IR_SHL:
+  case IR_SHR:
+    if (k == 0) {
+      to_mov(ir, ir->a);
+      return true;
+    }
+    return false;
+  case IR_MUL:
+    if (k == 0) {
+      to_imm(ir, 0);
+      return true;
+    }
+    if (k == 1) {
+      to_mov(ir, ir->a);
+      return true;
+    }
+    return false;
+  case IR_DIV:
+    if (k == 1) {
+      to_mov(ir, ir->a);
+      return true;
+    }
+    return false;
+  case IR_MOD:
+    if (k == 1 || (!ir->is_unsigned && k == -1)) {
+      to_imm(ir, 0);
+      return true;
+    }
+    return false;
+  case IR_AND:
+    if (k == 0) {
+      to_imm(ir, 0);
+      return true;
+    }
+    if (k == -1) {
+      to_mov(ir, ir->a);
+      return true;
+    }
+    return false;
+  }
+  return false;
+}
+
+// Simplify `a op a`.
+static bool simplify_same_operands(IR *ir) {
+  switch (ir->kind) {
+  case IR_SUB:
+  case IR_XOR:
+  case IR_NE:
+  case IR_LT:
+    to_imm(ir, 0);
+    return true;
+  case IR_EQ:
+  case IR_LE:
+    to_imm(ir, 1);
+    return true;
+  case IR_AND:
+  case IR_OR:
+    to_mov(ir, ir->a);
+    return true;
+  }
+  return false;
+}
+
+static bool simplify_inst(IR *ir) {
+  long x, y;
+
+  switch (ir->kind) {
+  case IR_MOV:
+    if (is_const(ir->a, &x)) {
+      to_imm(ir, x);
+      return true;
+    }
+    return false;
+  case IR_NEG:
+    if (is_const(ir->a, &x)) {
+      to_imm(ir, -(uint64_t)x);
+      return true;
+    }
+    return false;
+  case IR_BITNOT:
+    if (is_const(ir->a, &x)) {
+      to_imm(ir, ~x);
+      return true;
+    }
+    return false;
+  case IR_CAST:
+    if (is_const(ir->a, &x)) {
+      to_imm(ir, extend(x, ir->size, ir->is_unsigned));
+      return true;
+    }
+    return false;
+  case IR_ADD:
+  case IR_SUB:
+  case IR_MUL:
+  case IR_DIV:
+  case IR_MOD:
+  case IR_AND:
+  case IR_OR:
+  case IR_XOR:
+  case IR_SHL:
+  case IR_SHR:
+  case IR_EQ:
+  case IR_NE:
+  case IR_LT:
+  case IR_LE: {
+    bool a_const = is_const(ir->a, &x);
+    bool b_const = is_const(ir->b, &y);
+    long val;
+
+    if (a_const && b_const) {
+      if (!eval_binary(ir, x, y, &val))
+        return false;
+      to_imm(ir, val);
+      return true;
+    }
+
+    // Keep constants on the right-hand side, where the backend can
+    // use them as immediate operands.
+    if (a_const && is_commutative(ir->kind)) {
+      int tmp = ir->a;
+      ir->a = ir->b;
+      ir->b = tmp;
+      simplify_const_rhs(ir, x);
+      return true;
+    }
+
+    if (b_const)
+      return simplify_const_rhs(ir, y);
+    if (ir->a == ir->b)
+      return simplify_same_operands(ir);
+    return false;
+  }
+  case IR_BR:
+    if (is_const(ir->a, &x)) {
+      x = extend(x, ir->size, false);
+      ir->kind = IR_JMP;
+      ir->bb1 = x ? ir->bb1 : ir->bb2;
+      ir->bb2 = NULL;
+      ir->a = 0;
+      return true;
+    }
+    if (ir->bb1 == ir->bb2) {
+      ir->kind = IR_JMP;
+      ir->bb2 = NULL;
+      ir->a = 0;
+      return true;
+    }
+    return false;
+  case IR_SWITCH:
+    if (is_const(ir->a, &x)) {
+      x = extend(x, ir->size, true);
+      if ((unsigned long)x >= ir->ntargets)
+        return false;
+      ir->kind = IR_JMP;
+      ir->bb1 = ir->targets[x];
+      ir->targets = NULL;
+      ir->ntargets = 0;
+      ir->a = 0;
+      return true;
+    }
+    return false;
+  }
+  return false;
+}
+
+//
+// Dominators
+//
+
+static _Thread_local BB **idom; // Immediate dominator, indexed by BB::idx
+static _Thread_local int *rpo;  // Reverse postorder number, or -1
+
+static void number_blocks(BB *bb, BB **order, int *n) {
+  if (rpo[bb->idx] != -1)
+    return;
+  rpo[bb->idx] = 0;
+
+  BB **p;
+  for (int i = 0; (p = ir_succ(bb->last, i)); i++)
+    number_blocks(*p, order, n);
+  order[(*n)++] = bb;
+}
+
+static BB *intersect(BB *x, BB *y) {
+  while (x != y) {
+    while (rpo[x->idx] > rpo[y->idx])
+      x = idom[x->idx];
+    while (rpo[y->idx] > rpo[x->idx])
+      y = idom[y->idx];
+  }
+  return x;
+}
+
+// Compute dominators with the algorithm described in "A Simple, Fast
+// Dominance Algorithm" by Cooper, Harvey and Kennedy.
+static void compute_dominators(IRFunc *f) {
+  int nbbs = 0;
+  for (BB *bb = f->bb; bb; bb = bb->next)
+    bb->idx = nbbs++;
+
+  idom = calloc(nbbs, sizeof(BB *));
+  rpo = calloc(nbbs, sizeof(int));
+  for (int i = 0; i < nbbs; i++)
+    rpo[i] = -1;
+
+  // Blocks in postorder
+  BB **order = calloc(nbbs, sizeof(BB *));
+  int n = 0;
+  number_blocks(f->bb, order, &n);
+  for (int i = 0; i < n; i++)
+    rpo[order[i]->idx] = n - 1 - i;
+
+  // Predecessor lists
+  int *npreds = calloc(nbbs, sizeof(int));
+  BB ***preds = calloc(nbbs, sizeof(BB **));
+  for (int i = 0; i < n; i++) {
+    BB **p;
+    for (int j = 0; (p = ir_succ(order[i]->last, j)); j++)
+      npreds[(*p)->idx]++;
+  }
+  for (int i = 0; i < nbbs; i++) {
+    preds[i] = calloc(npreds[i], sizeof(BB *));
+    npreds[i] = 0;
+  }
+  for (int i = 0; i < n; i++) {
+    BB **p;
+    for (int j = 0; (p = ir_succ(order[i]->last, j)); j++)
+      preds[(*p)->idx][npreds[(*p)->idx]++] = order[i];
+  }
+
+  idom[f->bb->idx] = f->bb;
+
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (int i = n - 2; i >= 0; i--) {
+      BB *bb = order[i];
+      BB *new_idom = NULL;
+
+      for (int j = 0; j < npreds[bb->idx]; j++) {
+        BB *pred = preds[bb->idx][j];
+        if (idom[pred->idx])
+          new_idom = new_idom ? intersect(pred, new_idom) : pred;
+      }
+
+      if (idom[bb->idx] != new_idom) {
+        idom[bb->idx] = new_idom;
+        changed = true;
+      }
+    }
+  }
+}
+
+// Returns true if every path from the entry to `y` goes through `x`.
+// Unreachable blocks are dominated by everything.
+static bool dominates(BB *x, BB *y) {
+  if (rpo[y->idx] == -1)
+    return true;
+  for (;;) {
+    if (x == y)
+      return true;
+    if (y == idom[y->idx])
+      return false;
+    y = idom[y->idx];
+  }
+}
+
+// Replace uses of registers that are copies of other registers with
+// the original ones. Both registers must have a single definition,
+// and the copy must dominate all uses. Otherwise, the original may be
+// redefined by a loop before a use.
+static bool propagate_copies(IRFunc *f) {
+  int nregs = f->nregs + 1;
+  int *copy_of = calloc(nregs, sizeof(int));
+  BB **copy_bb = calloc(nregs, sizeof(BB *));
+  bool *seen = calloc(nregs, sizeof(bool));
+  bool found = false;
+
+  compute_dominators(f);
+
+  for (BB *bb = f->bb; bb; bb = bb->next) {
+    for (IR *ir = bb->first; ir; ir = ir->next) {
+      if (ir->kind == IR_MOV && ir->d != ir->a && ndefs[ir->d] == 1 &&
+          single_def(ir->a)) {
+        copy_of[ir->d] = ir->a;
+        copy_bb[ir->d] = bb;
+        found = true;
+      }
+    }
+  }
+
+  if (!found)
+    return false;
+
+  // Drop copies that don't dominate their uses.
+  for (BB *bb = f->bb; bb; bb = bb->next) {
+    for (IR *ir = bb->first; ir; ir = ir->next) {
+      int *p;
+      for (int i = 0; (p = ir_use(ir, i)); i++) {
+        int v = *p;
+        if (!copy_of[v])
+          continue;
+        if (copy_bb[v] == bb ? !seen[v] : !dominates(copy_bb[v], bb))
+          copy_of[v] = 0;
+      }
+      if (ir->d && copy_bb[ir->d] == bb)
+        seen[ir->d] = true;
+    }
+  }
+
+  bool changed = false;
+  for (BB *bb = f->bb; bb; bb = bb->next) {
+    for (IR *ir = bb->first; ir; ir = ir->next) {
+      int *p;
+      for (int i = 0; (p = ir_use(ir, i)); i++) {
+        while (*p && copy_of[*p]) {
+          *p = copy_of[*p];
+          changed = true;
+        }
+      }
+    }
+  }
+  return changed;
+}
+
+// Compute a value directly into the register it is copied to if the
+// copy immediately follows the only use of the value:
+//
+//   t = a op b; x = t  =>  x = a op b
+static bool coalesce_copies(IRFunc *f) {
+  bool changed = false;
+
+  for (BB *bb = f->bb; bb; bb = bb->next) {
+    for (IR *ir = bb->first; ir && ir->next; ir = ir->next) {
+      IR *mov = ir->next;
+      if (mov->kind == IR_MOV && ir->d && mov->a == ir->d && mov->d != ir->d &&
+          ndefs[ir->d] == 1 && nuses[ir->d] == 1) {
+        ir->d = mov->d;
+        remove_inst(bb, mov);
+        changed = true;
+      }
+    }
+  }
+  return changed;
+}
+
+static bool simplify(IRFunc *f) {
+  count_regs(f);
+  bool changed = false;
+
+  for (BB *bb = f->bb; bb; bb = bb->next)
+    for (IR *ir = bb->first; ir; ir = ir->next)
+      if (simplify_inst(ir))
+        changed = true;
+
+  if (propagate_copies(f))
+    changed = true;
+
+  count_regs(f);
+  if (coalesce_copies(f))
+    changed = true;
+  return changed;
+}
+
+//
+// Control flow graph simplification
+//
+
+// If `bb` contains nothing but a jump, returns the block that the
+// jump eventually leads to.
+static BB *skip_empty(BB *bb) {
+  for (int i = 0; i < 100 && bb->first->kind == IR_JMP; i++) {
+    if (bb->first->bb1 == bb)
+      break;
+    bb = bb->first->bb1;
+  }
+  return bb;
+}
+
+static void mark_reachable(BB *bb, bool *reachable) {
+  if (reachable[bb->idx])
+    return;
+  reachable[bb->idx] = true;
+
+  BB **p;
+  for (int i = 0; (p = ir_succ(bb->last, i)); i++)
+    mark_reachable(*p, reachable);
+}
+
+static bool simplify_cfg(IRFunc *f) {
+  bool changed = false;
+  int nbbs = 0;
+
+  for (BB *bb = f->bb; bb; bb = bb->next) {
+    bb->idx = nbbs++;
+
+    BB **p;
+    for (int i = 0; (p = ir_succ(bb->last, i)); i++) {
+      BB *target = skip_empty(*p);
+      if (target != *p) {
+        *p = target;
+        changed = true;
+      }
+    }
+  }
+
+  bool *reachable = calloc(nbbs, sizeof(bool));
+  mark_reachable(f->bb, reachable);
+
+  for (BB **p = &f->bb; *p;) {
+    if (reachable[(*p)->idx]) {
+      p = &(*p)->next;
+    } else {
+      *p = (*p)->next;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+//
+// Dead-store elimination
+//
+
+typedef struct {
+  Obj *var;
+  bool escaped;
+  bool loaded;
+} LocalInfo;
+
+static _Thread_local LocalInfo *locals;
+static _Thread_local int nlocals;
+
+static LocalInfo *find_local(Obj *var) {
+  for (int i = 0; i < nlocals; i++)
+    if (locals[i].var == var)
+      return &locals[i];
+  return NULL;
+}
+
+// Returns the local variable whose address is in `r`, or NULL.
+static LocalInfo *local_of(int r) {
+  IR *def = single_def(r);
+  if (!def || def->kind != IR_LVAR)
+    return NULL;
+  return find_local(def->var);
+}
+
+static bool is_memory_op(IROp kind) {
+  return kind == IR_LOAD || kind == IR_STORE || kind == IR_ZERO;
+}
+
+// Find out which local variables are accessed only through loads and
+// stores at constant offsets. Any other use of a variable's address
+// makes it escape. Pointer arithmetic on the address of one variable
+// may reach its neighbors on the stack, so it makes all of them
+// escape.
+static void analyze_locals(IRFunc *f) {
+  nlocals = 0;
+  for (Obj *var = f->fn->locals; var; var = var->next)
+    nlocals++;
+
+  locals = calloc(nlocals, sizeof(LocalInfo));
+  int i = 0;
+  for (Obj *var = f->fn->locals; var; var = var->next)
+    locals[i++].var = var;
+
+  bool all_escaped = false;
+
+  for (BB *bb = f->bb; bb; bb = bb->next) {
+    for (IR *ir = bb->first; ir; ir = ir->next) {
+      // An address in a register with other definitions is not
+      // tracked.
+      if (ir->kind == IR_LVAR && ndefs[ir->d] != 1) {
+        LocalInfo *info = find_local(ir->var);
+        if (info)
+          info->escaped = true;
+      }
+
+      int *p;
+      for (int j = 0; (p = ir_use(ir, j)); j++) {
+        LocalInfo *info = local_of(*p);
+        if (!info)
+          continue;
+        if (ir->kind == IR_ADD || ir->kind == IR_SUB)
+          all_escaped = true;
+        if (j != 0 || !is_memory_op(ir->kind))
+          info->escaped = true;
+        else if (ir->kind == IR_LOAD)
+          info->loaded = true;
+      }
+    }
+  }
+
+  if (all_escaped)
+    for (i = 0; i < nlocals; i++)
+      locals[i].escaped = true;
+}
+
+typedef struct {
+  LocalInfo *info;
+  long begin;
+  long end;
+} Range;
+
+// Walk a block backward and remove stores that are overwritten before
+// they are read. At a return, no local variable is read anymore.
+static bool remove_overwritten_stores(BB *bb) {
+  Range *dead = NULL;
+  int ndead = 0;
+  int cap = 0;
+  bool changed = false;
+
+  if (bb->last->kind == IR_RET) {
+    cap = nlocals;
+    dead = calloc(cap, sizeof(Range));
+    for (int i = 0; i < nlocals; i++)
+      dead[ndead++] = (Range){&locals[i], 0, INT64_MAX};
+  }
+
+  for (IR *ir = bb->last; ir;) {
+    IR *prev = ir->prev;
+    LocalInfo *info = is_memory_op(ir->kind) ? local_of(ir->a) : NULL;
+
+    if (info && !info->escaped) {
+      if (ir->kind == IR_LOAD) {
+        for (int i = 0; i < ndead;)
+          if (dead[i].info == info)
+            dead[i] = dead[--ndead];
+          else
+            i++;
+      } else {
+        long begin = ir->imm;
+        long end = ir->imm + ((ir->kind == IR_STORE) ? ir->ty->size : ir->size);
+
+        bool covered = false;
+        for (int i = 0; i < ndead; i++)
+          if (dead[i].info == info && dead[i].begin <= begin && end <= dead[i].end)
+            covered = true;
+
+        if (covered) {
+          remove_inst(bb, ir);
+          changed = true;
+        } else {
+          if (ndead == cap) {
+            cap = cap * 2 + 4;
+            dead = realloc(dead, cap * sizeof(Range));
+          }
+          dead[ndead++] = (Range){info, begin, end};
+        }
+      }
+    }
+    ir = prev;
+  }
+  return changed;
+}
+
+static bool remove_dead_stores(IRFunc *f) {
+  count_regs(f);
+  analyze_locals(f);
+  bool changed = false;
+
+  for (BB *bb = f->bb; bb; bb = bb->next) {
+    // Stores to a variable that is never read are dead.
+    for (IR *ir = bb->first; ir;) {
+      IR *next = ir->next;
+      if (ir->kind == IR_STORE || ir->kind == IR_ZERO) {
+        LocalInfo *info = local_of(ir->a);
+        if (info && !info->escaped && !info->loaded) {
+          remove_inst(bb, ir);
+          changed = true;
+        }
+      }
+      ir = next;
+    }
+
+    if (remove_overwritten_stores(bb))
+      changed = true;
+  }
+  return changed;
+}
+
+//
+// Dead-code elimination
+//
+
+static bool has_side_effect(IR *ir) {
+  switch (ir->kind) {
+  case IR_LOAD: {
+    // Loads from local variables can be removed.
+    IR *def = single_def(ir->a);
+    return !def || def->kind != IR_LVAR;
+  }
+  case IR_STORE:
+  case IR_ZERO:
+  case IR_CALL:
+  case IR_JMP:
+  case IR_BR:
+  case IR_SWITCH:
+  case IR_RET:
+    return true;
+  }
+  return false;
+}
+
+// Remove definitions that are overwritten later in the same block
+// before being used.
+static bool remove_dead_defs(IRFunc *f) {
+  int *killed = calloc(f->nregs + 1, sizeof(int));
+  bool changed = false;
+
+  for (BB *bb = f->bb; bb; bb = bb->next) {
+    int stamp = bb->idx + 1;
+
+    for (IR *ir = bb->last; ir;) {
+      IR *prev = ir->prev;
+      if (ir->d && killed[ir->d] == stamp && !has_side_effect(ir)) {
+        remove_inst(bb, ir);
+        changed = true;
+      } else {
+        if (ir->d)
+          killed[ir->d] = stamp;
+        int *p;
+        for (int i = 0; (p = ir_use(ir, i)); i++)
+          killed[*p] = 0;
+      }
+      ir = prev;
+    }
+  }
+  return changed;
+}
+
+static bool remove_dead_code(IRFunc *f) {
+  bool changed = false;
+
+  for (bool again = true; again;) {
+    again = false;
+    count_regs(f);
+
+    for (BB *bb = f->bb; bb; bb = bb->next) {
+      for (IR *ir = bb->last; ir;) {
+        IR *prev = ir->prev;
+        if (ir->d && !nuses[ir->d] && !has_side_effect(ir)) {
+          remove_inst(bb, ir);
+          int *p;
+          for (int i = 0; (p = ir_use(ir, i)); i++)
+            nuses[*p]--;
+          again = changed = true;
+        } else if (ir->kind == IR_MOV && ir->d == ir->a) {
+          remove_inst(bb, ir);
+          again = changed = true;
+        }
+        ir = prev;
+      }
+    }
+  }
+  return changed;
+}
+
+//
+// Tail calls
+//
+
+// Returns true if the code after `call` returns its value, or returns
+// nothing, doing nothing else but moving the value and jumping.
+static bool returns_value(IR *call) {
+  int val = call->d;
+  IR *ir = call->next;
+
+  for (int i = 0; ir && i < 16; i++) {
+    switch (ir->kind) {
+    case IR_MOV:
+      if (ir->a != val)
+        return false;
+      val = ir->d;
+      ir = ir->next;
+      continue;
+    case IR_JMP:
+      ir = ir->bb1->first;
+      continue;
+    case IR_RET:
+      return !ir->a || ir->a == val;
+    }
+    return false;
+  }
+  return false;
+}
+
+// Returns true if a function returning `ret` may return a value of
+// type `ty` in %rax as is. Small values are extended by the caller.
+static bool same_return(Type *ret, Type *ty) {
+  if (ret->size != ty->size)
+    return false;
+  if (ret->size >= 4)
+    return true;
+  return ret->kind == ty->kind && ret->is_unsigned == ty->is_unsigned;
+}
+
+// A call whose value is returned right away can jump to the callee
+// after the caller's frame is torn down, so that the callee returns
+// to the caller's caller. This is not done if the address of a local
+// variable escapes, because the callee may then access the frame, or
+// if arguments are passed on the stack.
+static void mark_tail_calls(IRFunc *f) {
+  if (f->fn->va_area)
+    return;
+
+  count_regs(f);
+  analyze_locals(f);
+  for (int i = 0; i < nlocals; i++)
+    if (locals[i].escaped)
+      return;
+
+  Type *ret = f->fn->ty->return_ty;
+
+  for (BB *bb = f->bb; bb; bb = bb->next) {
+    for (IR *ir = bb->first; ir; ir = ir->next) {
+      if (ir->kind != IR_CALL || ir->nargs > 6)
+        continue;
+
+      if (returns_value(ir) && (ret->kind == TY_VOID || same_return(ret, ir->ty)))
+        ir->is_tail = true;
+    }
+  }
+}
+
+void optimize_ir(IRFunc *f) {
+  for (bool changed = true; changed;) {
+    changed = false;
+    if (simplify(f))
+      changed = true;
+    if (simplify_cfg(f))
+      changed = true;
+    if (remove_dead_stores(f))
+      changed = true;
+    if (remove_dead_code(f))
+      changed = true;
+    if (remove_dead_defs(f))
+      changed = true;
+  }
+
+  mark_tail_calls(f);
+}
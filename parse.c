@@ -45,6 +45,8 @@ typedef struct {
   bool is_extern;
   bool is_inline;
   bool is_tls;
+  bool is_always_inline;
+  bool is_noinline;
   int align;
 } VarAttr;
 
@@ -82,32 +84,34 @@ struct InitDesg {
 
 // All local variable instances created during parsing are
 // accumulated to this list.
-static Obj *locals;
+static _Thread_local Obj *locals;
 
 // Likewise, global variables are accumulated to this list.
-static Obj *globals;
+static _Thread_local Obj *globals;
 
-static Scope *scope = &(Scope){};
+static _Thread_local Scope *scope;
 
 // Points to the function object the parser is currently parsing.
-static Obj *current_fn;
+static _Thread_local Obj *current_fn;
+static _Thread_local Block *current_block;
 
 // Lists of all goto statements and labels in the curent function.
-static Node *gotos;
-static Node *labels;
+static _Thread_local Node *gotos;
+static _Thread_local Node *labels;
 
 // Current "goto" and "continue" jump targets.
-static char *brk_label;
-static char *cont_label;
+static _Thread_local char *brk_label;
+static _Thread_local char *cont_label;
 
 // Points to a node representing a switch if we are parsing
 // a switch statement. Otherwise, NULL.
-static Node *current_switch;
+static _Thread_local Node *current_switch;
 
-static Obj *builtin_alloca;
+static _Thread_local Obj *builtin_alloca;
 
 static bool is_typename(Token *tok);
 static Type *declspec(Token **rest, Token *tok, VarAttr *attr);
+static Token *func_attribute_list(Token *tok, VarAttr *attr);
 static Type *typename(Token **rest, Token *tok);
 static Type *enum_specifier(Token **rest, Token *tok);
 static Type *typeof_specifier(Token **rest, Token *tok);
@@ -170,6 +174,17 @@ static void leave_scope(void) {
   scope = scope->next;
 }
 
+static void enter_block(void) {
+  Block *blk = calloc(1, sizeof(Block));
+  blk->parent = current_block;
+  blk->depth = current_block ? current_block->depth + 1 : 1;
+  current_block = blk;
+}
+
+static void leave_block(void) {
+  current_block = current_block->parent;
+}
+
 // Find a variable by name.
 static VarScope *find_var(Token *tok) {
   for (Scope *sc = scope; sc; sc = sc->next) {
@@ -310,6 +325,7 @@ static Obj *new_var(char *name, Type *ty) {
 static Obj *new_lvar(char *name, Type *ty) {
   Obj *var = new_var(name, ty);
   var->is_local = true;
+  var->block = current_block;
   var->next = locals;
   locals = var;
   return var;
@@ -325,7 +341,7 @@ static Obj *new_gvar(char *name, Type *ty) {
 }
 
 static char *new_unique_name(void) {
-  static int id = 0;
+  static _Thread_local int id = 0;
   return format(".L..%d", id++);
 }
 
@@ -427,6 +443,14 @@ static Type *declspec(Token **rest, Token *tok, VarAttr *attr) {
       continue;
     }
 
+    // [GNU] Function attributes
+    if (equal(tok, "__attribute__")) {
+      if (!attr)
+        error_tok(tok, "attribute is not allowed in this context");
+      tok = func_attribute_list(tok, attr);
+      continue;
+    }
+
     // These keywords are recognized but ignored.
     if (consume(&tok, tok, "const") || consume(&tok, tok, "volatile") ||
         consume(&tok, tok, "auto") || consume(&tok, tok, "register") ||
@@ -699,6 +723,12 @@ static Type *declarator(Token **rest, Token *tok, Type *ty) {
   }
 
   ty = type_suffix(rest, tok, ty);
+
+  // Predefined types such as ty_int are shared by all threads, so we
+  // attach a declaration name to a copy rather than to the type itself.
+  if (is_numeric(ty) || ty->kind == TY_VOID)
+    ty = copy_type(ty);
+
   ty->name = name;
   ty->name_pos = name_pos;
   return ty;
@@ -831,7 +861,17 @@ static Node *compute_vla_size(Type *ty, Token *tok) {
   return new_binary(ND_COMMA, node, expr, tok);
 }
 
+// alloca() moves the temporary area at the bottom of the stack frame,
+// so a function that calls it keeps track of where the area begins.
+static void use_alloca(void) {
+  if (!current_fn->alloca_bottom) {
+    current_fn->alloca_bottom = new_lvar("__alloca_size__", pointer_to(ty_char));
+    current_fn->alloca_bottom->block = NULL;
+  }
+}
+
 static Node *new_alloca(Node *sz) {
+  use_alloca();
   Node *node = new_unary(ND_FUNCALL, new_var_node(builtin_alloca, sz->tok), sz->tok);
   node->func_ty = builtin_alloca->ty;
   node->ty = builtin_alloca->ty->return_ty;
@@ -1328,6 +1368,57 @@ static Node *init_desg_expr(InitDesg *desg, Token *tok) {
   return new_unary(ND_DEREF, new_add(lhs, rhs, tok), tok);
 }
 
+// Returns the storage unit of the bitfield designated by `desg`.
+static Node *bitfield_unit(InitDesg *desg, Type *ty, Token *tok) {
+  Node *addr = new_unary(ND_ADDR, init_desg_expr(desg, tok), tok);
+  return new_unary(ND_DEREF, new_cast(addr, pointer_to(ty)), tok);
+}
+
+// Adjacent bitfields in the same storage unit are initialized by a
+// single read-modify-write of the unit. The unit is zero-cleared
+// beforehand, so the new values are or'ed into it, and constant ones
+// are combined at compile time. `*rest` is set to the last member.
+static Node *bitfield_init(Initializer *init, Member **rest, InitDesg *desg, Token *tok) {
+  Member *first = *rest;
+  int sz = first->ty->size;
+  Type *ty = (sz == 8) ? ty_ulong : (sz == 4) ? ty_uint : (sz == 2) ? ty_ushort : ty_uchar;
+  unsigned long bits = 0;
+  Node *val = NULL;
+
+  for (Member *mem = first; mem && mem->is_bitfield; mem = mem->next) {
+    if (mem->offset != first->offset || mem->ty->size != sz)
+      break;
+    *rest = mem;
+
+    Node *expr = init->children[mem->idx]->expr;
+    if (!expr)
+      continue;
+    expr = new_cast(expr, mem->ty);
+
+    unsigned long mask = (mem->bit_width == 64) ? -1 : (1UL << mem->bit_width) - 1;
+    if (is_const_expr(expr)) {
+      bits |= (eval(expr) & mask) << mem->bit_offset;
+      continue;
+    }
+
+    Node *node = new_binary(ND_BITAND, new_cast(expr, ty), new_ulong(mask, tok), tok);
+    node = new_binary(ND_SHL, node, new_num(mem->bit_offset, tok), tok);
+    val = val ? new_binary(ND_BITOR, val, node, tok) : node;
+  }
+
+  if (!val && !bits)
+    return new_node(ND_NULL_EXPR, tok);
+  if (!val)
+    val = new_ulong(bits, tok);
+  else if (bits)
+    val = new_binary(ND_BITOR, val, new_ulong(bits, tok), tok);
+
+  InitDesg desg2 = {desg, 0, first};
+  Node *lhs = bitfield_unit(&desg2, ty, tok);
+  Node *old = bitfield_unit(&desg2, ty, tok);
+  return new_binary(ND_ASSIGN, lhs, new_binary(ND_BITOR, old, val, tok), tok);
+}
+
 static Node *create_lvar_init(Initializer *init, Type *ty, InitDesg *desg, Token *tok) {
   if (ty->kind == TY_ARRAY) {
     Node *node = new_node(ND_NULL_EXPR, tok);
@@ -1343,6 +1434,11 @@ static Node *create_lvar_init(Initializer *init, Type *ty, InitDesg *desg, Token
     Node *node = new_node(ND_NULL_EXPR, tok);
 
     for (Member *mem = ty->members; mem; mem = mem->next) {
+      if (mem->is_bitfield) {
+        node = new_binary(ND_COMMA, node, bitfield_init(init, &mem, desg, tok), tok);
+        continue;
+      }
+
       InitDesg desg2 = {desg, 0, mem};
       Node *rhs = create_lvar_init(init->children[mem->idx], mem->ty, &desg2, tok);
       node = new_binary(ND_COMMA, node, rhs, tok);
@@ -1363,6 +1459,47 @@ static Node *create_lvar_init(Initializer *init, Type *ty, InitDesg *desg, Token
   return new_binary(ND_ASSIGN, lhs, init->expr, tok);
 }
 
+// Mark the bytes of a local variable that are assigned by `init`.
+// Bitfields are assigned by read-modify-write, so their bytes are not
+// marked. Neither are the padding bytes of a long double.
+static void mark_init(Initializer *init, Type *ty, int offset, bool *mask) {
+  if (ty->kind == TY_ARRAY) {
+    for (int i = 0; i < ty->array_len; i++)
+      mark_init(init->children[i], ty->base, offset + ty->base->size * i, mask);
+    return;
+  }
+
+  if (ty->kind == TY_STRUCT && !init->expr) {
+    for (Member *mem = ty->members; mem; mem = mem->next)
+      if (!mem->is_bitfield)
+        mark_init(init->children[mem->idx], mem->ty, offset + mem->offset, mask);
+    return;
+  }
+
+  if (ty->kind == TY_UNION) {
+    Member *mem = init->mem ? init->mem : ty->members;
+    if (!mem->is_bitfield)
+      mark_init(init->children[mem->idx], mem->ty, offset + mem->offset, mask);
+    return;
+  }
+
+  if (init->expr)
+    memset(mask + offset, 1, (ty->kind == TY_LDOUBLE) ? 10 : ty->size);
+}
+
+static Node *new_memzero(Obj *var, int offset, int size, Token *tok) {
+  Node *node = new_node(ND_MEMZERO, tok);
+  node->var = var;
+  node->zero_offset = offset;
+  node->zero_size = size;
+  return node;
+}
+
+// If a variable has more than this many runs of bytes that are not
+// assigned by its initializer, a single range from the first to the
+// last one is zero-cleared instead.
+#define MAX_MEMZERO 4
+
 // A variable definition with an initializer is a shorthand notation
 // for a variable definition followed by assignments. This function
 // generates assignment expressions for an initializer. For example,
@@ -1376,16 +1513,48 @@ static Node *create_lvar_init(Initializer *init, Type *ty, InitDesg *desg, Token
 static Node *lvar_initializer(Token **rest, Token *tok, Obj *var) {
   Initializer *init = initializer(rest, tok, var->ty, &var->ty);
   InitDesg desg = {NULL, 0, NULL, var};
+  Node *node = create_lvar_init(init, var->ty, &desg, tok);
 
   // If a partial initializer list is given, the standard requires
-  // that unspecified elements are set to 0. Here, we simply
-  // zero-initialize the entire memory region of a variable before
-  // initializing it with user-supplied values.
-  Node *lhs = new_node(ND_MEMZERO, tok);
-  lhs->var = var;
+  // that unspecified elements are set to 0. Here, we zero-initialize
+  // the bytes of a variable that are not assigned user-supplied
+  // values before initializing it.
+  int size = var->ty->size;
+  bool *mask = calloc(size, 1);
+  mark_init(init, var->ty, 0, mask);
+
+  int begin[MAX_MEMZERO + 1];
+  int end[MAX_MEMZERO + 1];
+  int n = 0;
+
+  for (int i = 0; i < size;) {
+    if (mask[i]) {
+      i++;
+      continue;
+    }
+
+    int j = i;
+    while (j < size && !mask[j])
+      j++;
 
-  Node *rhs = create_lvar_init(init, var->ty, &desg, tok);
-  return new_binary(ND_COMMA, lhs, rhs, tok);
+    if (n == MAX_MEMZERO + 1) {
+      end[MAX_MEMZERO] = j;
+    } else {
+      begin[n] = i;
+      end[n++] = j;
+    }
+    i = j;
+  }
+
+  if (n == MAX_MEMZERO + 1) {
+    end[0] = end[MAX_MEMZERO];
+    n = 1;
+  }
+
+  for (int i = n - 1; i >= 0; i--)
+    node = new_binary(ND_COMMA, new_memzero(var, begin[i], end[i] - begin[i], tok), node, tok);
+  free(mask);
+  return node;
 }
 
 static uint64_t read_buf(char *buf, int sz) {
@@ -1431,7 +1600,7 @@ write_gvar_data(Relocation *cur, Initializer *init, Type *ty, char *buf, int off
 
         char *loc = buf + offset + mem->offset;
         uint64_t oldval = read_buf(loc, mem->ty->size);
-        uint64_t newval = eval(expr);
+        uint64_t newval = eval(new_cast(expr, mem->ty));
         uint64_t mask = (1L << mem->bit_width) - 1;
         uint64_t combined = oldval | ((newval & mask) << mem->bit_offset);
         write_buf(loc, combined, mem->ty->size);
@@ -1495,7 +1664,7 @@ static void gvar_initializer(Token **rest, Token *tok, Obj *var) {
 
 // Returns true if a given token represents a type.
 static bool is_typename(Token *tok) {
-  static HashMap map;
+  static _Thread_local HashMap map;
 
   if (map.capacity == 0) {
     static char *kw[] = {
@@ -1503,7 +1672,7 @@ static bool is_typename(Token *tok) {
       "typedef", "enum", "static", "extern", "_Alignas", "signed", "unsigned",
       "const", "volatile", "auto", "register", "restrict", "__restrict",
       "__restrict__", "_Noreturn", "float", "double", "typeof", "inline",
-      "_Thread_local", "__thread", "_Atomic",
+      "_Thread_local", "__thread", "_Atomic", "__attribute__",
     };
 
     for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++)
@@ -1529,6 +1698,69 @@ static Node *asm_stmt(Token **rest, Token *tok) {
   return node;
 }
 
+static int compare_cases(const void *x, const void *y) {
+  long a = (*(Node **)x)->begin;
+  long b = (*(Node **)y)->begin;
+  return (a < b) ? -1 : (a > b);
+}
+
+static int compare_cases_unsigned(const void *x, const void *y) {
+  unsigned long a = (*(Node **)x)->begin;
+  unsigned long b = (*(Node **)y)->begin;
+  return (a < b) ? -1 : (a > b);
+}
+
+// Sort the cases of a switch statement by value, so that the code
+// generator can search them with a binary search or a jump table.
+// Case values are converted to the promoted type of the controlling
+// expression.
+static void sort_cases(Node *node) {
+  add_type(node->cond);
+  Type *ty = node->cond->ty;
+  bool is_unsigned = ty->is_unsigned && ty->size >= 4;
+
+  int n = 0;
+  for (Node *c = node->case_next; c; c = c->case_next)
+    n++;
+  if (n == 0)
+    return;
+
+  // Case values are converted to the promoted type of the controlling
+  // expression.
+  Node **cases = calloc(n, sizeof(Node *));
+  int i = 0;
+  for (Node *c = node->case_next; c; c = c->case_next) {
+    if (is_unsigned && ty->size == 4) {
+      c->begin = (uint32_t)c->begin;
+      c->end = (uint32_t)c->end;
+    } else if (ty->size < 8) {
+      c->begin = (int32_t)c->begin;
+      c->end = (int32_t)c->end;
+    }
+    bool empty = is_unsigned
+      ? (unsigned long)c->end < (unsigned long)c->begin
+      : c->end < c->begin;
+    if (empty)
+      error_tok(c->tok, "empty case range specified");
+    cases[i++] = c;
+  }
+
+  qsort(cases, n, sizeof(Node *), is_unsigned ? compare_cases_unsigned : compare_cases);
+
+  for (i = 1; i < n; i++) {
+    bool overlap = is_unsigned
+      ? (unsigned long)cases[i - 1]->end >= (unsigned long)cases[i]->begin
+      : cases[i - 1]->end >= cases[i]->begin;
+    if (overlap)
+      error_tok(cases[i]->tok, "duplicate case value");
+  }
+
+  for (i = 0; i < n - 1; i++)
+    cases[i]->case_next = cases[i + 1];
+  cases[n - 1]->case_next = NULL;
+  node->case_next = cases[0];
+}
+
 // stmt = "return" expr? ";"
 //      | "if" "(" expr ")" stmt ("else" stmt)?
 //      | "switch" "(" expr ")" stmt
@@ -1587,6 +1819,7 @@ static Node *stmt(Token **rest, Token *tok) {
     brk_label = node->brk_label = new_unique_name();
 
     node->then = stmt(rest, tok);
+    sort_cases(node);
 
     current_switch = sw;
     brk_label = brk;
@@ -1598,17 +1831,15 @@ static Node *stmt(Token **rest, Token *tok) {
       error_tok(tok, "stray case");
 
     Node *node = new_node(ND_CASE, tok);
-    int begin = const_expr(&tok, tok->next);
-    int end;
+    long begin = const_expr(&tok, tok->next);
+    long end;
 
-    if (equal(tok, "...")) {
-      // [GNU] Case ranges, e.g. "case 1 ... 5:"
+    // [GNU] Case ranges, e.g. "case 1 ... 5:". Empty ranges are
+    // reported by sort_cases(), which knows the type of the values.
+    if (equal(tok, "..."))
       end = const_expr(&tok, tok->next);
-      if (end < begin)
-        error_tok(tok, "empty case range specified");
-    } else {
+    else
       end = begin;
-    }
 
     tok = skip(tok, ":");
     node->label = new_unique_name();
@@ -1637,6 +1868,7 @@ static Node *stmt(Token **rest, Token *tok) {
     tok = skip(tok->next, "(");
 
     enter_scope();
+    enter_block();
 
     char *brk = brk_label;
     char *cont = cont_label;
@@ -1660,6 +1892,7 @@ static Node *stmt(Token **rest, Token *tok) {
 
     node->then = stmt(rest, tok);
 
+    leave_block();
     leave_scope();
     brk_label = brk;
     cont_label = cont;
@@ -1766,6 +1999,7 @@ static Node *compound_stmt(Token **rest, Token *tok) {
   Node *cur = &head;
 
   enter_scope();
+  enter_block();
 
   while (!equal(tok, "}")) {
     if (is_typename(tok) && !equal(tok->next, ":")) {
@@ -1794,6 +2028,7 @@ static Node *compound_stmt(Token **rest, Token *tok) {
     add_type(cur);
   }
 
+  leave_block();
   leave_scope();
 
   node->body = head.next;
@@ -1895,7 +2130,13 @@ static int64_t eval2(Node *node, char ***label) {
   case ND_LOGOR:
     return eval(node->lhs) || eval(node->rhs);
   case ND_CAST: {
+    // Conversion to _Bool yields 1 for any nonzero value.
+    if (node->ty->kind == TY_BOOL && is_flonum(node->lhs->ty))
+      return eval_double(node->lhs) != 0;
+
     int64_t val = eval2(node->lhs, label);
+    if (node->ty->kind == TY_BOOL && !(label && *label))
+      return val != 0;
     if (is_integer(node->ty)) {
       switch (node->ty->size) {
       case 1: return node->ty->is_unsigned ? (uint8_t)val : (int8_t)val;
@@ -2024,6 +2265,79 @@ static double eval_double(Node *node) {
   error_tok(node->tok, "not a compile-time constant");
 }
 
+static Node *new_fetch_op(NodeKind op, Node *addr, Node *val, bool fetch_new, Token *tok) {
+  Node *node = new_binary(ND_FETCH_OP, addr, val, tok);
+  node->fetch_op = op;
+  node->fetch_new = fetch_new;
+  return node;
+}
+
+// Returns true if `node` is an atomic integer that can be updated by
+// a single locked instruction.
+static bool is_atomic_int(Node *node) {
+  add_type(node);
+  if (!node->ty->is_atomic || !is_integer(node->ty) || node->ty->kind == TY_BOOL)
+    return false;
+  return node->kind != ND_MEMBER || !node->member->is_bitfield;
+}
+
+// Returns true if `node` is an _Atomic integer or pointer, which is
+// stored to with sequential consistency.
+static bool is_atomic_scalar(Node *node) {
+  add_type(node);
+  if (!node->ty->is_atomic || (!is_integer(node->ty) && node->ty->kind != TY_PTR))
+    return false;
+  return node->kind != ND_MEMBER || !node->member->is_bitfield;
+}
+
+// Returns true unless `order` is a constant memory order weaker than
+// __ATOMIC_SEQ_CST.
+// Memory orders, as numbered by the __ATOMIC_* macros, that are not
+// valid for an atomic load or store.
+#define INVALID_LOAD_ORDERS ((1 << 3) | (1 << 4))
+#define INVALID_STORE_ORDERS ((1 << 1) | (1 << 2) | (1 << 4))
+
+// Returns true if `order` may be sequentially consistent. An order
+// that is invalid for the operation at `tok` is treated as such, as
+// GCC does.
+static bool is_seq_cst(Node *order, int invalid, Token *tok) {
+  if (!is_const_expr(order))
+    return true;
+  int64_t val = eval(order);
+  if (0 <= val && val < 5 && (invalid & (1 << val))) {
+    warn_tok(tok, "invalid memory model");
+    return true;
+  }
+  return val < 0 || val >= 5;
+}
+
+// A memory order other than a number is evaluated before `node` for
+// its side effects.
+static Node *with_order(Node *order, Node *node, Token *tok) {
+  add_type(order);
+  if (order->kind == ND_NUM)
+    return node;
+  return new_binary(ND_COMMA, new_cast(order, ty_void), node, tok);
+}
+
+// Store `val` to `*addr`. On x86-64, every store has release
+// semantics, so only a sequentially consistent one needs the barrier
+// of an xchg, or of an mfence for a value not fitting in a register.
+static Node *new_atomic_store(Node *addr, Node *val, bool seq_cst, Token *tok) {
+  add_type(addr);
+  if (addr->ty->kind != TY_PTR)
+    error_tok(addr->tok, "pointer expected");
+
+  Type *ty = addr->ty->base;
+  if (seq_cst && (is_integer(ty) || ty->kind == TY_PTR))
+    return new_binary(ND_EXCH, addr, new_cast(val, ty), tok);
+
+  Node *node = new_binary(ND_ASSIGN, new_unary(ND_DEREF, addr, tok), val, tok);
+  if (seq_cst)
+    node = new_binary(ND_COMMA, node, new_node(ND_FENCE, tok), tok);
+  return node;
+}
+
 // Convert op= operators to expressions containing an assignment.
 //
 // In general, `A op= C` is converted to ``tmp = &A, *tmp = *tmp op B`.
@@ -2035,6 +2349,19 @@ static Node *to_assign(Node *binary) {
   add_type(binary->rhs);
   Token *tok = binary->tok;
 
+  // If A is an atomic integer, `A op= B` is an atomic fetch-and-op
+  // returning the new value.
+  switch (binary->kind) {
+  case ND_ADD:
+  case ND_SUB:
+  case ND_BITAND:
+  case ND_BITOR:
+  case ND_BITXOR:
+    if (is_atomic_int(binary->lhs) && is_integer(binary->rhs->ty))
+      return new_fetch_op(binary->kind, new_unary(ND_ADDR, binary->lhs, tok),
+                          binary->rhs, true, tok);
+  }
+
   // Convert `A.x op= C` to `tmp = &A, (*tmp).x = (*tmp).x op C`.
   if (binary->lhs->kind == ND_MEMBER) {
     Obj *var = new_lvar("", pointer_to(binary->lhs->lhs->ty));
@@ -2121,6 +2448,11 @@ static Node *to_assign(Node *binary) {
     return node;
   }
 
+  // Convert `A op= B` to `A = A op B` if A is a variable, so that
+  // its address is not taken.
+  if (binary->lhs->kind == ND_VAR)
+    return new_binary(ND_ASSIGN, new_var_node(binary->lhs->var, tok), binary, tok);
+
   // Convert `A op= B` to ``tmp = &A, *tmp = *tmp op B`.
   Obj *var = new_lvar("", pointer_to(binary->lhs->ty));
 
@@ -2145,8 +2477,17 @@ static Node *to_assign(Node *binary) {
 static Node *assign(Token **rest, Token *tok) {
   Node *node = conditional(&tok, tok);
 
-  if (equal(tok, "="))
-    return new_binary(ND_ASSIGN, node, assign(rest, tok->next), tok);
+  if (equal(tok, "=")) {
+    Node *rhs = assign(rest, tok->next);
+    if (!is_atomic_scalar(node))
+      return new_binary(ND_ASSIGN, node, rhs, tok);
+
+    // Convert `A = B` to `tmp = B, xchg(&A, tmp), tmp` if A is atomic.
+    Obj *var = new_lvar("", node->ty);
+    Node *expr1 = new_binary(ND_ASSIGN, new_var_node(var, tok), rhs, tok);
+    Node *expr2 = new_atomic_store(new_unary(ND_ADDR, node, tok), new_var_node(var, tok), true, tok);
+    return new_binary(ND_COMMA, expr1, new_binary(ND_COMMA, expr2, new_var_node(var, tok), tok), tok);
+  }
 
   if (equal(tok, "+="))
     return to_assign(new_add(node, assign(rest, tok->next), tok));
@@ -2629,6 +2970,39 @@ static Token *attribute_list(Token *tok, Type *ty) {
   return tok;
 }
 
+// func-attribute = ("__attribute__" "(" "(" ("always_inline" | "noinline") ")" ")")*
+static Token *func_attribute_list(Token *tok, VarAttr *attr) {
+  while (consume(&tok, tok, "__attribute__")) {
+    tok = skip(tok, "(");
+    tok = skip(tok, "(");
+
+    bool first = true;
+
+    while (!consume(&tok, tok, ")")) {
+      if (!first)
+        tok = skip(tok, ",");
+      first = false;
+
+      if (consume(&tok, tok, "always_inline") ||
+          consume(&tok, tok, "__always_inline__")) {
+        attr->is_always_inline = true;
+        continue;
+      }
+
+      if (consume(&tok, tok, "noinline") || consume(&tok, tok, "__noinline__")) {
+        attr->is_noinline = true;
+        continue;
+      }
+
+      error_tok(tok, "unknown attribute");
+    }
+
+    tok = skip(tok, ")");
+  }
+
+  return tok;
+}
+
 // struct-union-decl = attribute? ident? ("{" struct-members)?
 static Type *struct_union_decl(Token **rest, Token *tok) {
   Type *ty = struct_type();
@@ -2789,6 +3163,8 @@ static Node *struct_ref(Node *node, Token *tok) {
 // Convert A++ to `(typeof A)((A += 1) - 1)`
 static Node *new_inc_dec(Node *node, Token *tok, int addend) {
   add_type(node);
+  if (is_atomic_int(node))
+    return new_fetch_op(ND_ADD, new_unary(ND_ADDR, node, tok), new_num(addend, tok), false, tok);
   return new_cast(new_add(to_assign(new_add(node, new_num(addend, tok), tok)),
                           new_num(-addend, tok), tok),
                   node->ty);
@@ -2871,6 +3247,185 @@ static Node *postfix(Token **rest, Token *tok) {
   }
 }
 
+// memcpy and memset of at most this many bytes and memcmp of at most
+// MAX_BUILTIN_CMP bytes are expanded inline.
+#define MAX_BUILTIN_COPY 128
+#define MAX_BUILTIN_CMP 16
+
+// Returns true if a constant expression has a side effect, which can
+// only be in the lhs of a comma operator.
+static bool has_side_effect(Node *node) {
+  if (!node)
+    return false;
+  if (node->kind == ND_COMMA)
+    return true;
+  return has_side_effect(node->lhs) || has_side_effect(node->rhs) ||
+         has_side_effect(node->cond) || has_side_effect(node->then) ||
+         has_side_effect(node->els);
+}
+
+// Returns an unsigned integer of `sz` bytes at `ptr + offset`.
+static Node *mem_ref(Obj *ptr, int offset, int sz, Token *tok) {
+  Type *ty = (sz == 8) ? ty_ulong : (sz == 4) ? ty_uint : (sz == 2) ? ty_ushort : ty_uchar;
+  Node *addr = new_add(new_var_node(ptr, tok), new_long(offset, tok), tok);
+  return new_unary(ND_DEREF, new_cast(addr, pointer_to(ty)), tok);
+}
+
+// Returns the widest access of at most `sz` bytes.
+static int mem_word(int sz) {
+  return (sz >= 8) ? 8 : (sz >= 4) ? 4 : (sz >= 2) ? 2 : 1;
+}
+
+// Returns a new local variable that is assigned `expr` by `*init`.
+static Obj *new_temp(Node *expr, Type *ty, Node **init, Token *tok) {
+  Obj *var = new_lvar("", ty);
+  *init = new_binary(ND_ASSIGN, new_var_node(var, tok), new_cast(expr, ty), tok);
+  return var;
+}
+
+// memcpy(dst, src, n) is expanded to
+//
+//   (d = dst, s = src, *(T *)d = *(T *)s, ..., (void *)d)
+//
+// where T is the widest type that fits in the remaining bytes.
+static Node *expand_memcpy(Node *node, Node *dst, Node *src, int n) {
+  Token *tok = node->tok;
+  Node *init1, *init2;
+  Obj *d = new_temp(dst, pointer_to(ty_char), &init1, tok);
+  Obj *s = new_temp(src, pointer_to(ty_char), &init2, tok);
+  Node *expr = new_binary(ND_COMMA, init1, init2, tok);
+
+  for (int i = 0, sz; i < n; i += sz) {
+    sz = mem_word(n - i);
+    Node *copy = new_binary(ND_ASSIGN, mem_ref(d, i, sz, tok), mem_ref(s, i, sz, tok), tok);
+    expr = new_binary(ND_COMMA, expr, copy, tok);
+  }
+  return new_binary(ND_COMMA, expr, new_cast(new_var_node(d, tok), node->ty), tok);
+}
+
+// memset(dst, c, n) stores `c` repeated in each byte of a word.
+static Node *expand_memset(Node *node, Node *dst, Node *c, int n) {
+  Token *tok = node->tok;
+  Node *init1, *init2;
+  Obj *d = new_temp(dst, pointer_to(ty_char), &init1, tok);
+  Node *expr = init1;
+
+  Node *byte = new_cast(c, ty_uchar);
+  Node *val = new_binary(ND_MUL, new_cast(byte, ty_ulong), new_ulong(0x0101010101010101, tok), tok);
+
+  if (is_const_expr(val)) {
+    if (has_side_effect(c))
+      expr = new_binary(ND_COMMA, new_cast(c, ty_void), expr, tok);
+    val = new_ulong(eval(val), tok);
+  } else {
+    Obj *v = new_temp(val, ty_ulong, &init2, tok);
+    expr = new_binary(ND_COMMA, expr, init2, tok);
+    val = new_var_node(v, tok);
+  }
+
+  for (int i = 0, sz; i < n; i += sz) {
+    sz = mem_word(n - i);
+    Node *store = new_binary(ND_ASSIGN, mem_ref(d, i, sz, tok), val, tok);
+    expr = new_binary(ND_COMMA, expr, store, tok);
+  }
+  return new_binary(ND_COMMA, expr, new_cast(new_var_node(d, tok), node->ty), tok);
+}
+
+// memcmp(p, q, n) compares a word at a time. Only the first word that
+// differs is compared byte by byte:
+//
+//   *(T *)p != *(T *)q ? (p[0] != q[0] ? p[0] - q[0] : ...) : ...
+static Node *expand_memcmp(Node *node, Node *lhs, Node *rhs, int n) {
+  Token *tok = node->tok;
+  Node *init1, *init2;
+  Obj *p = new_temp(lhs, pointer_to(ty_char), &init1, tok);
+  Obj *q = new_temp(rhs, pointer_to(ty_char), &init2, tok);
+
+  int sizes[MAX_BUILTIN_CMP];
+  int nwords = 0;
+  for (int i = 0; i < n; i += sizes[nwords++])
+    sizes[nwords] = mem_word(n - i);
+
+  Node *expr = new_num(0, tok);
+  for (int w = nwords - 1, i = n; w >= 0; w--) {
+    i -= sizes[w];
+
+    Node *diff = new_num(0, tok);
+    for (int j = i + sizes[w] - 1; j >= i; j--) {
+      Node *cond = new_binary(ND_NE, mem_ref(p, j, 1, tok), mem_ref(q, j, 1, tok), tok);
+      Node *sub = new_binary(ND_SUB, mem_ref(p, j, 1, tok), mem_ref(q, j, 1, tok), tok);
+      Node *sel = new_node(ND_COND, tok);
+      sel->cond = cond;
+      sel->then = sub;
+      sel->els = diff;
+      diff = sel;
+    }
+
+    Node *sel = new_node(ND_COND, tok);
+    sel->cond = new_binary(ND_NE, mem_ref(p, i, sizes[w], tok), mem_ref(q, i, sizes[w], tok), tok);
+    sel->then = diff;
+    sel->els = expr;
+    expr = sel;
+  }
+
+  expr = new_binary(ND_COMMA, init2, new_cast(expr, node->ty), tok);
+  return new_binary(ND_COMMA, init1, expr, tok);
+}
+
+// Returns the length of a string literal, or -1.
+static long literal_strlen(Node *node) {
+  while (node->kind == ND_CAST)
+    node = node->lhs;
+  if (node->kind != ND_VAR || node->var->is_local || !node->var->init_data ||
+      strncmp(node->var->name, ".L..", 4))
+    return -1;
+  return strnlen(node->var->init_data, node->var->ty->size);
+}
+
+// Calls to memcpy, memset, memcmp and strlen, or to their __builtin_
+// variants, are expanded inline if the size is a small constant or
+// the string is a literal. Other calls are left alone.
+static Node *expand_builtin(Node *node) {
+  Node *fn = node->lhs;
+  if (fn->kind != ND_VAR || fn->var->is_local || fn->var->is_definition)
+    return node;
+  if (!current_fn || current_fn->body)
+    return node;
+
+  char *name = fn->var->name;
+  Node *a1 = node->args;
+  Node *a2 = a1 ? a1->next : NULL;
+  Node *a3 = a2 ? a2->next : NULL;
+
+  if (!strcmp(name, "strlen") && a1 && !a2) {
+    long len = literal_strlen(a1);
+    return (len < 0) ? node : new_cast(new_ulong(len, node->tok), node->ty);
+  }
+
+  if (!a3 || a3->next || !is_const_expr(a3))
+    return node;
+
+  long n = eval(a3);
+  if (n < 0)
+    return node;
+
+  Node *expr;
+  if (!strcmp(name, "memcpy") && n <= MAX_BUILTIN_COPY)
+    expr = expand_memcpy(node, a1, a2, n);
+  else if (!strcmp(name, "memset") && n <= MAX_BUILTIN_COPY)
+    expr = expand_memset(node, a1, a2, n);
+  else if (!strcmp(name, "memcmp") && n <= MAX_BUILTIN_CMP)
+    expr = expand_memcmp(node, a1, a2, n);
+  else
+    return node;
+
+  // Arguments are evaluated from right to left, so a size with a side
+  // effect goes first.
+  if (has_side_effect(a3))
+    expr = new_binary(ND_COMMA, new_cast(a3, ty_void), expr, node->tok);
+  return expr;
+}
+
 // funcall = (assign ("," assign)*)? ")"
 static Node *funcall(Token **rest, Token *tok, Node *fn) {
   add_type(fn);
@@ -2918,11 +3473,14 @@ static Node *funcall(Token **rest, Token *tok, Node *fn) {
   node->ty = ty->return_ty;
   node->args = head.next;
 
+  if (fn->kind == ND_VAR && !strcmp(fn->var->name, "alloca"))
+    use_alloca();
+
   // If a function returns a struct, it is caller's responsibility
   // to allocate a space for the return value.
   if (node->ty->kind == TY_STRUCT || node->ty->kind == TY_UNION)
     node->ret_buffer = new_lvar("", node->ty);
-  return node;
+  return expand_builtin(node);
 }
 
 // generic-selection = "(" assign "," generic-assoc ("," generic-assoc)* ")"
@@ -2968,6 +3526,24 @@ static Node *generic_selection(Token **rest, Token *tok) {
   return ret;
 }
 
+// Atomic fetch-and-op builtins
+static struct {
+  char *name;
+  NodeKind op;
+  bool fetch_new;
+} fetch_ops[] = {
+  {"__atomic_fetch_add", ND_ADD, false},
+  {"__atomic_fetch_sub", ND_SUB, false},
+  {"__atomic_fetch_and", ND_BITAND, false},
+  {"__atomic_fetch_or", ND_BITOR, false},
+  {"__atomic_fetch_xor", ND_BITXOR, false},
+  {"__atomic_add_fetch", ND_ADD, true},
+  {"__atomic_sub_fetch", ND_SUB, true},
+  {"__atomic_and_fetch", ND_BITAND, true},
+  {"__atomic_or_fetch", ND_BITOR, true},
+  {"__atomic_xor_fetch", ND_BITXOR, true},
+};
+
 // primary = "(" "{" stmt+ "}" ")"
 //         | "(" expr ")"
 //         | "sizeof" "(" type-name ")"
@@ -2977,6 +3553,7 @@ static Node *generic_selection(Token **rest, Token *tok) {
 //         | "_Generic" generic-selection
 //         | "__builtin_types_compatible_p" "(" type-name, type-name, ")"
 //         | "__builtin_reg_class" "(" type-name ")"
+//         | fetch-op "(" assign "," assign "," assign ")"
 //         | ident
 //         | str
 //         | num
@@ -3069,6 +3646,79 @@ static Node *primary(Token **rest, Token *tok) {
     return node;
   }
 
+  // The memory order of a fetch-and-op doesn't change the code
+  // because a locked instruction is a full barrier on x86-64.
+  for (int i = 0; i < sizeof(fetch_ops) / sizeof(*fetch_ops); i++) {
+    if (equal(tok, fetch_ops[i].name)) {
+      tok = skip(tok->next, "(");
+      Node *addr = assign(&tok, tok);
+      tok = skip(tok, ",");
+      Node *val = assign(&tok, tok);
+      tok = skip(tok, ",");
+      Node *order = assign(&tok, tok);
+      *rest = skip(tok, ")");
+      Node *node = new_fetch_op(fetch_ops[i].op, addr, val, fetch_ops[i].fetch_new, start);
+      return with_order(order, node, start);
+    }
+  }
+
+  // On x86-64, every load has acquire semantics, so an atomic load is
+  // an ordinary one regardless of its memory order.
+  if (equal(tok, "__atomic_load_n")) {
+    tok = skip(tok->next, "(");
+    Node *addr = assign(&tok, tok);
+    tok = skip(tok, ",");
+    Node *order = assign(&tok, tok);
+    *rest = skip(tok, ")");
+    is_seq_cst(order, INVALID_LOAD_ORDERS, start);
+
+    add_type(addr);
+    if (addr->ty->kind != TY_PTR)
+      error_tok(addr->tok, "pointer expected");
+
+    Node *node = new_unary(ND_DEREF, addr, start);
+    if (is_numeric(addr->ty->base) || addr->ty->base->kind == TY_PTR)
+      node = new_cast(node, addr->ty->base);
+    return with_order(order, node, start);
+  }
+
+  if (equal(tok, "__atomic_store_n")) {
+    tok = skip(tok->next, "(");
+    Node *addr = assign(&tok, tok);
+    tok = skip(tok, ",");
+    Node *val = assign(&tok, tok);
+    tok = skip(tok, ",");
+    Node *order = assign(&tok, tok);
+    *rest = skip(tok, ")");
+    Node *node = new_atomic_store(addr, val, is_seq_cst(order, INVALID_STORE_ORDERS, start), start);
+    return with_order(order, new_cast(node, ty_void), start);
+  }
+
+  if (equal(tok, "__atomic_exchange_n")) {
+    tok = skip(tok->next, "(");
+    Node *node = new_node(ND_EXCH, start);
+    node->lhs = assign(&tok, tok);
+    tok = skip(tok, ",");
+    node->rhs = assign(&tok, tok);
+    tok = skip(tok, ",");
+    Node *order = assign(&tok, tok);
+    *rest = skip(tok, ")");
+    return with_order(order, node, start);
+  }
+
+  // Only a sequentially consistent fence needs an instruction. The
+  // others just keep the compiler from moving memory accesses across
+  // them, which it never does.
+  if (equal(tok, "__atomic_thread_fence") || equal(tok, "__atomic_signal_fence")) {
+    bool is_thread = equal(tok, "__atomic_thread_fence");
+    tok = skip(tok->next, "(");
+    Node *order = assign(&tok, tok);
+    *rest = skip(tok, ")");
+    if (is_thread && is_seq_cst(order, 0, start))
+      return with_order(order, new_node(ND_FENCE, start), start);
+    return with_order(order, new_cast(new_node(ND_NULL_EXPR, start), ty_void), start);
+  }
+
   if (equal(tok, "__builtin_atomic_exchange")) {
     Node *node = new_node(ND_EXCH, tok);
     tok = skip(tok->next, "(");
@@ -3202,6 +3852,12 @@ static Token *function(Token *tok, Type *basety, VarAttr *attr) {
     error_tok(ty->name_pos, "function name omitted");
   char *name_str = get_ident(ty->name);
 
+  if (equal(tok, "__attribute__")) {
+    tok = func_attribute_list(tok, attr);
+    if (!equal(tok, ";"))
+      error_tok(tok, "attributes are not allowed on a function definition");
+  }
+
   Obj *fn = find_func(name_str);
   if (fn) {
     // Redeclaration
@@ -3221,11 +3877,16 @@ static Token *function(Token *tok, Type *basety, VarAttr *attr) {
   }
 
   fn->is_root = !(fn->is_static && fn->is_inline);
+  fn->is_always_inline = fn->is_always_inline || attr->is_always_inline;
+  fn->is_noinline = fn->is_noinline || attr->is_noinline;
+  if (fn->is_always_inline && fn->is_noinline)
+    error_tok(ty->name, "always_inline and noinline are incompatible");
 
   if (consume(&tok, tok, ";"))
     return tok;
 
   current_fn = fn;
+  current_block = NULL;
   locals = NULL;
   enter_scope();
   create_param_lvars(ty->params);
@@ -3240,7 +3901,6 @@ static Token *function(Token *tok, Type *basety, VarAttr *attr) {
 
   if (ty->is_variadic)
     fn->va_area = new_lvar("__va_area__", array_of(ty_char, 136));
-  fn->alloca_bottom = new_lvar("__alloca_size__", pointer_to(ty_char));
 
   tok = skip(tok, "{");
 
@@ -3326,15 +3986,40 @@ static void scan_globals(void) {
   globals = head.next;
 }
 
+// Declare a function `__builtin_<name>` that calls `<name>`.
+static void declare_builtin(char *name, Type *return_ty, Type *ty1, Type *ty2, Type *ty3) {
+  Type *ty = func_type(return_ty);
+  Type head = {};
+  Type *cur = &head;
+  if (ty1)
+    cur = cur->next = copy_type(ty1);
+  if (ty2)
+    cur = cur->next = copy_type(ty2);
+  if (ty3)
+    cur = cur->next = copy_type(ty3);
+  ty->params = head.next;
+
+  Obj *var = new_gvar(format("__builtin_%s", name), ty);
+  var->name = name;
+  var->is_definition = false;
+}
+
 static void declare_builtin_functions(void) {
   Type *ty = func_type(pointer_to(ty_void));
   ty->params = copy_type(ty_int);
   builtin_alloca = new_gvar("alloca", ty);
   builtin_alloca->is_definition = false;
+
+  Type *ptr = pointer_to(ty_void);
+  declare_builtin("memcpy", ptr, ptr, ptr, ty_ulong);
+  declare_builtin("memset", ptr, ptr, ty_int, ty_ulong);
+  declare_builtin("memcmp", ty_int, ptr, ptr, ty_ulong);
+  declare_builtin("strlen", ty_ulong, pointer_to(ty_char), NULL, NULL);
 }
 
 // program = (typedef | function-definition | global-variable)*
 Obj *parse(Token *tok) {
+  scope = calloc(1, sizeof(Scope));
   declare_builtin_functions();
   globals = NULL;
 
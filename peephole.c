@@ -0,0 +1,547 @@
+// This file implements a peephole optimizer that runs on the assembly
+// of a function body at -O1. The body is parsed into a buffer of
+// instructions, each with a mnemonic and operands, and a table of
+// rules is applied to it until none of them matches. Each rule looks
+// at a short window of instructions starting at a given position and
+// rewrites it in place. Labels and directives other than .loc end a
+// window, and inline assembly, which codegen puts between #APP and
+// #NO_APP, is left as is.
+//
+// The rules clean up patterns that the code generators produce
+// because they emit code for one node at a time:
+//
+//  - push-pop:        `push %rax; pop %rdi` becomes `mov %rax, %rdi`.
+//  - lea-load:        `lea -8(%rbp), %rax; mov (%rax), %rax` becomes
+//                     `mov -8(%rbp), %rax`.
+//  - mov-back:        `mov %rax, %rdi; mov %rdi, %rax` loses the
+//                     second move.
+//  - self-mov:        `mov %rax, %rax` is removed.
+//  - setcc-jcc:       a conditional jump on a boolean that was just
+//                     materialized by setcc jumps on the flags instead.
+//  - redundant-test:  `cmp $0` or `test` after an arithmetic
+//                     instruction that already set the zero flag for
+//                     the same value is removed.
+//  - jcc-over-jmp:    `jCC L1; jmp L2; L1:` becomes `jNCC L2; L1:`.
+//  - jmp-next:        a jump to the immediately following label is
+//                     removed.
+//  - dead-code:       instructions between an unconditional jump and
+//                     the next label are removed.
+//  - loc-run, loc-dup: a .loc that is immediately followed by another
+//                     one, or that repeats the line in effect, is
+//                     removed.
+//
+// The number of times each rule matched is counted and can be printed
+// with -peephole-stats.
+
+#include "chibicc.h"
+
+typedef enum {
+  I_INSN,
+  I_LABEL,
+  I_LOC,
+  I_OTHER,
+} InstKind;
+
+typedef struct {
+  InstKind kind;
+  char *text; // Original line, or NULL if the instruction was rewritten
+  char *op;
+  char *args[3];
+  int nargs;
+  bool deleted;
+} Inst;
+
+static _Thread_local Inst *insts;
+static _Thread_local int ninsts;
+
+//
+// Instruction buffer
+//
+
+static char *skip_space(char *p) {
+  while (*p == ' ' || *p == '\t')
+    p++;
+  return p;
+}
+
+static void trim_end(char *p) {
+  char *q = p + strlen(p);
+  while (q > p && (q[-1] == ' ' || q[-1] == '\t'))
+    *--q = '\0';
+}
+
+// Split the operands of an instruction at commas that are not in
+// parentheses.
+static void split_args(Inst *in, char *p) {
+  p = skip_space(p);
+  if (!*p)
+    return;
+
+  int depth = 0;
+  in->args[in->nargs++] = p;
+  for (; *p; p++) {
+    if (*p == '(') {
+      depth++;
+    } else if (*p == ')') {
+      depth--;
+    } else if (*p == ',' && depth == 0) {
+      *p = '\0';
+      trim_end(in->args[in->nargs - 1]);
+      if (in->nargs == 3) {
+        in->kind = I_OTHER;
+        return;
+      }
+      in->args[in->nargs++] = skip_space(p + 1);
+    }
+  }
+  trim_end(in->args[in->nargs - 1]);
+}
+
+static void parse_insts(char *buf) {
+  int cap = 64;
+  insts = calloc(cap, sizeof(Inst));
+  ninsts = 0;
+  bool in_asm = false;
+
+  for (char *line = buf; *line;) {
+    char *end = strchr(line, '\n');
+    if (end)
+      *end = '\0';
+
+    if (ninsts == cap) {
+      cap *= 2;
+      insts = realloc(insts, sizeof(Inst) * cap);
+    }
+
+    Inst *in = &insts[ninsts++];
+    *in = (Inst){I_OTHER, line};
+
+    char *p = skip_space(line);
+    if (!strcmp(p, "#APP")) {
+      in_asm = true;
+    } else if (!strcmp(p, "#NO_APP")) {
+      in_asm = false;
+    } else if (in_asm || *p == '\0' || *p == '#') {
+      // Leave it as is.
+    } else if (p == line && line[strlen(line) - 1] == ':') {
+      in->kind = I_LABEL;
+      in->op = strndup(line, strlen(line) - 1);
+    } else if (!strncmp(p, ".loc ", 5)) {
+      in->kind = I_LOC;
+    } else if (*p != '.') {
+      char *q = p;
+      while (*q && *q != ' ' && *q != '\t')
+        q++;
+      in->kind = I_INSN;
+      in->op = strndup(p, q - p);
+      split_args(in, strdup(q));
+    }
+
+    if (!end)
+      break;
+    line = end + 1;
+  }
+}
+
+static void emit(FILE *out) {
+  for (int i = 0; i < ninsts; i++) {
+    Inst *in = &insts[i];
+    if (in->deleted)
+      continue;
+    if (in->text) {
+      fprintf(out, "%s\n", in->text);
+      continue;
+    }
+
+    fprintf(out, "  %s", in->op);
+    for (int j = 0; j < in->nargs; j++)
+      fprintf(out, "%s%s", j ? ", " : " ", in->args[j]);
+    fprintf(out, "\n");
+  }
+}
+
+// Returns the index of the next entry after `i` that is not deleted
+// and is not a .loc directive.
+static int next(int i) {
+  for (i++; i < ninsts; i++)
+    if (!insts[i].deleted && insts[i].kind != I_LOC)
+      return i;
+  return ninsts;
+}
+
+static bool is_insn(int i, char *op, int nargs) {
+  return i < ninsts && insts[i].kind == I_INSN && insts[i].nargs == nargs &&
+         (!op || !strcmp(insts[i].op, op));
+}
+
+static void rewrite(int i, char *op, char *a, char *b) {
+  Inst *in = &insts[i];
+  in->text = NULL;
+  in->op = op;
+  in->args[0] = a;
+  in->args[1] = b;
+  in->nargs = b ? 2 : a ? 1 : 0;
+}
+
+//
+// Operands
+//
+
+static char *regs[][4] = {
+  {"%al", "%ax", "%eax", "%rax"},     {"%cl", "%cx", "%ecx", "%rcx"},
+  {"%dl", "%dx", "%edx", "%rdx"},     {"%bl", "%bx", "%ebx", "%rbx"},
+  {"%sil", "%si", "%esi", "%rsi"},    {"%dil", "%di", "%edi", "%rdi"},
+  {"%r8b", "%r8w", "%r8d", "%r8"},    {"%r9b", "%r9w", "%r9d", "%r9"},
+  {"%r10b", "%r10w", "%r10d", "%r10"}, {"%r11b", "%r11w", "%r11d", "%r11"},
+  {"%r12b", "%r12w", "%r12d", "%r12"}, {"%r13b", "%r13w", "%r13d", "%r13"},
+  {"%r14b", "%r14w", "%r14d", "%r14"}, {"%r15b", "%r15w", "%r15d", "%r15"},
+};
+
+// If `s` names a general-purpose register other than %rsp and %rbp,
+// returns its size in bytes and sets `*num` to its number. Otherwise,
+// returns 0.
+static int reg_size(char *s, int *num) {
+  for (int i = 0; i < sizeof(regs) / sizeof(*regs); i++) {
+    for (int j = 0; j < 4; j++) {
+      if (!strcmp(s, regs[i][j])) {
+        *num = i;
+        return 1 << j;
+      }
+    }
+  }
+  return 0;
+}
+
+static bool is_reg64(char *s) {
+  int num;
+  return reg_size(s, &num) == 8;
+}
+
+// Returns true if `x` and `y` are the same register and the value of
+// `y` is the value of `x` zero-extended.
+static bool is_zext_of(char *x, char *y) {
+  int n1, n2;
+  int sz1 = reg_size(x, &n1);
+  int sz2 = reg_size(y, &n2);
+  return sz1 && n1 == n2 && (sz1 == sz2 || (sz1 == 4 && sz2 == 8));
+}
+
+static char *cond_pairs[][2] = {
+  {"e", "ne"}, {"z", "nz"}, {"l", "ge"}, {"le", "g"}, {"b", "ae"},
+  {"be", "a"}, {"s", "ns"}, {"p", "np"}, {"o", "no"}, {"c", "nc"},
+};
+
+// Returns the negation of a condition code, or NULL if `cc` is not a
+// condition code.
+static char *invert_cond(char *cc) {
+  for (int i = 0; i < sizeof(cond_pairs) / sizeof(*cond_pairs); i++) {
+    if (!strcmp(cc, cond_pairs[i][0]))
+      return cond_pairs[i][1];
+    if (!strcmp(cc, cond_pairs[i][1]))
+      return cond_pairs[i][0];
+  }
+  return NULL;
+}
+
+// Returns the condition code of a conditional jump, or NULL.
+static char *jcc_cond(int i) {
+  if (!is_insn(i, NULL, 1) || insts[i].op[0] != 'j' || !strcmp(insts[i].op, "jmp"))
+    return NULL;
+  char *cc = insts[i].op + 1;
+  return invert_cond(cc) ? cc : NULL;
+}
+
+// Returns true if instruction `i` only reads the zero flag.
+static bool uses_only_zf(int i) {
+  if (i >= ninsts || insts[i].kind != I_INSN)
+    return false;
+  char *op = insts[i].op;
+  return !strcmp(op, "je") || !strcmp(op, "jne") || !strcmp(op, "jz") ||
+         !strcmp(op, "jnz") || !strcmp(op, "sete") || !strcmp(op, "setne") ||
+         !strcmp(op, "setz") || !strcmp(op, "setnz");
+}
+
+// Returns true if instruction `i` is `cmp $0, x` or `test x, x`, and
+// sets `*x` to the operand.
+static bool is_zero_test(int i, char **x) {
+  if (is_insn(i, "cmp", 2) && !strcmp(insts[i].args[0], "$0")) {
+    *x = insts[i].args[1];
+    return true;
+  }
+  if (is_insn(i, "test", 2) && !strcmp(insts[i].args[0], insts[i].args[1])) {
+    *x = insts[i].args[0];
+    return true;
+  }
+  return false;
+}
+
+static bool is_movz(int i) {
+  return is_insn(i, NULL, 2) && !strncmp(insts[i].op, "movz", 4);
+}
+
+static bool is_label(int i, char *name) {
+  return i < ninsts && insts[i].kind == I_LABEL && !strcmp(insts[i].op, name);
+}
+
+//
+// Rules
+//
+
+static bool push_pop(int i) {
+  int j = next(i);
+  if (!is_insn(i, "push", 1) || !is_insn(j, "pop", 1) || !is_reg64(insts[i].args[0]))
+    return false;
+
+  if (!strcmp(insts[i].args[0], insts[j].args[0]))
+    insts[j].deleted = true;
+  else
+    rewrite(j, "mov", insts[i].args[0], insts[j].args[0]);
+  insts[i].deleted = true;
+  return true;
+}
+
+static bool lea_load(int i) {
+  static char *loads[] = {
+    "mov", "movsxd", "movslq", "movsbl", "movswl", "movzbl", "movzwl",
+    "movsbq", "movswq", "movzbq", "movzwq",
+  };
+
+  int j = next(i);
+  if (!is_insn(i, "lea", 2) || strcmp(insts[i].args[1], "%rax") ||
+      !is_insn(j, NULL, 2) || strcmp(insts[j].args[0], "(%rax)"))
+    return false;
+
+  // The address must be dead after the load.
+  char *dst = insts[j].args[1];
+  if (strcmp(dst, "%rax") && strcmp(dst, "%eax"))
+    return false;
+
+  for (int k = 0; k < sizeof(loads) / sizeof(*loads); k++) {
+    if (!strcmp(insts[j].op, loads[k])) {
+      rewrite(j, insts[j].op, insts[i].args[0], dst);
+      insts[i].deleted = true;
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool mov_back(int i) {
+  int j = next(i);
+  if (!is_insn(i, "mov", 2) || !is_insn(j, "mov", 2))
+    return false;
+
+  Inst *x = &insts[i];
+  Inst *y = &insts[j];
+  if (is_reg64(x->args[0]) && is_reg64(x->args[1]) &&
+      !strcmp(x->args[0], y->args[1]) && !strcmp(x->args[1], y->args[0])) {
+    y->deleted = true;
+    return true;
+  }
+  return false;
+}
+
+static bool self_mov(int i) {
+  if (is_insn(i, "mov", 2) && is_reg64(insts[i].args[0]) &&
+      !strcmp(insts[i].args[0], insts[i].args[1])) {
+    insts[i].deleted = true;
+    return true;
+  }
+  return false;
+}
+
+// setCC %al; movzbl %al, %eax; test %eax, %eax; je L
+// => setCC %al; movzbl %al, %eax; jNCC L
+static bool setcc_jcc(int i) {
+  if (!is_insn(i, NULL, 1) || strncmp(insts[i].op, "set", 3))
+    return false;
+
+  char *cc = insts[i].op + 3;
+  char *ncc = invert_cond(cc);
+  int j = next(i);
+  int k = next(j);
+  int l = next(k);
+  char *x;
+
+  if (!ncc || !is_movz(j) || strcmp(insts[j].args[0], insts[i].args[0]) ||
+      !is_zero_test(k, &x))
+    return false;
+
+  int n1, n2;
+  if (!reg_size(insts[j].args[1], &n1) || !reg_size(x, &n2) || n1 != n2)
+    return false;
+
+  if (is_insn(l, "je", 1) || is_insn(l, "jz", 1))
+    cc = ncc;
+  else if (!is_insn(l, "jne", 1) && !is_insn(l, "jnz", 1))
+    return false;
+
+  rewrite(l, format("j%s", cc), insts[l].args[0], NULL);
+  insts[k].deleted = true;
+  return true;
+}
+
+// add %ecx, %eax; test %eax, %eax; je L => add %ecx, %eax; je L
+static bool redundant_test(int i) {
+  static char *ops[] = {"add", "sub", "and", "or", "xor", "neg", "inc", "dec"};
+
+  if (i >= ninsts || insts[i].kind != I_INSN || insts[i].nargs == 0)
+    return false;
+
+  bool sets_zf = false;
+  for (int k = 0; k < sizeof(ops) / sizeof(*ops); k++)
+    if (!strcmp(insts[i].op, ops[k]))
+      sets_zf = true;
+  if (!sets_zf)
+    return false;
+
+  char *r = insts[i].args[insts[i].nargs - 1];
+  int j = next(i);
+  char *x;
+
+  // A zero extension of the result in between doesn't change the flags.
+  if (is_movz(j) && !strcmp(insts[j].args[0], r)) {
+    char *ext = insts[j].args[1];
+    int n1, n2, n3;
+    int sz1 = reg_size(r, &n1);
+    int sz2 = reg_size(ext, &n2);
+    j = next(j);
+    if (!sz1 || !sz2 || !is_zero_test(j, &x))
+      return false;
+
+    int sz3 = reg_size(x, &n3);
+    if (sz3 < sz1 || n3 != n2 || (sz3 > sz2 && !is_zext_of(ext, x)))
+      return false;
+  } else if (!is_zero_test(j, &x) || !is_zext_of(r, x)) {
+    return false;
+  }
+
+  if (!uses_only_zf(next(j)))
+    return false;
+  insts[j].deleted = true;
+  return true;
+}
+
+static bool jcc_over_jmp(int i) {
+  char *cc = jcc_cond(i);
+  int j = next(i);
+  if (!cc || !is_insn(j, "jmp", 1) || insts[j].args[0][0] == '*')
+    return false;
+
+  for (int k = next(j); k < ninsts && insts[k].kind == I_LABEL; k = next(k)) {
+    if (is_label(k, insts[i].args[0])) {
+      rewrite(i, format("j%s", invert_cond(cc)), insts[j].args[0], NULL);
+      insts[j].deleted = true;
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool jmp_next(int i) {
+  if (!is_insn(i, "jmp", 1))
+    return false;
+
+  for (int k = next(i); k < ninsts && insts[k].kind == I_LABEL; k = next(k)) {
+    if (is_label(k, insts[i].args[0])) {
+      insts[i].deleted = true;
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool dead_code(int i) {
+  if (!is_insn(i, "jmp", 1) && !is_insn(i, "ret", 0))
+    return false;
+
+  bool changed = false;
+  for (int k = next(i); k < ninsts && insts[k].kind == I_INSN; k = next(k)) {
+    insts[k].deleted = true;
+    changed = true;
+  }
+  return changed;
+}
+
+static bool loc_run(int i) {
+  if (insts[i].kind != I_LOC)
+    return false;
+
+  for (int k = i + 1; k < ninsts; k++) {
+    if (insts[k].deleted)
+      continue;
+    if (insts[k].kind != I_LOC)
+      return false;
+    insts[i].deleted = true;
+    return true;
+  }
+  return false;
+}
+
+static bool loc_dup(int i) {
+  if (insts[i].kind != I_LOC)
+    return false;
+
+  for (int k = i - 1; k >= 0; k--) {
+    if (insts[k].deleted || insts[k].kind != I_LOC)
+      continue;
+    if (strcmp(insts[k].text, insts[i].text))
+      return false;
+    insts[i].deleted = true;
+    return true;
+  }
+  return false;
+}
+
+typedef struct {
+  char *name;
+  bool (*fn)(int i);
+} Rule;
+
+static Rule rules[] = {
+  {"push-pop", push_pop},
+  {"lea-load", lea_load},
+  {"mov-back", mov_back},
+  {"self-mov", self_mov},
+  {"setcc-jcc", setcc_jcc},
+  {"redundant-test", redundant_test},
+  {"jcc-over-jmp", jcc_over_jmp},
+  {"jmp-next", jmp_next},
+  {"dead-code", dead_code},
+  {"loc-run", loc_run},
+  {"loc-dup", loc_dup},
+};
+
+#define NRULES (sizeof(rules) / sizeof(*rules))
+
+static _Thread_local int hits[NRULES];
+
+// Optimize the function body in `buf` and write it to `out`.
+void peephole(char *buf, FILE *out) {
+  parse_insts(buf);
+
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (int i = 0; i < ninsts; i++) {
+      if (insts[i].deleted)
+        continue;
+      for (int r = 0; r < NRULES; r++) {
+        if (rules[r].fn(i)) {
+          hits[r]++;
+          changed = true;
+          if (insts[i].deleted)
+            break;
+        }
+      }
+    }
+  }
+
+  emit(out);
+  free(insts);
+}
+
+void print_peephole_stats(char *file) {
+  fprintf(stderr, "%s: peephole rule hits:\n", file);
+  for (int i = 0; i < NRULES; i++)
+    fprintf(stderr, "  %-16s %d\n", rules[i].name, hits[i]);
+}
@@ -65,10 +65,26 @@ struct Hideset {
   char *name;
 };
 
-static HashMap macros;
-static CondIncl *cond_incl;
-static HashMap pragma_once;
-static int include_next_idx;
+// Preprocessor state for a translation unit. Each thread works on
+// its own context, so independent translation units can be
+// preprocessed concurrently.
+struct Preprocessor {
+  HashMap macros;
+  CondIncl *cond_incl;
+  HashMap pragma_once;
+  HashMap include_guards;
+  int include_next_idx;
+  int counter;
+  time_t start_time; // For __DATE__ and __TIME__
+};
+
+static _Thread_local Preprocessor *pp;
+
+// Search results of the include paths. The include paths don't
+// change once the command line is parsed, so this cache is shared
+// by all threads.
+static HashMap include_cache;
+static pthread_mutex_t include_cache_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static Token *preprocess2(Token *tok);
 static Macro *find_macro(Token *tok);
@@ -309,18 +325,18 @@ static long eval_const_expr(Token **rest, Token *tok) {
 
 static CondIncl *push_cond_incl(Token *tok, bool included) {
   CondIncl *ci = calloc(1, sizeof(CondIncl));
-  ci->next = cond_incl;
+  ci->next = pp->cond_incl;
   ci->ctx = IN_THEN;
   ci->tok = tok;
   ci->included = included;
-  cond_incl = ci;
+  pp->cond_incl = ci;
   return ci;
 }
 
 static Macro *find_macro(Token *tok) {
   if (tok->kind != TK_IDENT)
     return NULL;
-  return hashmap_get2(&macros, tok->loc, tok->len);
+  return hashmap_get2(&pp->macros, tok->loc, tok->len);
 }
 
 static Macro *add_macro(char *name, bool is_objlike, Token *body) {
@@ -328,7 +344,7 @@ static Macro *add_macro(char *name, bool is_objlike, Token *body) {
   m->name = name;
   m->is_objlike = is_objlike;
   m->body = body;
-  hashmap_put(&macros, name, m);
+  hashmap_put(&pp->macros, name, m);
   return m;
 }
 
@@ -682,12 +698,21 @@ static bool expand_macro(Token **rest, Token *tok) {
   return true;
 }
 
-char *search_include_paths(char *filename) {
+// Like file_exists(), but the result is recorded in the manifest
+// of the direct-mode compilation cache.
+static bool probe_file(char *path) {
+  bool found = file_exists(path);
+  manifest_add_probe(path, found);
+  return found;
+}
+
+static char *search_include_paths2(char *filename) {
   if (filename[0] == '/')
     return filename;
 
-  static HashMap cache;
-  char *cached = hashmap_get(&cache, filename);
+  pthread_mutex_lock(&include_cache_lock);
+  char *cached = hashmap_get(&include_cache, filename);
+  pthread_mutex_unlock(&include_cache_lock);
   if (cached)
     return cached;
 
@@ -696,17 +721,25 @@ char *search_include_paths(char *filename) {
     char *path = format("%s/%s", include_paths.data[i], filename);
     if (!file_exists(path))
       continue;
-    hashmap_put(&cache, filename, path);
-    include_next_idx = i + 1;
+    pthread_mutex_lock(&include_cache_lock);
+    hashmap_put(&include_cache, filename, path);
+    pthread_mutex_unlock(&include_cache_lock);
+    pp->include_next_idx = i + 1;
     return path;
   }
   return NULL;
 }
 
+char *search_include_paths(char *filename) {
+  char *path = search_include_paths2(filename);
+  manifest_add_search(filename, path);
+  return path;
+}
+
 static char *search_include_next(char *filename) {
-  for (; include_next_idx < include_paths.len; include_next_idx++) {
-    char *path = format("%s/%s", include_paths.data[include_next_idx], filename);
-    if (file_exists(path))
+  for (; pp->include_next_idx < include_paths.len; pp->include_next_idx++) {
+    char *path = format("%s/%s", include_paths.data[pp->include_next_idx], filename);
+    if (probe_file(path))
       return path;
   }
   return NULL;
@@ -794,15 +827,14 @@ static char *detect_include_guard(Token *tok) {
 
 static Token *include_file(Token *tok, char *path, Token *filename_tok) {
   // Check for "#pragma once"
-  if (hashmap_get(&pragma_once, path))
+  if (hashmap_get(&pp->pragma_once, path))
     return tok;
 
   // If we read the same file before, and if the file was guarded
   // by the usual #ifndef ... #endif pattern, we may be able to
   // skip the file without opening it.
-  static HashMap include_guards;
-  char *guard_name = hashmap_get(&include_guards, path);
-  if (guard_name && hashmap_get(&macros, guard_name))
+  char *guard_name = hashmap_get(&pp->include_guards, path);
+  if (guard_name && hashmap_get(&pp->macros, guard_name))
     return tok;
 
   Token *tok2 = tokenize_file(path);
@@ -811,7 +843,7 @@ static Token *include_file(Token *tok, char *path, Token *filename_tok) {
 
   guard_name = detect_include_guard(tok2);
   if (guard_name)
-    hashmap_put(&include_guards, path, guard_name);
+    hashmap_put(&pp->include_guards, path, guard_name);
 
   return append(tok2, tok);
 }
@@ -863,7 +895,7 @@ static Token *preprocess2(Token *tok) {
 
       if (filename[0] != '/' && is_dquote) {
         char *path = format("%s/%s", dirname(strdup(start->file->name)), filename);
-        if (file_exists(path)) {
+        if (probe_file(path)) {
           tok = include_file(tok, path, start->next->next);
           continue;
         }
@@ -923,32 +955,32 @@ static Token *preprocess2(Token *tok) {
     }
 
     if (equal(tok, "elif")) {
-      if (!cond_incl || cond_incl->ctx == IN_ELSE)
+      if (!pp->cond_incl || pp->cond_incl->ctx == IN_ELSE)
         error_tok(start, "stray #elif");
-      cond_incl->ctx = IN_ELIF;
+      pp->cond_incl->ctx = IN_ELIF;
 
-      if (!cond_incl->included && eval_const_expr(&tok, tok))
-        cond_incl->included = true;
+      if (!pp->cond_incl->included && eval_const_expr(&tok, tok))
+        pp->cond_incl->included = true;
       else
         tok = skip_cond_incl(tok);
       continue;
     }
 
     if (equal(tok, "else")) {
-      if (!cond_incl || cond_incl->ctx == IN_ELSE)
+      if (!pp->cond_incl || pp->cond_incl->ctx == IN_ELSE)
         error_tok(start, "stray #else");
-      cond_incl->ctx = IN_ELSE;
+      pp->cond_incl->ctx = IN_ELSE;
       tok = skip_line(tok->next);
 
-      if (cond_incl->included)
+      if (pp->cond_incl->included)
         tok = skip_cond_incl(tok);
       continue;
     }
 
     if (equal(tok, "endif")) {
-      if (!cond_incl)
+      if (!pp->cond_incl)
         error_tok(start, "stray #endif");
-      cond_incl = cond_incl->next;
+      pp->cond_incl = pp->cond_incl->next;
       tok = skip_line(tok->next);
       continue;
     }
@@ -964,7 +996,7 @@ static Token *preprocess2(Token *tok) {
     }
 
     if (equal(tok, "pragma") && equal(tok->next, "once")) {
-      hashmap_put(&pragma_once, tok->file->name, (void *)1);
+      hashmap_put(&pp->pragma_once, tok->file->name, (void *)1);
       tok = skip_line(tok->next->next);
       continue;
     }
@@ -996,7 +1028,7 @@ void define_macro(char *name, char *buf) {
 }
 
 void undef_macro(char *name) {
-  hashmap_delete(&macros, name);
+  hashmap_delete(&pp->macros, name);
 }
 
 static Macro *add_builtin(char *name, macro_handler_fn *fn) {
@@ -1020,14 +1052,16 @@ static Token *line_macro(Token *tmpl) {
 
 // __COUNTER__ is expanded to serial values starting from 0.
 static Token *counter_macro(Token *tmpl) {
-  static int i = 0;
-  return new_num_token(i++, tmpl);
+  return new_num_token(pp->counter++, tmpl);
 }
 
 // __TIMESTAMP__ is expanded to a string describing the last
 // modification time of the current file. E.g.
 // "Fri Jul 24 01:32:50 2020"
 static Token *timestamp_macro(Token *tmpl) {
+  // The result doesn't depend only on the file contents.
+  manifest_disable();
+
   struct stat st;
   if (stat(tmpl->file->name, &st) != 0)
     return new_str_token("??? ??? ?? ??:??:?? ????", tmpl);
@@ -1042,24 +1076,48 @@ static Token *base_file_macro(Token *tmpl) {
   return new_str_token(base_file, tmpl);
 }
 
-// __DATE__ is expanded to the current date, e.g. "May 17 2020".
-static char *format_date(struct tm *tm) {
+// __DATE__ is expanded to the date when the translation unit is
+// compiled, e.g. "May 17 2020".
+static Token *date_macro(Token *tmpl) {
   static char mon[][4] = {
     "Jan", "Feb", "Mar", "Apr", "May", "Jun",
     "Jul", "Aug", "Sep", "Oct", "Nov", "Dec",
   };
 
-  return format("\"%s %2d %d\"", mon[tm->tm_mon], tm->tm_mday, tm->tm_year + 1900);
+  // The result of the compilation depends on the current time.
+  manifest_disable();
+
+  struct tm tm;
+  localtime_r(&pp->start_time, &tm);
+  return new_str_token(format("%s %2d %d", mon[tm.tm_mon], tm.tm_mday,
+                              tm.tm_year + 1900), tmpl);
 }
 
-// __TIME__ is expanded to the current time, e.g. "13:34:03".
-static char *format_time(struct tm *tm) {
-  return format("\"%02d:%02d:%02d\"", tm->tm_hour, tm->tm_min, tm->tm_sec);
+// __TIME__ is expanded to the time when the translation unit is
+// compiled, e.g. "13:34:03".
+static Token *time_macro(Token *tmpl) {
+  manifest_disable();
+
+  struct tm tm;
+  localtime_r(&pp->start_time, &tm);
+  return new_str_token(format("%02d:%02d:%02d", tm.tm_hour, tm.tm_min,
+                              tm.tm_sec), tmpl);
 }
 
 void init_macros(void) {
+  if (!pp) {
+    pp = calloc(1, sizeof(Preprocessor));
+    pp->start_time = time(NULL);
+  }
+
   // Define predefined macros
   define_macro("_LP64", "1");
+  define_macro("__ATOMIC_ACQUIRE", "2");
+  define_macro("__ATOMIC_ACQ_REL", "4");
+  define_macro("__ATOMIC_CONSUME", "1");
+  define_macro("__ATOMIC_RELAXED", "0");
+  define_macro("__ATOMIC_RELEASE", "3");
+  define_macro("__ATOMIC_SEQ_CST", "5");
   define_macro("__C99_MACRO_WITH_VA_ARGS", "1");
   define_macro("__ELF__", "1");
   define_macro("__LP64__", "1");
@@ -1105,11 +1163,24 @@ void init_macros(void) {
   add_builtin("__COUNTER__", counter_macro);
   add_builtin("__TIMESTAMP__", timestamp_macro);
   add_builtin("__BASE_FILE__", base_file_macro);
+  add_builtin("__DATE__", date_macro);
+  add_builtin("__TIME__", time_macro);
+}
+
+// Returns a new preprocessor context whose macro definitions are
+// a snapshot of the current thread's ones. The new context is
+// typically handed to a worker thread which calls use_preprocessor().
+Preprocessor *new_preprocessor(void) {
+  Preprocessor *ctx = calloc(1, sizeof(Preprocessor));
+  ctx->start_time = time(NULL);
+  if (pp)
+    hashmap_copy(&ctx->macros, &pp->macros);
+  return ctx;
+}
 
-  time_t now = time(NULL);
-  struct tm *tm = localtime(&now);
-  define_macro("__DATE__", format_date(tm));
-  define_macro("__TIME__", format_time(tm));
+// Make `ctx` the preprocessor context of the current thread.
+void use_preprocessor(Preprocessor *ctx) {
+  pp = ctx;
 }
 
 typedef enum {
@@ -1197,8 +1268,8 @@ static void join_adjacent_string_literals(Token *tok) {
 // Entry point function of the preprocessor.
 Token *preprocess(Token *tok) {
   tok = preprocess2(tok);
-  if (cond_incl)
-    error_tok(cond_incl->tok, "unterminated conditional directive");
+  if (pp->cond_incl)
+    error_tok(pp->cond_incl->tok, "unterminated conditional directive");
   convert_pp_tokens(tok);
   join_adjacent_string_literals(tok);
 
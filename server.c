@@ -0,0 +1,281 @@
+// This file implements the compile server. A server keeps the
+// process-wide caches (predefined macros and tokenized headers) warm
+// across compiler invocations, so that a build that runs the
+// compiler many times on the same tree doesn't pay for a cold start
+// each time.
+//
+// A client forwards its command line, working directory, environment
+// and standard file descriptors over a Unix domain socket. The server forks a
+// child for each request; the child inherits the warm caches, runs
+// the compiler driver as if it had been invoked by the client, and
+// writes output files and diagnostics directly. The exit status is
+// sent back to the client.
+//
+// Requests are handled one at a time. Each child reports the files it
+// tokenized, and the server tokenizes them too, so that subsequent
+// requests find them in the cache.
+
+#include "chibicc.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+
+extern char **environ;
+
+static bool write_all(int fd, void *buf, size_t len) {
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool read_all(int fd, void *buf, size_t len) {
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool init_addr(struct sockaddr_un *addr, char *path) {
+  if (strlen(path) >= sizeof(addr->sun_path))
+    return false;
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  strcpy(addr->sun_path, path);
+  return true;
+}
+
+// A request starts with the length of the payload. Standard input,
+// output and error of the client are attached to it as ancillary
+// data. The payload is the working directory, the environment, an
+// empty string and argv, each terminated by '\0'. An environment
+// variable is never empty because it contains '='.
+static bool send_request(int fd, int argc, char **argv) {
+  char *buf;
+  size_t buflen;
+  FILE *out = open_memstream(&buf, &buflen);
+
+  char *cwd = getcwd(NULL, 0);
+  if (!cwd)
+    return false;
+  fwrite(cwd, strlen(cwd) + 1, 1, out);
+  free(cwd);
+  for (char **env = environ; *env; env++)
+    fwrite(*env, strlen(*env) + 1, 1, out);
+  fputc('\0', out);
+  for (int i = 0; i < argc; i++)
+    fwrite(argv[i], strlen(argv[i]) + 1, 1, out);
+  fclose(out);
+
+  uint32_t len = buflen;
+  struct iovec iov = {&len, sizeof(len)};
+  char cbuf[CMSG_SPACE(sizeof(int) * 3)];
+  memset(cbuf, 0, sizeof(cbuf));
+
+  struct msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * 3);
+  int fds[] = {0, 1, 2};
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(len))
+    return false;
+  return write_all(fd, buf, buflen);
+}
+
+// Returns the payload of a request, or NULL on failure.
+static char *recv_request(int fd, int *fds, size_t *buflen) {
+  uint32_t len;
+  struct iovec iov = {&len, sizeof(len)};
+  char cbuf[CMSG_SPACE(sizeof(int) * 3)];
+
+  struct msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+
+  if (recvmsg(fd, &msg, 0) != sizeof(len))
+    return NULL;
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(sizeof(int) * 3))
+    return NULL;
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * 3);
+
+  char *buf = calloc(1, len + 1);
+  if (!read_all(fd, buf, len)) {
+    for (int i = 0; i < 3; i++)
+      close(fds[i]);
+    return NULL;
+  }
+  *buflen = len;
+  return buf;
+}
+
+// Forward a command line to the server at `path`. Returns false if
+// the server is not available, in which case the caller should
+// compile by itself.
+bool run_client(char *path, int argc, char **argv, int *status) {
+  struct sockaddr_un addr;
+  if (!init_addr(&addr, path))
+    return false;
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1)
+    return false;
+
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+      !send_request(fd, argc, argv)) {
+    close(fd);
+    return false;
+  }
+
+  // If the server dies before replying, the request is compiled
+  // again locally.
+  int32_t st;
+  bool ok = read_all(fd, &st, sizeof(st));
+  close(fd);
+  *status = st;
+  return ok;
+}
+
+static void handle_request(int sock, int conn, int (*fn)(int argc, char **argv)) {
+  int fds[3];
+  size_t buflen;
+  char *buf = recv_request(conn, fds, &buflen);
+  if (!buf)
+    return;
+
+  // Unpack the working directory, the environment and argv.
+  char *cwd = buf;
+  char *p = buf + strlen(buf) + 1;
+
+  StringArray env = {};
+  for (; p < buf + buflen && *p; p += strlen(p) + 1)
+    strarray_push(&env, p);
+  p++;
+
+  StringArray args = {};
+  for (; p < buf + buflen; p += strlen(p) + 1)
+    strarray_push(&args, p);
+  int argc = args.len;
+  strarray_push(&args, NULL);
+
+  int pipefd[2];
+  if (pipe(pipefd))
+    error("pipe failed: %s", strerror(errno));
+
+  pid_t pid = fork();
+  if (pid == -1)
+    error("fork failed: %s", strerror(errno));
+
+  if (pid == 0) {
+    // Child process. Run the driver on behalf of the client.
+    close(sock);
+    close(conn);
+    close(pipefd[0]);
+    for (int i = 0; i < 3; i++) {
+      dup2(fds[i], i);
+      close(fds[i]);
+    }
+
+    if (chdir(cwd))
+      error("%s: %s", cwd, strerror(errno));
+
+    // Run with the client's environment, so that the cache settings
+    // and the assembler and linker found in $PATH are the client's.
+    strarray_push(&env, NULL);
+    environ = env.data;
+
+    int status = fn(argc, args.data);
+
+    FILE *out = fdopen(pipefd[1], "w");
+    save_file_cache(out);
+    fclose(out);
+    exit(status);
+  }
+
+  close(pipefd[1]);
+  for (int i = 0; i < 3; i++)
+    close(fds[i]);
+
+  // Read the child's list of tokenized files before waiting for it,
+  // so that the child never blocks on a full pipe.
+  char *list;
+  size_t listlen;
+  FILE *out = open_memstream(&list, &listlen);
+  char tmp[4096];
+  ssize_t n;
+  while ((n = read(pipefd[0], tmp, sizeof(tmp))) > 0)
+    fwrite(tmp, n, 1, out);
+  fclose(out);
+  close(pipefd[0]);
+
+  int status;
+  if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status))
+    status = 1;
+  else
+    status = WEXITSTATUS(status);
+
+  int32_t st = status;
+  write_all(conn, &st, sizeof(st));
+  shutdown(conn, SHUT_RDWR);
+
+  // Warm the cache for the next request after replying to the client.
+  FILE *in = fmemopen(list, listlen, "r");
+  if (in) {
+    load_file_cache(in);
+    fclose(in);
+  }
+  free(list);
+  free(buf);
+  free(env.data);
+  free(args.data);
+}
+
+// Listen on a Unix domain socket at `path` and handle requests by
+// calling `fn` in a child process. Never returns.
+void run_server(char *path, int (*fn)(int argc, char **argv)) {
+  struct sockaddr_un addr;
+  if (!init_addr(&addr, path))
+    error("socket path too long: %s", path);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock == -1)
+    error("socket failed: %s", strerror(errno));
+
+  unlink(path);
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)))
+    error("%s: %s", path, strerror(errno));
+  if (listen(sock, 16))
+    error("listen failed: %s", strerror(errno));
+
+  for (;;) {
+    int conn = accept(sock, NULL, NULL);
+    if (conn == -1) {
+      if (errno == EINTR)
+        continue;
+      error("accept failed: %s", strerror(errno));
+    }
+    handle_request(sock, conn, fn);
+    close(conn);
+  }
+}
@@ -1,5 +1,17 @@
 #include "test.h"
 
+static int id(int x) { return x; }
+
+#define T0(x) id(x)
+#define T1(x) (T0(x) - T0(x+1) * 2)
+#define T2(x) (T1(x) + T1(x+3))
+#define T3(x) (T2(x) - T2(x+1) * 2)
+#define T4(x) (T3(x) + T3(x+3))
+#define T5(x) (T4(x) - T4(x+1) * 2)
+#define T6(x) (T5(x) + T5(x+3))
+#define T7(x) (T6(x) - T6(x+1) * 2)
+#define T8(x) (T7(x) + T7(x+3))
+
 int main() {
   ASSERT(0, 0);
   ASSERT(42, 42);
@@ -139,6 +151,11 @@ int main() {
   ASSERT(6, (long double)3*2);
   ASSERT(5, (long double)3+2.0);
 
+  ASSERT(240, T8(1));
+  ASSERT(3091, ({ int x=id(3), y=id(10); (x<<y) + (y>>x) + (x<<2) + y/3 + y%x + (y-x*id(2))/(x-id(1)); }));
+  ASSERT(-7, ({ long x=id(-42); x/6; }));
+  ASSERT(4, ({ unsigned x=4294967295; x%9 + (x/(x-1)); }));
+
   printf("OK\n");
   return 0;
 }
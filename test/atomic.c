@@ -52,12 +52,130 @@ static int add_millions(void) {
   return x;
 }
 
+static _Atomic unsigned bits;
+
+static int set_bits(void *arg) {
+  for (int i = 0; i < 1000*1000; i++) {
+    bits |= 1u << (i & 15);
+    bits &= ~(1u << ((i & 15) + 16));
+  }
+  return 0;
+}
+
+static int clear_bits(void *arg) {
+  for (int i = 0; i < 1000*1000; i++) {
+    bits ^= 1u << ((i & 15) + 16);
+    atomic_fetch_or(&bits, 1u << (i & 15));
+  }
+  return 0;
+}
+
+static int fetch_millions(void) {
+  _Atomic long x = 0;
+
+  pthread_t thr1;
+  pthread_t thr2;
+  pthread_t thr3;
+
+  pthread_create(&thr1, NULL, set_bits, NULL);
+  pthread_create(&thr2, NULL, clear_bits, NULL);
+  pthread_create(&thr3, NULL, add2, &x);
+
+  long sum = 0;
+  for (int i = 0; i < 1000*1000; i++)
+    sum += atomic_fetch_add(&x, 3) & 1;
+
+  pthread_join(thr1, NULL);
+  pthread_join(thr2, NULL);
+  pthread_join(thr3, NULL);
+  return x == 4*1000*1000 && (bits & 0xffff) == 0xffff && sum <= 1000*1000;
+}
+
+static int data;
+static _Atomic int ready;
+
+static int produce(void *arg) {
+  for (int i = 1; i <= 1000; i++) {
+    while (__atomic_load_n(&ready, __ATOMIC_ACQUIRE))
+      ;
+    data = i;
+    __atomic_store_n(&ready, 1, __ATOMIC_RELEASE);
+  }
+  return 0;
+}
+
+static long consume(void) {
+  pthread_t thr;
+  pthread_create(&thr, NULL, produce, NULL);
+
+  long sum = 0;
+  for (int i = 1; i <= 1000; i++) {
+    while (!atomic_load_explicit(&ready, memory_order_acquire))
+      ;
+    sum += data == i;
+    atomic_store_explicit(&ready, 0, memory_order_release);
+  }
+
+  pthread_join(thr, NULL);
+  return sum;
+}
+
 int main() {
   ASSERT(6*1000*1000, add_millions());
 
   ASSERT(3, ({ int x=3; atomic_exchange(&x, 5); }));
   ASSERT(5, ({ int x=3; atomic_exchange(&x, 5); x; }));
 
+  ASSERT(1, fetch_millions());
+
+  ASSERT(3, ({ int x=3; atomic_fetch_add(&x, 5); }));
+  ASSERT(8, ({ int x=3; atomic_fetch_add(&x, 5); x; }));
+  ASSERT(3, ({ long x=3; atomic_fetch_sub(&x, 5); }));
+  ASSERT(-2, ({ long x=3; atomic_fetch_sub(&x, 5); x; }));
+  ASSERT(12, ({ int x=12; atomic_fetch_and(&x, 10); }));
+  ASSERT(8, ({ int x=12; atomic_fetch_and(&x, 10); x; }));
+  ASSERT(14, ({ int x=12; atomic_fetch_or(&x, 10); x; }));
+  ASSERT(6, ({ int x=12; atomic_fetch_xor(&x, 10); x; }));
+  ASSERT(8, ({ int x=3; __atomic_add_fetch(&x, 5, 0); }));
+  ASSERT(14, ({ int x=12; __atomic_or_fetch(&x, 10, 0); }));
+  ASSERT(6, ({ int x=12; __atomic_xor_fetch(&x, 10, 0); }));
+  ASSERT(-1, ({ char x=127; __atomic_add_fetch(&x, 128, 0); }));
+  ASSERT(255, ({ unsigned char x=0; __atomic_sub_fetch(&x, 1, 0); }));
+  ASSERT(8, ({ int y=8; int *p=0; __atomic_fetch_add(&p, y, 0); (long)p; }));
+
+  ASSERT(3, ({ _Atomic int x=3; x++; }));
+  ASSERT(4, ({ _Atomic int x=3; x++; x; }));
+  ASSERT(2, ({ _Atomic int x=3; --x; }));
+  ASSERT(-128, ({ _Atomic char x=127; ++x; }));
+  ASSERT(0, ({ _Atomic unsigned char x=255; x++; x; }));
+  ASSERT(8, ({ _Atomic int x=12; x &= 10; }));
+  ASSERT(6, ({ _Atomic int x=12; int y=10; x ^= y; }));
+  ASSERT(5, ({ _Atomic short x=2; x += 3; }));
+  ASSERT(1, ({ _Atomic _Bool x=0; x++; x; }));
+  ASSERT(2, ({ _Atomic int a[3]={0}; a[1] += 2; a[1]; }));
+  ASSERT(3, ({ struct { int a; _Atomic int b; } s={1,2}; s.b |= 1; s.b; }));
+
+  ASSERT(1000, consume());
+
+  ASSERT(3, ({ int x=3; __atomic_load_n(&x, __ATOMIC_RELAXED); }));
+  ASSERT(3, ({ long x=3; atomic_load(&x); }));
+  ASSERT(5, ({ int x=3; __atomic_store_n(&x, 5, __ATOMIC_RELAXED); x; }));
+  ASSERT(5, ({ int x=3; __atomic_store_n(&x, 5, __ATOMIC_SEQ_CST); x; }));
+  ASSERT(7, ({ char x=3; int o=5; __atomic_store_n(&x, 263, o); x; }));
+  ASSERT(5, ({ int x=3; atomic_store(&x, 5); atomic_thread_fence(memory_order_seq_cst); x; }));
+  ASSERT(2, ({ double x=1; atomic_store(&x, 2.5); atomic_signal_fence(memory_order_seq_cst); x; }));
+  ASSERT(3, ({ int x=3; __atomic_exchange_n(&x, 5, __ATOMIC_ACQ_REL); }));
+  ASSERT(7, ({ _Atomic int x=3; x = 7; }));
+  ASSERT(7, ({ _Atomic int x=3; int y = x = 7; y; }));
+  ASSERT(1, ({ _Atomic _Bool x=0; x = 5; }));
+  ASSERT(0, ({ atomic_flag f=1; atomic_flag_clear(&f); f; }));
+  ASSERT(5, __ATOMIC_SEQ_CST);
+  ASSERT(31, ({ int x=3, n=0; int y = __atomic_load_n(&x, (n++, __ATOMIC_ACQUIRE)); y * 10 + n; }));
+  ASSERT(51, ({ int x=3, n=0; __atomic_store_n(&x, 5, (n++, __ATOMIC_RELEASE)); x * 10 + n; }));
+  ASSERT(351, ({ int x=3, n=0; int y = __atomic_exchange_n(&x, 5, (n++, __ATOMIC_SEQ_CST)); y * 100 + x * 10 + n; }));
+  ASSERT(41, ({ int x=3, n=0; __atomic_fetch_add(&x, 1, (n++, __ATOMIC_RELAXED)); x * 10 + n; }));
+  ASSERT(2, ({ int n=0; __atomic_thread_fence((n++, __ATOMIC_SEQ_CST)); __atomic_signal_fence((n++, 0)); n; }));
+
   printf("OK\n");
   return 0;
 }
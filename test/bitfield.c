@@ -6,6 +6,49 @@ struct {
   int c : 10;
 } g45 = {1, 2, 3}, g46={};
 
+typedef struct {
+  unsigned a : 3;
+  unsigned b : 7;
+  unsigned c : 22;
+  unsigned long d : 40;
+  long e : 24;
+  unsigned long f : 64;
+} U;
+
+static int get_b(U *p) { return p->b; }
+static void set_b(U *p, int x) { p->b = x; }
+static long sum(U *p) { return p->a + p->b + p->c + p->d + p->e; }
+
+static long init_var(int x, long y) {
+  struct { char a; unsigned b : 4; int c : 5; unsigned d : 3; short e; } s = {x, x, -x, 9, 7};
+  U u = {.b = x, .d = y, .a = 5, .e = y};
+  return s.a + s.b * 10 + s.c * 100 + s.d * 1000 + s.e * 10000 + sum(&u) * 100000;
+}
+
+typedef struct { char h : 2; _Bool i : 1; _Bool j : 1; unsigned k : 3; } B;
+
+B gb = {2, 2, 0.5, 9};
+
+static int bool_bits(int x) {
+  B s = {2, 2, 0.5, 9};
+  B t = {x + 1, x + 1, x * 0.5, x + 8};
+  B u = {0};
+  u.i = 2;
+  u.j = x + 255;
+  return s.i + s.j * 2 + t.i * 4 + t.j * 8 + u.i * 16 + u.j * 32 + s.h * 100 + t.k * 1000;
+}
+
+// Functions using floating-point numbers are compiled from the AST.
+static long ast_bits(double d, int y) {
+  U x = {1, 2, 3};
+  x.b = 300;
+  x.a = d;
+  x.c = y;
+  x.e = -1;
+  x.d = y & 7;
+  return x.a + x.b * 10 + x.c * 100 + (long)x.d * 1000 + x.e * 10000;
+}
+
 int main() {
   ASSERT(4, sizeof(struct {int x:1; }));
   ASSERT(8, sizeof(struct {long x:1; }));
@@ -52,6 +95,35 @@ int main() {
   ASSERT(8, sizeof(struct {int a:3; int:0; int c:5;}));
   ASSERT(4, sizeof(struct {int a:3; int:0;}));
 
+  ASSERT(5, ({ U x={5,100,3000000}; x.a; }));
+  ASSERT(100, ({ U x={5,100,3000000}; x.b; }));
+  ASSERT(3000000, ({ U x={5,100,3000000}; x.c; }));
+  ASSERT(100, ({ U x={5,100,3000000}; get_b(&x); }));
+  ASSERT(3000000, ({ U x={5,100,3000000}; set_b(&x, 255); x.c; }));
+  ASSERT(127, ({ U x={5,100,3000000}; set_b(&x, 255); x.b; }));
+  ASSERT(5, ({ U x={5,100,3000000}; set_b(&x, 255); x.a; }));
+  ASSERT(0, ({ U x={7,0,0}; x.a = 8; x.a; }));
+  ASSERT(1, ({ U x={0}; x.d = 0xffffffffffL; x.d == 0xffffffffffL && x.c == 0 && x.e == 0; }));
+  ASSERT(1, ({ U x={0}; x.d = -1; x.e = -1; x.d == 0xffffffffffL && x.e == -1 && x.f == 0; }));
+  ASSERT(1, ({ U x={0}; x.f = -1; x.f == -1UL && x.e == 0; }));
+  ASSERT(1, ({ U x={1,2,3,4,-5,6}; x.e == -5 && x.f == 6 && sum(&x) == 5; }));
+  ASSERT(-8388608, ({ U x={0}; x.e = 0x800000; x.e; }));
+  ASSERT(3, ({ U x={0}; int y = 3; x.b = y; }));
+  ASSERT(3, ({ U x={0}; U *p = &x; p->a = 3; p->a; }));
+  ASSERT(870733, init_var(3, 0));
+  ASSERT(200870733, init_var(3, 1000));
+  ASSERT(-18, ({ struct bit1 x={1,2}; x.c=3; x.e=-1; x.b + x.a * 10 + x.c * 30 + x.d; }));
+
+  ASSERT(-4059, ast_bits(1, 5));
+  ASSERT(419427741, ast_bits(1, -1));
+
+  ASSERT(863, bool_bits(1));
+  ASSERT(1, gb.i);
+  ASSERT(1, gb.j);
+  ASSERT(1, gb.k);
+  ASSERT(-2, gb.h);
+  ASSERT(1, ({ B b = {2, 2}; b.i; }));
+
   printf("OK\n");
   return 0;
 }
@@ -1,5 +1,9 @@
 #include "test.h"
 
+static int cmp_sign(int x) {
+  return (x > 0) - (x < 0);
+}
+
 int main() {
   ASSERT(1, __builtin_types_compatible_p(int, int));
   ASSERT(1, __builtin_types_compatible_p(double, double));
@@ -28,6 +32,31 @@ int main() {
 
   ASSERT(1, ({ struct {int a; int b;} x; __builtin_types_compatible_p(typeof(x.a), typeof(x.b)); }));
 
+  ASSERT(0, ({ char x[16]={1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16}, y[16]={0}; memcpy(y, x, 15); memcmp(y, "\1\2\3\4\5\6\7\10\11\12\13\14\15\16\17\0", 16); }));
+  ASSERT(1, ({ char x[8], *p=x; memcpy(x, "abcdefg", 8) == p; }));
+  ASSERT(7, ({ char x[8]="abcdefg", y[8]; __builtin_memcpy(y, x, 8); __builtin_strlen(y); }));
+  ASSERT(5, ({ char x[8]="abcdefg", y[8]={0}; int n=5; __builtin_memcpy(y, x, n); strlen(y); }));
+  ASSERT(2, ({ char x[4]={1,2,3,4}, y[4]={0}, *p=x, *q=y; memcpy(q++, p++, 0); (q-y) + (p-x); }));
+  ASSERT(0, ({ char x[11]; memset(x, 'a', 11); memcmp(x, "aaaaaaaaaaa", 11); }));
+  ASSERT(-1, ({ char x[13]; int c=255; memset(x, c, 13); x[0] + x[12] + 1; }));
+  ASSERT(1, ({ char x[13]; int c=0; memset(x+1, c++, 3) == x+1 && c == 1; }));
+  ASSERT(10, ({ long x[2]={10,20}; __builtin_memset(x+1, 0, 8); x[0] + x[1]; }));
+  ASSERT(3, ({ char x[4]="abc"; int c=0; memcpy((c++, x), (c++, "zz"), (c++, 3)); c; }));
+  ASSERT(122, ({ char x[4]="abc"; int c=0; memcpy((c++, x), (c++, "zz"), (c++, 3)); x[1]; }));
+  ASSERT(2, ({ char x[4]; int c=0; memset(x, (c++, 'x'), (c++, 2)); c; }));
+  ASSERT(2, ({ char x[4]="ab"; int c=0; memcmp(x, "ab", (c++, 2)) + (c++, 0) + c; }));
+  ASSERT(0, ({ memcmp("abcdefghijklmno", "abcdefghijklmno", 16); }));
+  ASSERT(-1, ({ cmp_sign(memcmp("abcdefghijklmn", "abcdefghijklmo", 15)); }));
+  ASSERT(1, ({ cmp_sign(memcmp("abcdefgh\xff", "abcdefgh\x01", 9)); }));
+  ASSERT(-1, ({ cmp_sign(__builtin_memcmp("\x01bcd", "\x02bcd", 4)); }));
+  ASSERT(0, ({ memcmp("abc", "abd", 2); }));
+  ASSERT(0, ({ memcmp("abc", "abd", 0); }));
+  ASSERT(1, ({ int n=3; cmp_sign(memcmp("abd", "abc", n)); }));
+  ASSERT(3, strlen("abc"));
+  ASSERT(1, strlen("a\0bc"));
+  ASSERT(8, sizeof(strlen("abc")));
+  ASSERT(5, __builtin_strlen("hello"));
+
   printf("OK\n");
   return 0;
 }
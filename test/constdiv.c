@@ -0,0 +1,103 @@
+#include "test.h"
+
+typedef int i32;
+typedef unsigned u32;
+typedef long i64;
+typedef unsigned long u64;
+
+static long vals[] = {
+  0, 1, -1, 2, -2, 3, 7, -7, 9, 10, -10, 11, 99, 100, -100, 101, 999, 1000,
+  -1001, 4095, 4096, 65535, 65536, 123456789, -123456789, 2147483647,
+  -2147483647 - 1, 2147483648, 4294967295, 4294967296, 1000000007,
+  9223372036854775807, -9223372036854775807 - 1, 1234567890123456789,
+  -987654321987654321, 0x5555555555555555, 0xaaaaaaaaaaaaaaaa,
+};
+
+// Division by a variable is done with div or idiv.
+static __attribute__((noinline)) int check_i32(i32 x, i32 d, i32 q, i32 r) {
+  return q == x / d && r == x % d;
+}
+
+static __attribute__((noinline)) int check_u32(u32 x, u32 d, u32 q, u32 r) {
+  return q == x / d && r == x % d;
+}
+
+static __attribute__((noinline)) int check_i64(i64 x, i64 d, i64 q, i64 r) {
+  return q == x / d && r == x % d;
+}
+
+static __attribute__((noinline)) int check_u64(u64 x, u64 d, u64 q, u64 r) {
+  return q == x / d && r == x % d;
+}
+
+#define CHECK(T, D) ({                                        \
+  int ok = 1;                                                 \
+  for (int i = 0; i < sizeof(vals) / sizeof(*vals); i++) {   \
+    T x = vals[i];                                            \
+    ok = ok && check_##T(x, D, x / (D), x % (D));            \
+  }                                                           \
+  ok;                                                         \
+})
+
+#define DIVISORS(T)                                           \
+  CHECK(T, 1) + CHECK(T, 2) + CHECK(T, 3) + CHECK(T, 5) +     \
+  CHECK(T, 6) + CHECK(T, 7) + CHECK(T, 9) + CHECK(T, 10) +    \
+  CHECK(T, 11) + CHECK(T, 12) + CHECK(T, 13) + CHECK(T, 16) + \
+  CHECK(T, 25) + CHECK(T, 60) + CHECK(T, 100) +               \
+  CHECK(T, 125) + CHECK(T, 641) + CHECK(T, 1000) +            \
+  CHECK(T, 4096) + CHECK(T, 10000) + CHECK(T, 65537) +        \
+  CHECK(T, 1000000) + CHECK(T, 0x40000000) +                  \
+  CHECK(T, 0x7fffffff) + CHECK(T, -2) + CHECK(T, -3) +        \
+  CHECK(T, -7) + CHECK(T, -10) + CHECK(T, -16) +              \
+  CHECK(T, -1000) + CHECK(T, -2147483647 - 1)
+
+static int ir_i32(void) { return DIVISORS(i32); }
+static int ir_u32(void) { return DIVISORS(u32) + CHECK(u32, 0x80000000) + CHECK(u32, 0x80000001); }
+static int ir_i64(void) { return DIVISORS(i64) + CHECK(i64, 1000000007) + CHECK(i64, -(1L << 40)); }
+static int ir_u64(void) {
+  return DIVISORS(u64) + CHECK(u64, 10000000000) + CHECK(u64, 0x8000000000000000) +
+    CHECK(u64, 0xffffffffffffffff) + CHECK(u64, 0x123456789);
+}
+
+// Functions using floating-point numbers are compiled from the AST.
+static int ast_i32(double d) { return DIVISORS(i32) + d; }
+static int ast_u32(double d) { return DIVISORS(u32) + CHECK(u32, 0x80000001) + d; }
+static int ast_i64(double d) { return DIVISORS(i64) + CHECK(i64, 1000000007) + d; }
+static int ast_u64(double d) { return DIVISORS(u64) + CHECK(u64, 0xfffffffffffffff1) + d; }
+
+static long mul(long x) {
+  return x * 2 + x * 3 + x * 5 + x * 9 + x * 12 + x * 40 + x * 72 + x * 7 + x * -3;
+}
+
+static int mul32(int x) {
+  return x * 3 + x * 10 + x * 1024 + x * 36;
+}
+
+static double mul_ast(long x, double d) {
+  return x * 3 + x * 10 + x * 1024 + x * 36 + x * 1 + d;
+}
+
+int main() {
+  ASSERT(31, ir_i32());
+  ASSERT(33, ir_u32());
+  ASSERT(33, ir_i64());
+  ASSERT(35, ir_u64());
+  ASSERT(31, ast_i32(0));
+  ASSERT(32, ast_u32(0));
+  ASSERT(32, ast_i64(0));
+  ASSERT(32, ast_u64(0));
+
+  ASSERT(-5, ({ int x = 5; x / -1; }));
+  ASSERT(0, ({ int x = 5; x % -1; }));
+  ASSERT(-5, ({ long x = 5; x / -1; }));
+  ASSERT(5, ({ unsigned x = 5; x / 1; }));
+
+  ASSERT(147, mul(1));
+  ASSERT(-147, mul(-1));
+  ASSERT(1073, mul32(1));
+  ASSERT(-2146, mul32(-2));
+  ASSERT(1074, mul_ast(1, 0));
+
+  printf("OK\n");
+  return 0;
+}
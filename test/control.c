@@ -95,6 +95,15 @@ int main() {
   ASSERT(2, ({ static void *p[]={&&v52,&&v52,&&v53}; int i=0; goto *p[1]; v51:i++; v52:i++; v53:i++; i; }));
   ASSERT(1, ({ static void *p[]={&&v62,&&v62,&&v63}; int i=0; goto *p[2]; v61:i++; v62:i++; v63:i++; i; }));
 
+  ASSERT(1, ({ int a=1, b=2, c=3, i=0; if (a < b && c) i=1; i; }));
+  ASSERT(0, ({ int a=1, b=2, c=0, i=0; if (a < b && c) i=1; i; }));
+  ASSERT(1, ({ int a=3, b=2, c=1, i=0; if (a < b || c) i=1; i; }));
+  ASSERT(0, ({ int a=3, b=2, c=0, i=0; if (!(a > b) || c) i=1; i; }));
+  ASSERT(1, ({ unsigned a=-1; int i=0; if (a > 1 && !(a < 1) && (a == -1 || a)) i=1; i; }));
+  ASSERT(2, ({ long a=1L<<40, i=0; if ((a > 0 || i++) && (a < 0 || !i)) i+=2; i; }));
+  ASSERT(5, ({ int i=0; for (; i < 10 && !(i == 5); i++); i; }));
+  ASSERT(1, ({ int a=5; (a < 3 || a > 4) && (a != 7); }));
+  ASSERT(0, ({ int a=5; (a < 3 || a > 5) && (a != 7); }));
   printf("OK\n");
   return 0;
 }
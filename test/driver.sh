@@ -68,6 +68,14 @@ $tmp/foo
 [ "$?" = 42 ]
 check linker
 
+rm -f $tmp/foo
+echo 'typedef int T; static T x = 1; int foo() { return x + __COUNTER__; }' > $tmp/foo.c
+echo 'typedef long T; static T x = 2; int foo(); int main() { return foo() * 10 + x + __COUNTER__; }' > $tmp/bar.c
+$chibicc -o $tmp/foo $tmp/foo.c $tmp/bar.c
+$tmp/foo
+[ "$?" = 12 ]
+check 'multiple translation units'
+
 # a.out
 rm -f $tmp/a.out
 echo 'int main() {}' > $tmp/foo.c
@@ -85,6 +93,17 @@ echo "#include \"$tmp/out1\"" | $chibicc -E -o $tmp/out2 -xc -
 cat $tmp/out2 | grep -q foo
 check '-E and -o'
 
+# -E with multiple input files
+echo '#include "pp-hdr.h"' > $tmp/pp1.c
+echo 'one __BASE_FILE__ FOO' >> $tmp/pp1.c
+echo '#define FOO local' > $tmp/pp2.c
+echo '#include "pp-hdr.h"' >> $tmp/pp2.c
+echo 'two __BASE_FILE__ FOO' >> $tmp/pp2.c
+echo 'hdr' > $tmp/pp-hdr.h
+$chibicc -DFOO=cmdline -E $tmp/pp1.c $tmp/pp2.c > $tmp/pp.out
+[ "$(grep -v '^$' $tmp/pp.out | tr '\n' ' ')" = "hdr one \"$tmp/pp1.c\" cmdline hdr two \"$tmp/pp2.c\" local " ]
+check '-E with multiple files'
+
 # -I
 mkdir $tmp/dir
 echo foo > $tmp/dir/i-option-test
@@ -309,4 +328,238 @@ echo 'int main() {}' | $chibicc -c -o $tmp/baz.o -xc -
 cc -Xlinker -z -Xlinker muldefs -Xlinker --gc-sections -o $tmp/foo $tmp/foo.o $tmp/bar.o $tmp/baz.o
 check -Xlinker
 
+# Compilation cache
+echo 'int main() { return 5; }' > $tmp/cache.c
+CHIBICC_CACHE_DIR=$tmp/cache $chibicc -o $tmp/cache1 $tmp/cache.c
+CHIBICC_CACHE_DIR=$tmp/cache $chibicc -o $tmp/cache2 $tmp/cache.c
+$tmp/cache2
+[ $? -eq 5 ]
+check 'compilation cache'
+CHIBICC_CACHE_DIR=$tmp/cache $chibicc -cache-stats | grep -q 'hits: *1$'
+check 'compilation cache: hit'
+echo 'int main() { return 6; }' > $tmp/cache.c
+CHIBICC_CACHE_DIR=$tmp/cache $chibicc -o $tmp/cache2 $tmp/cache.c
+$tmp/cache2
+[ $? -eq 6 ]
+check 'compilation cache: miss'
+CHIBICC_CACHE_DIR=$tmp/cache $chibicc -cache-stats | grep -q 'misses: *2$'
+check 'compilation cache: miss'
+echo 'int main() { return 7; }' > $tmp/cache.c
+CHIBICC_CACHE_DIR=$tmp/cache CHIBICC_CACHE_SIZE=1 $chibicc -c -o $tmp/cache.o $tmp/cache.c
+[ -z "$(find $tmp/cache -name '*.[so]')" ]
+check 'compilation cache: eviction'
+echo 'int f(int x) { volatile int a = x; return a; }' > $tmp/cache.c
+CHIBICC_CACHE_DIR=$tmp/fcache $chibicc -O1 -c -o $tmp/cache1.o $tmp/cache.c
+CHIBICC_CACHE_DIR=$tmp/fcache $chibicc -O1 -mno-red-zone -c -o $tmp/cache2.o $tmp/cache.c
+CHIBICC_CACHE_DIR=$tmp/fcache $chibicc -O1 -fno-omit-frame-pointer -c -o $tmp/cache3.o $tmp/cache.c
+! cmp -s $tmp/cache1.o $tmp/cache2.o && ! cmp -s $tmp/cache1.o $tmp/cache3.o
+check 'compilation cache: code generation flags'
+CHIBICC_CACHE_DIR=$tmp/fcache $chibicc -cache-stats | grep -q 'misses: *3$'
+check 'compilation cache: code generation flags'
+
+# Compilation cache: direct mode
+mkdir -p $tmp/direct1 $tmp/direct2
+echo '#define VAL 3' > $tmp/direct2/direct.h
+echo '#include "direct.h"
+int main() { return VAL; }' > $tmp/direct2/direct.c
+touch -d '-1 minute' $tmp/direct2/direct.h $tmp/direct2/direct.c
+CHIBICC_CACHE_DIR=$tmp/dcache $chibicc -I$tmp/direct1 -I$tmp/direct2 -o $tmp/direct $tmp/direct2/direct.c
+CHIBICC_CACHE_DIR=$tmp/dcache $chibicc -I$tmp/direct1 -I$tmp/direct2 -o $tmp/direct $tmp/direct2/direct.c
+$tmp/direct
+[ $? -eq 3 ]
+check 'compilation cache: direct mode'
+CHIBICC_CACHE_DIR=$tmp/dcache $chibicc -cache-stats | grep -q 'direct hits: *1$'
+check 'compilation cache: direct mode'
+echo '#define VAL 4' > $tmp/direct2/direct.h
+CHIBICC_CACHE_DIR=$tmp/dcache $chibicc -I$tmp/direct1 -I$tmp/direct2 -o $tmp/direct $tmp/direct2/direct.c
+$tmp/direct
+[ $? -eq 4 ]
+check 'compilation cache: direct mode: modified header'
+CHIBICC_CACHE_DIR=$tmp/dcache $chibicc -I$tmp/direct1 -I$tmp/direct2 -o $tmp/direct $tmp/direct2/direct.c
+CHIBICC_CACHE_DIR=$tmp/dcache $chibicc -cache-stats | grep -q 'direct hits: *1$'
+check 'compilation cache: direct mode: recently modified header'
+rm $tmp/direct2/direct.h
+echo '#include <direct.h>
+int main() { return VAL; }' > $tmp/direct.c
+echo '#define VAL 5' > $tmp/direct2/direct.h
+CHIBICC_CACHE_DIR=$tmp/dcache $chibicc -I$tmp/direct1 -I$tmp/direct2 -o $tmp/direct $tmp/direct.c
+echo '#define VAL 6' > $tmp/direct1/direct.h
+CHIBICC_CACHE_DIR=$tmp/dcache $chibicc -I$tmp/direct1 -I$tmp/direct2 -o $tmp/direct $tmp/direct.c
+$tmp/direct
+[ $? -eq 6 ]
+check 'compilation cache: direct mode: new header'
+
+# -emit-ir
+echo 'int add(int x, int y) { return x + y; }' | $chibicc -emit-ir -o- -xc - | grep -q 'add.32'
+check -emit-ir
+echo 'double f(double x) { return x; }' | $chibicc -emit-ir -o- -xc - | grep -q 'not lowered'
+check '-emit-ir: fallback'
+
+# -O1
+echo 'int g; int f(int x) { if (0) g = 1; return x * 1 + (2 + 3) * 4; }' | \
+  $chibicc -O1 -emit-ir -o- -xc - > $tmp/out
+grep -q 'imm 20' $tmp/out && ! grep -q 'mul\|gvar\|br' $tmp/out
+check '-O1: constant folding'
+echo 'int f(int x) { int y = x; y = 3; return 5; }' | $chibicc -O1 -emit-ir -o- -xc - | grep -q store
+[ $? -ne 0 ]
+check '-O1: dead stores'
+echo 'static int sq(int x) { return x * x; } int f(int x) { return sq(x) + 1; }' | \
+  $chibicc -O1 -S -o- -xc - | grep -q call
+[ $? -ne 0 ]
+check '-O1: inlining'
+echo '__attribute__((noinline)) static int sq(int x) { return x * x; } int f(int x) { return sq(x); }' | \
+  $chibicc -O1 -S -o- -xc - | grep -qE '(call|jmp) sq'
+check '-O1: noinline'
+
+# Peephole optimizer
+echo 'double f(double x) { return x; }' | $chibicc -O1 -peephole-stats -S -o $tmp/out -xc - 2>&1 | \
+  grep -q 'jmp-next *1'
+check '-O1: peephole stats'
+! grep -q 'jmp .L.return' $tmp/out
+check '-O1: peephole'
+echo 'double f(double x) { asm("jmp 1f\n 1:"); return x; }' | $chibicc -O1 -S -o- -xc - | grep -q 'jmp 1f'
+check '-O1: peephole: inline asm'
+
+# Conditions
+echo 'int g(void); int f(int a, int b, int c) { if (a < b && c) return g(); return 0; }' | \
+  $chibicc -O1 -S -o- -xc - | grep -q 'set'
+[ $? -ne 0 ]
+check '-O1: branch on condition'
+echo 'int g(void); int f(double a, double b, int c) { if (a < b && c) return g(); return 0; }' | \
+  $chibicc -S -o- -xc - | grep -q 'set'
+[ $? -ne 0 ]
+check 'branch on condition'
+
+# Atomics
+echo 'int x; void f(int v) { __atomic_store_n(&x, v, __ATOMIC_RELEASE); __atomic_thread_fence(__ATOMIC_ACQ_REL); }' | \
+  $chibicc -O1 -S -o- -xc - | grep -Eq 'xchg|mfence'
+[ $? -ne 0 ]
+check 'atomic: release store'
+echo 'int x; void f(int v) { __atomic_store_n(&x, v, __ATOMIC_SEQ_CST); }' | \
+  $chibicc -O1 -S -o- -xc - | grep -q 'xchg'
+check 'atomic: seq_cst store'
+echo 'void f(void) { __atomic_thread_fence(__ATOMIC_SEQ_CST); }' | \
+  $chibicc -O1 -S -o- -xc - | grep -q 'mfence'
+check 'atomic: seq_cst fence'
+echo 'int f(int *p) { return __atomic_load_n(p, __ATOMIC_RELEASE); }' | \
+  $chibicc -S -o /dev/null -xc - 2>&1 | grep -q 'invalid memory model'
+check 'atomic: invalid load order'
+echo 'void f(int *p) { __atomic_store_n(p, 1, __ATOMIC_ACQUIRE); }' | \
+  $chibicc -O1 -S -o- -xc - 2>/dev/null | grep -q 'xchg'
+check 'atomic: invalid store order'
+
+# Case values
+echo 'int f(int x) { switch (x) { case 0x100000000L: case 0: return 1; } return 0; }' | \
+  $chibicc -S -o- -xc - 2>&1 | grep -q 'duplicate case value'
+check 'switch: duplicate case value'
+echo 'int f(long x) { switch (x) { case 0x100000000L: case 0: return 1; } return 0; }' | \
+  $chibicc -S -o /dev/null -xc -
+check 'switch: long case value'
+
+# Tail calls
+cat <<EOF > $tmp/tail.c
+int odd(long n);
+int even(long n) { return n == 0 ? 1 : odd(n - 1); }
+int odd(long n) { return n == 0 ? 0 : even(n - 1); }
+long sum(long n, long acc) { return n ? sum(n - 1, acc + n) : acc; }
+int main() { return even(100000001) + (sum(100000000, 0) != 5000000050000000); }
+EOF
+$chibicc -O1 -o $tmp/tail $tmp/tail.c && $tmp/tail
+check '-O1: tail call'
+echo 'int g(int *p); int f(int x) { int y = x; return g(&y); }' | \
+  $chibicc -O1 -S -o- -xc - | grep -q 'jmp g'
+[ $? -ne 0 ]
+check '-O1: tail call: escaping local'
+
+# Huge functions
+{
+  echo 'int f(int x) { int a = 0;'
+  seq 0 19999 | sed 's/.*/  if (x == &) a += &;/'
+  echo '  return a; } int main() { return f(5) != 5; }'
+} > $tmp/huge.c
+$chibicc -o $tmp/huge $tmp/huge.c && $tmp/huge
+check 'huge function'
+$chibicc -O1 -o $tmp/huge $tmp/huge.c && $tmp/huge
+check '-O1: huge function'
+
+# Frame pointer
+echo 'int f(int x) { return x + 1; }' | $chibicc -S -o- -xc - > $tmp/out
+grep -q 'push %rbp' $tmp/out && ! grep -q 'mov %rsp, -' $tmp/out
+check 'frame pointer'
+echo 'int f(int x) { return x + 1; }' | $chibicc -O1 -S -o- -xc - | grep -q 'rbp\|rsp'
+[ $? -ne 0 ]
+check '-O1: leaf function without frame'
+echo 'int g(int); int f(int x) { return g(x) + 1; }' | $chibicc -fomit-frame-pointer -S -o- -xc - | grep -q rbp
+[ $? -ne 0 ]
+check -fomit-frame-pointer
+echo 'long g(long, long, long, long, long, long, long *, long); long f(long x) { return g(x, x, x, x, x, x, &x, x) + 1; }' | \
+  $chibicc -O1 -S -o- -xc - | grep -q rbp
+[ $? -ne 0 ]
+check '-fomit-frame-pointer: stack arguments'
+echo 'int f(int x) { return x + 1; }' | $chibicc -O1 -fno-omit-frame-pointer -S -o- -xc - | grep -q 'push %rbp'
+check -fno-omit-frame-pointer
+echo 'int f(int x) { int a[4] = {x}; return a[x & 3]; }' | $chibicc -O1 -mno-red-zone -S -o- -xc - | grep -q 'sub $.*, %rsp'
+check -mno-red-zone
+
+# Stack slot sharing
+echo 'void g(char *); void f(void) { { char a[1000]; g(a); } { char b[1000]; g(b); } }' | \
+  $chibicc -S -o- -xc - | grep -q 'sub $1008, %rsp'
+check 'stack slot sharing'
+
+# Builtin memcpy, memset, memcmp and strlen
+echo 'void *memcpy(void *, void *, unsigned long); void f(long *p, long *q) { memcpy(p, q, 16); }' | \
+  $chibicc -S -o- -xc - | grep -q 'call'
+[ $? -ne 0 ]
+check 'builtin memcpy'
+echo 'void *memcpy(void *, void *, unsigned long); void f(long *p, long *q) { memcpy(p, q, 1000); }' | \
+  $chibicc -S -o- -xc - | grep -q 'call memcpy'
+check 'builtin memcpy: large size'
+echo 'void f(char *p, int n) { __builtin_memset(p, 0, n); }' | $chibicc -S -o- -xc - | grep -q 'call memset'
+check 'builtin memset: variable size'
+
+# always_inline
+echo 'static __attribute__((always_inline)) int sq(int x) { return x * x; } int f(int x) { return sq(x); }' | \
+  $chibicc -S -o- -xc - | grep -q call
+[ $? -ne 0 ]
+check always_inline
+
+# Compile server
+$chibicc -server $tmp/server.sock &
+server_pid=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do [ -S $tmp/server.sock ] && break; sleep 0.1; done
+echo '#define VAL 3' > $tmp/server.h
+echo '#include "server.h"
+int main() { return VAL; }' > $tmp/server.c
+(cd $tmp; CHIBICC_SERVER=$tmp/server.sock $OLDPWD/$chibicc -o server server.c)
+$tmp/server
+[ $? -eq 3 ]
+check 'compile server'
+# The server fills its cache after replying, and it finishes doing so
+# before it accepts the next request.
+(cd $tmp; CHIBICC_SERVER=$tmp/server.sock $OLDPWD/$chibicc -o server server.c)
+touch -r $tmp/server.h $tmp/server.ref
+echo '#define VAL 5' > $tmp/server.h
+touch -r $tmp/server.ref $tmp/server.h
+(cd $tmp; CHIBICC_SERVER=$tmp/server.sock $OLDPWD/$chibicc -o server server.c)
+$tmp/server
+[ $? -eq 3 ]
+check 'compile server: cached header'
+echo '#define VAL 4' > $tmp/server.h
+(cd $tmp; CHIBICC_SERVER=$tmp/server.sock $OLDPWD/$chibicc -o server server.c)
+$tmp/server
+[ $? -eq 4 ]
+check 'compile server: modified header'
+echo 'int main() { return x; }' > $tmp/server.c
+CHIBICC_SERVER=$tmp/server.sock $chibicc -c -o $tmp/server.o $tmp/server.c 2>&1 | grep -q 'undefined variable'
+check 'compile server: diagnostics'
+CHIBICC_SERVER=$tmp/server.sock $chibicc -c -o $tmp/server.o $tmp/server.c 2> /dev/null
+[ $? -ne 0 ]
+check 'compile server: exit status'
+echo 'int main() { return 0; }' > $tmp/server.c
+CHIBICC_SERVER=$tmp/server.sock CHIBICC_CACHE_DIR=$tmp/scache $chibicc -c -o $tmp/server.o $tmp/server.c
+CHIBICC_CACHE_DIR=$tmp/scache $chibicc -cache-stats | grep -q 'misses: *1$'
+check 'compile server: environment'
+kill $server_pid
+wait $server_pid 2> /dev/null
+
 echo OK
@@ -1,5 +1,10 @@
 #include "test.h"
 
+#define HALVE(e) ((e) - (e) * 0.5)
+
+static double fsq(double x) { return x * x; }
+static float fhalf(float x) { return x / 2; }
+
 int main() {
   ASSERT(35, (float)(char)35);
   ASSERT(35, (float)(short)35);
@@ -80,6 +85,16 @@ int main() {
   ASSERT(0, 0.0/0.0 > 0);
   ASSERT(0, 0.0/0.0 >= 0);
 
+  ASSERT(0, ({ double x=0.0/0.0; x == x ? 1 : 0; }));
+  ASSERT(1, ({ double x=0.0/0.0; x != x ? 1 : 0; }));
+  ASSERT(0, ({ double x=0.0/0.0; x < 1 || x <= 1 ? 1 : 0; }));
+  ASSERT(1, ({ double x=0.0/0.0; !(x < 1) && !(x >= 1) ? 1 : 0; }));
+  ASSERT(1, ({ double x=1, y=1; x == y ? 1 : 0; }));
+  ASSERT(0, ({ double x=1, y=1; x != y ? 1 : 0; }));
+  ASSERT(1, ({ float x=1, y=2; int i=0; if (x < y && y <= 2) i=1; i; }));
+  ASSERT(3, ({ double x=0; int i=0; while (x < 3) { x += 1; i++; } i; }));
+  ASSERT(2, ({ double x=0.0/0.0; int i=0; do i++; while (x != x && i < 2); i; }));
+
   ASSERT(0, !3.);
   ASSERT(1, !0.);
   ASSERT(0, !3.f);
@@ -88,6 +103,22 @@ int main() {
   ASSERT(5, 0.0 ? 3 : 5);
   ASSERT(3, 1.2 ? 3 : 5);
 
+  ASSERT(1, (unsigned long)1e19 == 10000000000000000000UL);
+  ASSERT(1, (unsigned long)1e19f == 9999999980506447872UL);
+  ASSERT(1, (unsigned long)(double)(1UL << 63) == 1UL << 63);
+  ASSERT(1, (unsigned long)(float)(1UL << 63) == 1UL << 63);
+  ASSERT(1, (float)18446744073709551615UL == 18446744073709551616.0f);
+  ASSERT(1, (float)0x8000008000000001UL == 9223373136366403584.0f);
+
+  ASSERT(6, ({ double x=3; HALVE(HALVE(HALVE(HALVE(HALVE(HALVE(HALVE(HALVE(HALVE(x))))))))) * 1024; }));
+  ASSERT(30, fsq(1) + (fsq(2) + (fsq(3) + fsq(4))));
+  ASSERT(15, fhalf(3) * fhalf(5) * 4);
+  ASSERT(1, fsq(2) < fsq(3));
+  ASSERT(0, ({ double n=0.0/0.0, y=1; (y < n) + (y <= n) + (y == n) + (n < y) + (n <= y); }));
+  ASSERT(1, ({ double n=0.0/0.0, y=1; y != n; }));
+  ASSERT(1, ({ float a=1.5, b=2.25; a * b == 3.375f; }));
+  ASSERT(1, ({ double a=7, b=2; a / b - b == 1.5; }));
+
   printf("OK\n");
   return 0;
 }
@@ -177,6 +177,13 @@ Ty6 struct_test26(void);
 Ty20 struct_test27(void);
 Ty21 struct_test28(void);
 
+typedef struct { unsigned char a[15]; } Ty22;
+typedef struct { float f; unsigned char a[3]; } Ty23;
+
+Ty22 struct_test29(void);
+int struct_test30(Ty22 x, int n);
+Ty23 struct_test31(void);
+
 Ty4 struct_test34(void) {
   return (Ty4){10, 20, 30, 40};
 }
@@ -197,6 +204,18 @@ Ty21 struct_test38(void) {
   return (Ty21){1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20};
 }
 
+Ty22 struct_test39(void) {
+  return (Ty22){1,2,3,4,5,6,7,8,9,10,11,12,13,14,15};
+}
+
+int struct_test40(Ty22 x, int n) {
+  return x.a[n];
+}
+
+Ty23 struct_test41(void) {
+  return (Ty23){1.5, {10, 20, 30}};
+}
+
 inline int inline_fn(void) {
   return 3;
 }
@@ -209,6 +228,37 @@ long double to_ldouble(int x) {
   return x;
 }
 
+int tail_perm(int a, int b, int c, int n) {
+  return n ? tail_perm(c, a, b, n - 1) : a * 100 + b * 10 + c;
+}
+
+long tail_sum(long n, long acc) {
+  if (n == 0)
+    return acc;
+  return tail_sum(n - 1, acc + n);
+}
+
+int tail_odd(int n);
+int tail_even(int n) { return n == 0 ? 1 : tail_odd(n - 1); }
+int tail_odd(int n) { return n == 0 ? 0 : tail_even(n - 1); }
+
+int (*tail_fp)(int) = tail_even;
+int tail_ptr(int n) { return tail_fp(n); }
+
+char tail_char(int x) { return x; }
+int tail_widen(int x) { return tail_char(x); }
+unsigned char tail_uchar(int x) { return x; }
+unsigned char tail_same(int x) { return tail_uchar(x); }
+
+int tail_deref(int *p) { return *p; }
+int tail_local(int x) { int y = x + 1; return tail_deref(&y); }
+
+int tail_7(int a, int b, int c, int d, int e, int f, int g) { return a + b + c + d + e + f + g; }
+int tail_stack(int x) { return tail_7(x, x, x, x, x, x, x + 1); }
+
+void tail_set(int *p, int x) { *p = x; }
+void tail_void(int *p, int x) { tail_set(p, x * 2); }
+
 int main() {
   ASSERT(3, ret3());
   ASSERT(8, add2(3, 5));
@@ -375,6 +425,18 @@ int main() {
   ASSERT(15, struct_test38().a[14]);
   ASSERT(20, struct_test38().a[19]);
 
+  ASSERT(1, struct_test29().a[0]);
+  ASSERT(7, struct_test29().a[6]);
+  ASSERT(9, struct_test29().a[8]);
+  ASSERT(15, struct_test29().a[14]);
+  ASSERT(14, struct_test30(struct_test39(), 13));
+  ASSERT(15, struct_test40(struct_test29(), 14));
+  ASSERT(8, struct_test40(struct_test39(), 7));
+  ASSERT(30, struct_test31().a[2]);
+  ASSERT(3, struct_test31().f * 2);
+  ASSERT(30, struct_test41().a[2]);
+  ASSERT(3, struct_test41().f * 2);
+
   ASSERT(5, (***add2)(2,3));
 
   ASSERT(3, inline_fn());
@@ -390,5 +452,16 @@ int main() {
   ASSERT(1, to_ldouble(5.0) == 5.0);
   ASSERT(0, to_ldouble(5.0) == 5.2);
 
+  ASSERT(312, tail_perm(1, 2, 3, 4));
+  ASSERT(5050, tail_sum(100, 0));
+  ASSERT(1, tail_even(10000));
+  ASSERT(1, tail_odd(10001));
+  ASSERT(0, tail_ptr(77));
+  ASSERT(44, tail_widen(300));
+  ASSERT(255, tail_same(-1));
+  ASSERT(6, tail_local(5));
+  ASSERT(8, tail_stack(1));
+  ASSERT(14, ({ int x; tail_void(&x, 7); x; }));
+
   printf("OK\n");
 }
@@ -38,6 +38,50 @@ typedef struct { char a, b[]; } T65;
 T65 g65 = {'f','o','o',0};
 T65 g66 = {'f','o','o','b','a','r',0};
 
+// Fill the stack below the caller with garbage, so that zero-clearing
+// by the following call is visible.
+static void dirty(void) {
+  volatile char buf[1024];
+  for (int i = 0; i < 1024; i++)
+    buf[i] = i | 1;
+}
+
+static long zero1(int x) {
+  struct { char c; int i; long l; } s = {x};
+  return s.c + s.i + s.l;
+}
+
+static long zero2(int x) {
+  int a[40] = {[0]=x, [5]=2, [10]=3, [20]=4, [30]=5, [39]=6};
+  long s = 0;
+  for (int i = 0; i < 40; i++)
+    s = s * 3 + a[i];
+  return s % 1000;
+}
+
+static int zero3(int x) {
+  char buf[300] = "ab";
+  int s = 0;
+  for (int i = 0; i < 300; i++)
+    s += buf[i];
+  return s + x;
+}
+
+static int zero4(int x) {
+  struct { int a:3, b:5; short c; char d[3]; } s = {1, x, 3};
+  return s.a + s.b + s.c + s.d[0] + s.d[1] + s.d[2];
+}
+
+static long zero5(int x) {
+  union { char c; long l; } u = {x};
+  return u.l;
+}
+
+static int zero6(int x) {
+  struct { long double f; int i; } s = {x};
+  return !memcmp((char *)&s + 10, "\0\0\0\0\0\0\0\0\0\0", 10);
+}
+
 int main() {
   ASSERT(1, ({ int x[3]={1,2,3}; x[0]; }));
   ASSERT(2, ({ int x[3]={1,2,3}; x[1]; }));
@@ -262,6 +306,13 @@ int main() {
   ASSERT(16, ({ char x[]={[2 ... 10]='a', [7]='b', [15 ... 15]='c', [3 ... 5]='d'}; sizeof(x); }));
   ASSERT(0, ({ char x[]={[2 ... 10]='a', [7]='b', [15 ... 15]='c', [3 ... 5]='d'}; memcmp(x, "\0\0adddabaaa\0\0\0\0c", 16); }));
 
+  ASSERT(7, ({ dirty(); zero1(7); }));
+  ASSERT(343, ({ dirty(); zero2(1); }));
+  ASSERT(198, ({ dirty(); zero3(3); }));
+  ASSERT(6, ({ dirty(); zero4(2); }));
+  ASSERT(9, ({ dirty(); zero5(9); }));
+  ASSERT(1, ({ dirty(); zero6(9); }));
+
   printf("OK\n");
   return 0;
 }
@@ -0,0 +1,110 @@
+#include "test.h"
+
+typedef struct { int x, y; } Point;
+
+static int g;
+
+static int add(int x, int y) { return x + y; }
+static int get_x(Point *p) { return p->x; }
+static void set_g(int x) { g = x; }
+static char to_char(int x) { return x; }
+static unsigned char to_uchar(int x) { return x; }
+
+static inline int sign(long x) {
+  if (x < 0)
+    return -1;
+  if (x > 0)
+    return 1;
+  return 0;
+}
+
+static inline int sum_to(int n) {
+  int s = 0;
+  for (int i = 1; i <= n; i++)
+    s += i;
+  return s;
+}
+
+static inline int swap_sum(int a, int b) {
+  int t[2] = {a, b};
+  int *p = &a;
+  *p = t[1];
+  return a * 10 + t[0];
+}
+
+static inline int classify(int x) {
+  switch (x) {
+  case 0: return 10;
+  case 1: return 11;
+  case 2: return 12;
+  case 3: return 13;
+  default: return -1;
+  }
+}
+
+static inline int twice(int x) { return add(x, x); }
+static int nested(int x) { return twice(twice(x)) + sign(x); }
+
+static inline int fact(int n) {
+  return n <= 1 ? 1 : n * fact(n - 1);
+}
+
+static inline __attribute__((always_inline)) int digits(unsigned long x) {
+  int n = 0;
+  char buf[20];
+  do {
+    buf[n++] = x % 10;
+    x /= 10;
+  } while (x);
+  int s = 0;
+  for (int i = 0; i < n; i++)
+    s = s * 2 + buf[i];
+  return s * 100 + n;
+}
+
+static int fib(int n) { return n < 2 ? n : fib(n - 1) + fib(n - 2); }
+
+static int count;
+static int __attribute__((noinline)) bump(void) { return ++count; }
+static int bump2(void) __attribute__((noinline));
+static int bump2(void) { return count += 2; }
+
+static int early(int *p) {
+  if (!p)
+    return -1;
+  return *p;
+}
+
+int main() {
+  Point pt = {3, 4};
+  int z = 7;
+
+  ASSERT(5, add(2, 3));
+  ASSERT(3, get_x(&pt));
+  set_g(9);
+  ASSERT(9, g);
+  ASSERT(-1, to_char(255));
+  ASSERT(255, to_uchar(-1));
+  ASSERT(-1, sign(-5));
+  ASSERT(0, sign(0));
+  ASSERT(1, sign(1L << 40));
+  ASSERT(55, sum_to(10));
+  ASSERT(21, swap_sum(1, 2));
+  ASSERT(12, classify(2));
+  ASSERT(-1, classify(7));
+  ASSERT(21, nested(5));
+  ASSERT(-21, nested(-5));
+  ASSERT(120, fact(5));
+  ASSERT(55, fib(10));
+  ASSERT(1703, digits(123));
+  ASSERT(1, digits(0));
+  ASSERT(1, bump());
+  ASSERT(3, bump2());
+  ASSERT(-1, early(0));
+  ASSERT(7, early(&z));
+  ASSERT(3, ({ int (*fp)(int, int) = add; fp(1, 2); }));
+  ASSERT(32, ({ int s = 0; for (int i = 0; i < 4; i++) s += add(i, sum_to(i)) * 2; s; }));
+
+  printf("OK\n");
+  return 0;
+}
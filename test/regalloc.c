@@ -0,0 +1,165 @@
+#include "test.h"
+
+static int id(int x) { return x; }
+
+static long weigh6(long a, long b, long c, long d, long e, long f) {
+  return a + b * 10 + c * 100 + d * 1000 + e * 10000 + f * 100000;
+}
+
+static long weigh8(long a, long b, long c, long d, long e, long f, long g, long h) {
+  return weigh6(a, b, c, d, e, f) + g * 1000000 + h * 10000000;
+}
+
+static long args(int x) {
+  return weigh6(x+1, x+2, x+3, x+4, x+5, x+6);
+}
+
+static long args_rev(int x) {
+  long a = weigh6(x+6, x+5, x+4, x+3, x+2, x+1);
+  return a + weigh6(id(x+6), x+5, id(x+4), x+3, id(x+2), x+1);
+}
+
+static long stack_args(int x) {
+  return weigh8(x, x+1, x+2, x+3, x+4, x+5, x+6, id(x+7));
+}
+
+static long deref8(long a, long b, long c, long d, long e, long f, long *g, long *h) {
+  return a + *g * 10 + *h * 100;
+}
+
+// The addresses of locals are computed while arguments are pushed.
+static long stack_addrs(int x) {
+  long y = x + 1, z = x + 2;
+  return deref8(x, 0, 0, 0, 0, 0, &y, &z);
+}
+
+static long across_calls(void) {
+  return id(1) + (id(2) + (id(3) + (id(4) + (id(5) + (id(6) + (id(7) +
+    (id(8) + (id(9) + (id(10) + (id(11) * id(12)))))))))));
+}
+
+static long pressure(int x) {
+  return (((x+1)*(x+2) - (x+3)*(x+4)) * ((x+5)*(x+6) - (x+7)*(x+8))) -
+    (((x+9)*(x+10) - (x+11)*(x+12)) * ((x+13)*(x+14) - (x+15)*(x+16))) +
+    ((((x+1)*(x+2)) ^ ((x+3)*(x+4))) | (((x+5)<<(x+6)) & ((x+7)>>(x&3))));
+}
+
+static int classify(int x) {
+  switch (x) {
+  case 0 ... 9: return 1;
+  case 10: return 2;
+  case 'a' ... 'z': return 3;
+  case -5: return 4;
+  default: return 5;
+  }
+}
+
+static int logic(int x, int y) {
+  return (x && y) + (x || y) * 2 + !x * 4 + (x > y ? 8 : 16);
+}
+
+static int narrow(int x) {
+  char c = x;
+  unsigned char uc = x;
+  short s = x;
+  unsigned short us = x;
+  return c + uc + s + us;
+}
+
+// Shifts and `~` have the type of their operand, so the result must
+// be truncated when it is written back.
+static int shift_byte(int x) {
+  unsigned char u = x;
+  u = u << 1;
+  return u;
+}
+
+static int not_byte(int x) {
+  unsigned char u = x;
+  u = ~u;
+  return u;
+}
+
+static int wrap(int x) {
+  unsigned short us = x;
+  signed char c = x;
+  unsigned char uc = x;
+  us <<= 1;
+  c += 100;
+  uc++;
+  c = c << 1;
+  return us * 1000 + c * 10 + uc;
+}
+
+static int crc8(unsigned char *p, int n) {
+  unsigned char crc = 0;
+  for (int i = 0; i < n; i++) {
+    crc ^= p[i];
+    for (int j = 0; j < 8; j++)
+      crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+  }
+  return crc;
+}
+
+static long divide(long x, int y) {
+  unsigned u = x;
+  return x / y + x % y + u / 3 + u % 7 + (x >> 2) + ((unsigned long)x >> 60);
+}
+
+static int copy_in_loop(int n) {
+  int x, s = 0;
+  for (int i = 0; i < n; i++) {
+    int a = id(i * 10 + 1);
+    if (i == 0)
+      x = a;
+    else
+      s += x;
+  }
+  return s;
+}
+
+static long params(char c, unsigned char uc, short s, _Bool b, long x, int y, int z, long w) {
+  long t = x;
+  x = y;
+  y = z;
+  z = t;
+  return c + uc + s + b + x * 10 + y * 100 + z * 1000 + w * 10000;
+}
+
+static int addr_param(int x) {
+  int *p = &x;
+  *p += 1;
+  return x;
+}
+
+int main() {
+  ASSERT(654321, args(0));
+  ASSERT(469134, args_rev(1));
+  ASSERT(98765432, stack_args(2));
+  ASSERT(321, stack_addrs(1));
+  ASSERT(187, across_calls());
+  ASSERT(-2414, pressure(1));
+  ASSERT(1, classify(7));
+  ASSERT(2, classify(10));
+  ASSERT(3, classify('q'));
+  ASSERT(4, classify(-5));
+  ASSERT(5, classify(11));
+  ASSERT(11, logic(3, 2));
+  ASSERT(22, logic(0, 5));
+  ASSERT(10, logic(1, 0));
+  ASSERT(65788, narrow(-1));
+  ASSERT(1276, narrow(511));
+  ASSERT(144, shift_byte(200));
+  ASSERT(254, not_byte(1));
+  ASSERT(0, not_byte(255));
+  ASSERT(1462, wrap(0x8001));
+  ASSERT(65533420, wrap(32767));
+  ASSERT(244, crc8((unsigned char *)"123456789", 9));
+  ASSERT(1431655776, divide(-7, 2));
+  ASSERT(3, copy_in_loop(4));
+  ASSERT(41573, params(-1, 255, -2, 1, 1, 2, 3, 4));
+  ASSERT(6, addr_param(5));
+
+  printf("OK\n");
+  return 0;
+}
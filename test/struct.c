@@ -1,5 +1,10 @@
 #include "test.h"
 
+typedef struct { char c[300]; } Big;
+
+int big_arg(Big b) { return b.c[0] + b.c[299] + b.c[150]; }
+Big big_ret(int x) { Big b = {0}; b.c[299] = x; return b; }
+
 int main() {
   ASSERT(1, ({ struct {int a; int b;} x; x.a=1; x.b=2; x.a; }));
   ASSERT(2, ({ struct {int a; int b;} x; x.a=1; x.b=2; x.b; }));
@@ -61,6 +66,13 @@ int main() {
   ASSERT(1, ({ struct {int a;} x={1}, y={2}; (1?x:y).a; }));
   ASSERT(2, ({ struct {int a;} x={1}, y={2}; (0?x:y).a; }));
 
+  ASSERT(21, ({ struct {char c[7];} x={1,2,3,4,5,6}, y; y=x; y.c[0]+y.c[1]+y.c[2]+y.c[3]+y.c[4]+y.c[5]+y.c[6]; }));
+  ASSERT(61, ({ struct {char c[31];} x={{[29]=30,[30]=31}}, y; y=x; y.c[29]+y.c[30]+y.c[0]; }));
+  ASSERT(127, ({ struct {char c[131];} x={{[0]=1,[127]=2,[130]=124}}, y; y=x; y.c[0]+y.c[127]+y.c[130]; }));
+  ASSERT(12, ({ struct {long l[37]; short s[3];} x={{[36]=5},{1,2,4}}, y; y=x; y.l[36]+y.s[0]+y.s[1]+y.s[2]; }));
+  ASSERT(7, big_arg((Big){{[0]=3,[299]=4}}));
+  ASSERT(9, ({ Big b=big_ret(9); b.c[299]; }));
+
   printf("OK\n");
   return 0;
 }
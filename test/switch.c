@@ -0,0 +1,268 @@
+#include "test.h"
+
+static int dense(int x) {
+  switch (x) {
+  case 0: return 10;
+  case 1: return 11;
+  case 2: return 12;
+  case 4: return 14;
+  case 5: return 15;
+  case 6 ... 8: return 16;
+  case 10: return 20;
+  default: return -1;
+  }
+}
+
+static int sparse(int x) {
+  switch (x) {
+  case -1000: return 1;
+  case -7: return 2;
+  case 3: return 3;
+  case 100: return 4;
+  case 1000 ... 1010: return 5;
+  case 50000: return 6;
+  case 1 << 30: return 7;
+  }
+  return 0;
+}
+
+static int fallthrough(int x) {
+  int n = 0;
+  switch (x) {
+  case 1: n++;
+  case 2: n++;
+  case 3: n++;
+  case 5: n++;
+  case 7: n++;
+  default: n += 10;
+  case 8: n++;
+  }
+  return n;
+}
+
+static int sparse_unsigned(unsigned x) {
+  switch (x) {
+  case 0: return 1;
+  case 5: return 2;
+  case 0x7fffffff: return 3;
+  case 0x80000000: return 4;
+  case 0xfffffff0 ... 0xfffffffe: return 5;
+  case 0xffffffff: return 6;
+  }
+  return 0;
+}
+
+static int sparse_long(long x) {
+  switch (x) {
+  case -100000: return 1;
+  case -1: return 2;
+  case 0: return 3;
+  case 70000: return 4;
+  case 2147483647: return 5;
+  }
+  return 0;
+}
+
+static int dense_char(char c) {
+  switch (c) {
+  case 'a': return 1;
+  case 'b': return 2;
+  case 'c': return 3;
+  case 'e': return 5;
+  case 'f': return 6;
+  case -1: return 7;
+  }
+  return 0;
+}
+
+// Case values are not truncated to int.
+static int wide_long(long x) {
+  switch (x) {
+  case 0x100000000L: return 1;
+  case 0: return 2;
+  case -9223372036854775807L - 1: return 3;
+  case -1: return 4;
+  case 0x7fffffffffffffffL: return 5;
+  case 0x200000000L ... 0x200000003L: return 6;
+  }
+  return 0;
+}
+
+static int wide_table(long x) {
+  switch (x) {
+  case 0x100000000L: return 1;
+  case 0x100000001L: return 2;
+  case 0x100000002L: return 3;
+  case 0x100000004L: return 4;
+  case 0x100000005L: return 5;
+  }
+  return 0;
+}
+
+static int wide_unsigned(unsigned x) {
+  switch (x) {
+  case 0x7ffffff0 ... 0x80000010: return 1;
+  case 0: return 2;
+  case 0xffffffff: return 3;
+  }
+  return 0;
+}
+
+static int wide_ulong(unsigned long x) {
+  switch (x) {
+  case 0xffffffffffffffffUL: return 1;
+  case 0x8000000000000000UL ... 0x8000000000000005UL: return 2;
+  case 0: return 3;
+  case 0x7fffffffffffffffUL: return 4;
+  }
+  return 0;
+}
+
+// Floating-point numbers are compiled from the AST.
+static int dense_double(int x, double d) {
+  switch (x) {
+  case 0: return d;
+  case 1: return d + 1;
+  case 2: return d + 2;
+  case 3 ... 5: return d + 3;
+  case 7: return d + 7;
+  }
+  return -1;
+}
+
+static int sparse_double(int x, double d) {
+  switch (x) {
+  case -1000: return d;
+  case -7: return d + 1;
+  case 3: return d + 2;
+  case 100: return d + 3;
+  case 1000 ... 1010: return d + 4;
+  case 50000: return d + 5;
+  }
+  return -1;
+}
+
+static int wide_long_double(long x, double d) {
+  switch (x) {
+  case 0x100000000L: return d + 1;
+  case 0: return d + 2;
+  case -9223372036854775807L - 1: return d + 3;
+  case -1: return d + 4;
+  case 0x200000000L ... 0x200000003L: return d + 6;
+  }
+  return d;
+}
+
+static int wide_table_double(long x, double d) {
+  switch (x) {
+  case 0x100000000L: return d + 1;
+  case 0x100000001L: return d + 2;
+  case 0x100000002L: return d + 3;
+  case 0x100000004L: return d + 4;
+  }
+  return d;
+}
+
+static int sum(int (*fn)(int), int lo, int hi) {
+  int n = 0;
+  for (int i = lo; i <= hi; i++)
+    n += fn(i) * (i - lo + 1);
+  return n;
+}
+
+int main() {
+  ASSERT(10, dense(0));
+  ASSERT(14, dense(4));
+  ASSERT(-1, dense(3));
+  ASSERT(16, dense(7));
+  ASSERT(20, dense(10));
+  ASSERT(-1, dense(11));
+  ASSERT(-1, dense(-1));
+  ASSERT(1148, sum(dense, -3, 13));
+
+  ASSERT(1, sparse(-1000));
+  ASSERT(2, sparse(-7));
+  ASSERT(3, sparse(3));
+  ASSERT(4, sparse(100));
+  ASSERT(5, sparse(1005));
+  ASSERT(0, sparse(1011));
+  ASSERT(6, sparse(50000));
+  ASSERT(7, sparse(1 << 30));
+  ASSERT(0, sparse(4));
+
+  ASSERT(16, fallthrough(1));
+  ASSERT(14, fallthrough(3));
+  ASSERT(11, fallthrough(4));
+  ASSERT(1, fallthrough(8));
+  ASSERT(569, sum(fallthrough, 0, 9));
+
+  ASSERT(1, sparse_unsigned(0));
+  ASSERT(2, sparse_unsigned(5));
+  ASSERT(3, sparse_unsigned(0x7fffffff));
+  ASSERT(4, sparse_unsigned(0x80000000));
+  ASSERT(5, sparse_unsigned(0xfffffff5));
+  ASSERT(6, sparse_unsigned(-1));
+  ASSERT(0, sparse_unsigned(6));
+
+  ASSERT(1, sparse_long(-100000));
+  ASSERT(2, sparse_long(-1));
+  ASSERT(3, sparse_long(0));
+  ASSERT(4, sparse_long(70000));
+  ASSERT(5, sparse_long(2147483647));
+  ASSERT(0, sparse_long(4294967295));
+
+  ASSERT(1, dense_char('a'));
+  ASSERT(0, dense_char('d'));
+  ASSERT(6, dense_char('f'));
+  ASSERT(7, dense_char(255));
+
+  ASSERT(10, dense_double(0, 10));
+  ASSERT(13, dense_double(4, 10));
+  ASSERT(-1, dense_double(6, 10));
+  ASSERT(17, dense_double(7, 10));
+  ASSERT(-1, dense_double(8, 10));
+
+  ASSERT(10, sparse_double(-1000, 10));
+  ASSERT(12, sparse_double(3, 10));
+  ASSERT(14, sparse_double(1010, 10));
+  ASSERT(15, sparse_double(50000, 10));
+  ASSERT(-1, sparse_double(4, 10));
+
+  ASSERT(1, wide_long(0x100000000L));
+  ASSERT(2, wide_long(0));
+  ASSERT(3, wide_long(-9223372036854775807L - 1));
+  ASSERT(4, wide_long(-1));
+  ASSERT(5, wide_long(0x7fffffffffffffffL));
+  ASSERT(6, wide_long(0x200000002L));
+  ASSERT(0, wide_long(0xffffffffL));
+  ASSERT(0, wide_long(0x200000004L));
+  ASSERT(1, wide_table(0x100000000L));
+  ASSERT(3, wide_table(0x100000002L));
+  ASSERT(0, wide_table(0x100000003L));
+  ASSERT(5, wide_table(0x100000005L));
+  ASSERT(0, wide_table(0));
+  ASSERT(1, wide_unsigned(0x7fffffff));
+  ASSERT(1, wide_unsigned(0x80000000));
+  ASSERT(1, wide_unsigned(0x80000010));
+  ASSERT(0, wide_unsigned(0x80000011));
+  ASSERT(2, wide_unsigned(0));
+  ASSERT(3, wide_unsigned(-1));
+  ASSERT(1, wide_ulong(-1));
+  ASSERT(2, wide_ulong(0x8000000000000003UL));
+  ASSERT(0, wide_ulong(0x8000000000000006UL));
+  ASSERT(3, wide_ulong(0));
+  ASSERT(4, wide_ulong(0x7fffffffffffffffUL));
+  ASSERT(11, wide_long_double(0x100000000L, 10));
+  ASSERT(12, wide_long_double(0, 10));
+  ASSERT(13, wide_long_double(-9223372036854775807L - 1, 10));
+  ASSERT(14, wide_long_double(-1, 10));
+  ASSERT(16, wide_long_double(0x200000003L, 10));
+  ASSERT(10, wide_long_double(1, 10));
+  ASSERT(11, wide_table_double(0x100000000L, 10));
+  ASSERT(14, wide_table_double(0x100000004L, 10));
+  ASSERT(10, wide_table_double(0x100000003L, 10));
+  ASSERT(10, wide_table_double(4, 10));
+
+  printf("OK\n");
+  return 0;
+}
@@ -67,6 +67,10 @@ int main() {
 
   ASSERT(3, g3);
 
+  ASSERT(9, ({ int r=0; { int a[4]={1,2,3,4}; r+=a[3]; } { int b[4]={0}; r+=b[3]+5; } r; }));
+  ASSERT(6, ({ int r=0; for (int i=0; i<3; i++) { int a[2]={i}; r+=a[0]+a[1]; } { int b=3; r+=b; } r; }));
+  ASSERT(7, ({ int x=3; { int y=4; { int z=x+y; x=z; } } { char c[8]={0}; x+=c[7]; } x; }));
+
   printf("OK\n");
   return 0;
 }
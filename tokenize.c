@@ -1,16 +1,29 @@
 #include "chibicc.h"
 
 // Input file
-static File *current_file;
+static _Thread_local File *current_file;
 
-// A list of all input files.
-static File **input_files;
+// A list of all input files of the current translation unit.
+static _Thread_local File **input_files;
+static _Thread_local int file_no;
 
 // True if the current position is at the beginning of a line
-static bool at_bol;
+static _Thread_local bool at_bol;
 
 // True if the current position follows a space character
-static bool has_space;
+static _Thread_local bool has_space;
+
+// Tokenized files, keyed by absolute path. Token lists in this cache are
+// never modified, so they can be shared by all translation units
+// compiled in this process. Each user gets its own copy.
+typedef struct {
+  Token *tok;
+  struct stat st;
+} CachedFile;
+
+static HashMap file_cache;
+static StringArray cached_paths;
+static pthread_mutex_t file_cache_lock = PTHREAD_MUTEX_INITIALIZER;
 
 // Reports an error and exit.
 void error(char *fmt, ...) {
@@ -156,7 +169,7 @@ static int read_punct(char *p) {
 }
 
 static bool is_keyword(Token *tok) {
-  static HashMap map;
+  static _Thread_local HashMap map;
 
   if (map.capacity == 0) {
     static char *kw[] = {
@@ -775,7 +788,9 @@ static void convert_universal_chars(char *p) {
   *q = '\0';
 }
 
-Token *tokenize_file(char *path) {
+// Returns the contents of a given file as the tokenizer sees them,
+// or NULL if it can't be read.
+char *read_source(char *path) {
   char *p = read_file(path);
   if (!p)
     return NULL;
@@ -790,10 +805,96 @@ Token *tokenize_file(char *path) {
   canonicalize_newline(p);
   remove_backslash_newline(p);
   convert_universal_chars(p);
+  return p;
+}
 
-  // Save the filename for assembler .file directive.
-  static int file_no;
-  File *file = new_file(path, file_no + 1, p);
+static Token *tokenize_file2(char *path) {
+  char *p = read_source(path);
+  if (!p)
+    return NULL;
+  return tokenize(new_file(path, 0, p));
+}
+
+// Returns a copy of a cached token list that belongs to `file`.
+static Token *copy_file_tokens(Token *tok, File *file) {
+  Token head = {};
+  Token *cur = &head;
+
+  for (; tok; tok = tok->next) {
+    cur = cur->next = calloc(1, sizeof(Token));
+    *cur = *tok;
+    cur->file = file;
+    cur->filename = file->display_name;
+  }
+  return head.next;
+}
+
+// A compile server lives long enough to see files change, so a
+// cache entry is valid only while the file's inode, size and mtime
+// stay the same.
+static bool is_same_file(struct stat *st1, struct stat *st2) {
+  return st1->st_ino == st2->st_ino && st1->st_size == st2->st_size &&
+         st1->st_mtim.tv_sec == st2->st_mtim.tv_sec &&
+         st1->st_mtim.tv_nsec == st2->st_mtim.tv_nsec;
+}
+
+static Token *find_cached_file(char *path, struct stat *st) {
+  pthread_mutex_lock(&file_cache_lock);
+  CachedFile *cf = hashmap_get(&file_cache, path);
+  pthread_mutex_unlock(&file_cache_lock);
+
+  if (cf && is_same_file(&cf->st, st))
+    return cf->tok;
+  return NULL;
+}
+
+static void cache_file(char *path, Token *tok, struct stat *st) {
+  CachedFile *cf = calloc(1, sizeof(CachedFile));
+  cf->tok = tok;
+  cf->st = *st;
+
+  pthread_mutex_lock(&file_cache_lock);
+  if (!hashmap_get(&file_cache, path))
+    strarray_push(&cached_paths, path);
+  hashmap_put(&file_cache, path, cf);
+  pthread_mutex_unlock(&file_cache_lock);
+}
+
+// Returns a cache key for a file. Keys are absolute paths, because
+// a compile server handles requests from different directories.
+static char *file_cache_key(char *path) {
+  if (path[0] == '/')
+    return path;
+
+  char *cwd = getcwd(NULL, 0);
+  if (!cwd)
+    return NULL;
+  char *key = format("%s/%s", cwd, path);
+  free(cwd);
+  return key;
+}
+
+Token *tokenize_file(char *path) {
+  Token *tok = NULL;
+  struct stat st;
+
+  // Standard input can be read only once, so it is never cached.
+  char *key = strcmp(path, "-") ? file_cache_key(path) : NULL;
+  bool cacheable = key && !stat(key, &st);
+  if (cacheable)
+    tok = find_cached_file(key, &st);
+
+  if (!tok) {
+    tok = tokenize_file2(path);
+    if (!tok)
+      return NULL;
+    if (cacheable)
+      cache_file(key, tok, &st);
+  }
+
+  manifest_add_file(path, tok->file->contents);
+
+  File *file = new_file(path, file_no + 1, tok->file->contents);
 
   // Save the filename for assembler .file directive.
   input_files = realloc(input_files, sizeof(char *) * (file_no + 2));
@@ -801,5 +902,48 @@ Token *tokenize_file(char *path) {
   input_files[file_no + 1] = NULL;
   file_no++;
 
-  return tokenize(file);
+  return copy_file_tokens(tok, file);
+}
+
+// Write the list of cached files to `out`, so that another process
+// can fill its own cache with the same files. This is used by the
+// compile server, whose requests are handled by child processes.
+void save_file_cache(FILE *out) {
+  pthread_mutex_lock(&file_cache_lock);
+  for (int i = 0; i < cached_paths.len; i++) {
+    char *path = cached_paths.data[i];
+    CachedFile *cf = hashmap_get(&file_cache, path);
+    fprintf(out, "%ld %ld %ld %ld %s\n", (long)cf->st.st_ino,
+            (long)cf->st.st_size, (long)cf->st.st_mtim.tv_sec,
+            (long)cf->st.st_mtim.tv_nsec, path);
+  }
+  pthread_mutex_unlock(&file_cache_lock);
+}
+
+// Read a list written by save_file_cache() and tokenize the files
+// that are not in the cache yet. A file is tokenized only if it is
+// still the same one the writer tokenized successfully, so that an
+// error in a file being edited doesn't kill the reader.
+void load_file_cache(FILE *in) {
+  char *line = NULL;
+  size_t cap = 0;
+
+  while (getline(&line, &cap, in) != -1) {
+    long ino, size, sec, nsec;
+    int n;
+    if (sscanf(line, "%ld %ld %ld %ld %n", &ino, &size, &sec, &nsec, &n) != 4)
+      continue;
+
+    char *path = strndup(line + n, strcspn(line + n, "\n"));
+    struct stat st;
+    if (stat(path, &st) || st.st_ino != ino || st.st_size != size ||
+        st.st_mtim.tv_sec != sec || st.st_mtim.tv_nsec != nsec ||
+        find_cached_file(path, &st))
+      continue;
+
+    Token *tok = tokenize_file2(path);
+    if (tok)
+      cache_file(path, tok, &st);
+  }
+  free(line);
 }
@@ -303,5 +303,16 @@ void add_type(Node *node) {
       error_tok(node->cas_addr->tok, "pointer expected");
     node->ty = node->lhs->ty->base;
     return;
+  case ND_FENCE:
+    node->ty = ty_void;
+    return;
+  case ND_FETCH_OP:
+    if (node->lhs->ty->kind != TY_PTR)
+      error_tok(node->lhs->tok, "pointer expected");
+    node->ty = node->lhs->ty->base;
+    if (!is_integer(node->ty) && node->ty->kind != TY_PTR)
+      error_tok(node->lhs->tok, "pointer to integer or pointer expected");
+    node->rhs = new_cast(node->rhs, (node->ty->kind == TY_PTR) ? ty_long : node->ty);
+    return;
   }
 }